@@ -3,6 +3,11 @@ os.copyfile("ext/rf/premake5.lua", "ext/rf/rf.lua")
 
 require "ext/rf"
 
+newoption {
+    trigger = "avx",
+    description = "Build for CPUs with AVX, the ocean FFT then works on 8 lines at a time instead of 4"
+}
+
 workspace "Radar"
     language "C++"
     cppdialect "C++11"
@@ -28,6 +33,9 @@ workspace "Radar"
     filter "platforms:Unix"
         buildoptions { "-Wall" }
 
+    filter "options:avx"
+        vectorextensions "AVX"
+
     filter {}
 
 externalproject "glfw3"
@@ -71,4 +79,31 @@ project "radar"
     filter "platforms:Unix"
         links { "openal", "GL", "X11", "dl", "pthread" }
 
-    filter {}
\ No newline at end of file
+    filter {}
+
+-- Headless check of the stream ring buffer under Mesa, see tests/run_stream_buffer_test.sh
+project "stream_buffer_test"
+    kind "ConsoleApp"
+    targetdir "bin/"
+    debugdir "bin/"
+    defines { "GLEW_STATIC" }
+    removeplatforms { "Windows" }
+
+    files { "tests/stream_buffer_test.cpp", "src/stream_buffer.cpp", "src/stream_buffer.h" }
+    includedirs { "src", "ext/rf/include", "ext/rf/ext/glew/include", "ext/rf/ext/glfw/include" }
+
+    libdirs { "ext/rf/lib" }
+
+    filter "configurations:Debug"
+        links { "rf_d", "glfw3_d" }
+
+    filter "configurations:ReleaseDbg"
+        links { "rf_p", "glfw3_p" }
+
+    filter { "configurations:Release" }
+        links { "rf", "glfw3" }
+
+    filter "platforms:Unix"
+        links { "EGL", "GL", "X11", "dl", "pthread" }
+
+    filter {}
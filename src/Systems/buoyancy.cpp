@@ -0,0 +1,332 @@
+#include "buoyancy.h"
+#include "water.h"
+#include "rf/context.h"
+#include "rf/utils.h"
+#include "jobs.h"
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+real32 static const WaterDensity = 1025.f;  // kg/m^3, sea water
+real32 static const Gravity = 9.81f;
+real32 static const LinearDrag = 0.5f;      // 1/s, per kg of displaced water
+real32 static const QuadraticDrag = 1.f;    // 1/m, per kg of displaced water
+int static const MaxSubSteps = 4;           // A late frame drops the time past this many steps
+
+struct buoyancy_step
+{
+    buoyancy::system *System;
+    real32 dTime;
+};
+
+// NOTE - Force on hull point p and its torque around the body center. The submerged fraction of the point's sphere
+// is taken linear in its depth, from 0 with the top at the surface to 1 with the bottom there. Buoyancy pushes the
+// submerged volume up, drag opposes the point velocity with linear and quadratic terms.
+inline void PointForce(buoyancy::system *S, int p)
+{
+    real32 Submerged = Clamp((S->Height[p] - S->WorldY[p] + S->Radius[p]) / (2.f * S->Radius[p]), 0.f, 1.f);
+    real32 SubVolume = Submerged * S->Volume[p];
+    S->SubVolume[p] = SubVolume;
+
+    real32 Vx = S->PointVelX[p], Vy = S->PointVelY[p], Vz = S->PointVelZ[p];
+    real32 Speed = sqrtf(Vx * Vx + Vy * Vy + Vz * Vz);
+    real32 Drag = -WaterDensity * SubVolume * (LinearDrag + QuadraticDrag * Speed);
+
+    real32 Fx = Drag * Vx;
+    real32 Fy = Drag * Vy + WaterDensity * Gravity * SubVolume;
+    real32 Fz = Drag * Vz;
+    S->ForceX[p] = Fx;
+    S->ForceY[p] = Fy;
+    S->ForceZ[p] = Fz;
+    S->TorqueX[p] = S->ArmY[p] * Fz - S->ArmZ[p] * Fy;
+    S->TorqueY[p] = S->ArmZ[p] * Fx - S->ArmX[p] * Fz;
+    S->TorqueZ[p] = S->ArmX[p] * Fy - S->ArmY[p] * Fx;
+}
+
+void PointForces(buoyancy::system *S, int Begin, int End)
+{
+    int p = Begin;
+#if HAVE_SSE2
+    __m128 Zero = _mm_setzero_ps();
+    __m128 One = _mm_set1_ps(1.f);
+    __m128 Half = _mm_set1_ps(0.5f);
+    __m128 Density = _mm_set1_ps(WaterDensity);
+    __m128 Weight = _mm_set1_ps(WaterDensity * Gravity);
+    __m128 Linear = _mm_set1_ps(LinearDrag);
+    __m128 Quadratic = _mm_set1_ps(QuadraticDrag);
+    for(; p + 4 <= End; p += 4)
+    {
+        __m128 Radius = _mm_loadu_ps(S->Radius + p);
+        __m128 Depth = _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(S->Height + p), _mm_loadu_ps(S->WorldY + p)), Radius);
+        __m128 Submerged = _mm_min_ps(_mm_max_ps(_mm_div_ps(_mm_mul_ps(Depth, Half), Radius), Zero), One);
+        __m128 SubVolume = _mm_mul_ps(Submerged, _mm_loadu_ps(S->Volume + p));
+        _mm_storeu_ps(S->SubVolume + p, SubVolume);
+
+        __m128 Vx = _mm_loadu_ps(S->PointVelX + p);
+        __m128 Vy = _mm_loadu_ps(S->PointVelY + p);
+        __m128 Vz = _mm_loadu_ps(S->PointVelZ + p);
+        __m128 Speed = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(Vx, Vx), _mm_mul_ps(Vy, Vy)), _mm_mul_ps(Vz, Vz)));
+        __m128 Drag = _mm_sub_ps(Zero, _mm_mul_ps(_mm_mul_ps(Density, SubVolume), _mm_add_ps(Linear, _mm_mul_ps(Quadratic, Speed))));
+
+        __m128 Fx = _mm_mul_ps(Drag, Vx);
+        __m128 Fy = _mm_add_ps(_mm_mul_ps(Drag, Vy), _mm_mul_ps(Weight, SubVolume));
+        __m128 Fz = _mm_mul_ps(Drag, Vz);
+        _mm_storeu_ps(S->ForceX + p, Fx);
+        _mm_storeu_ps(S->ForceY + p, Fy);
+        _mm_storeu_ps(S->ForceZ + p, Fz);
+
+        __m128 Ax = _mm_loadu_ps(S->ArmX + p);
+        __m128 Ay = _mm_loadu_ps(S->ArmY + p);
+        __m128 Az = _mm_loadu_ps(S->ArmZ + p);
+        _mm_storeu_ps(S->TorqueX + p, _mm_sub_ps(_mm_mul_ps(Ay, Fz), _mm_mul_ps(Az, Fy)));
+        _mm_storeu_ps(S->TorqueY + p, _mm_sub_ps(_mm_mul_ps(Az, Fx), _mm_mul_ps(Ax, Fz)));
+        _mm_storeu_ps(S->TorqueZ + p, _mm_sub_ps(_mm_mul_ps(Ax, Fy), _mm_mul_ps(Ay, Fx)));
+    }
+#endif
+    for(; p < End; ++p)
+    {
+        PointForce(S, p);
+    }
+}
+
+// NOTE - One fixed step of bodies [Begin, End), whose hull points are contiguous : hull points to world, ocean under
+// them, point forces, then semi-implicit Euler on each body.
+void StepBodies(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    buoyancy_step *Job = (buoyancy_step*)UserData;
+    buoyancy::system *S = Job->System;
+    real32 dTime = Job->dTime;
+    int PointBegin = S->FirstPoint[Begin];
+    int PointEnd = S->FirstPoint[End - 1] + S->PointCounts[End - 1];
+
+    for(int b = Begin; b < End; ++b)
+    {
+        real32 W = S->RotW[b], X = S->RotX[b], Y = S->RotY[b], Z = S->RotZ[b];
+        real32 R00 = 1.f - 2.f * (Y * Y + Z * Z), R01 = 2.f * (X * Y - W * Z), R02 = 2.f * (X * Z + W * Y);
+        real32 R10 = 2.f * (X * Y + W * Z), R11 = 1.f - 2.f * (X * X + Z * Z), R12 = 2.f * (Y * Z - W * X);
+        real32 R20 = 2.f * (X * Z - W * Y), R21 = 2.f * (Y * Z + W * X), R22 = 1.f - 2.f * (X * X + Y * Y);
+        real32 Wx = S->AngVelX[b], Wy = S->AngVelY[b], Wz = S->AngVelZ[b];
+
+        int First = S->FirstPoint[b];
+        for(int p = First; p < First + S->PointCounts[b]; ++p)
+        {
+            real32 Lx = S->LocalX[p], Ly = S->LocalY[p], Lz = S->LocalZ[p];
+            real32 Ax = R00 * Lx + R01 * Ly + R02 * Lz;
+            real32 Ay = R10 * Lx + R11 * Ly + R12 * Lz;
+            real32 Az = R20 * Lx + R21 * Ly + R22 * Lz;
+            S->ArmX[p] = Ax;
+            S->ArmY[p] = Ay;
+            S->ArmZ[p] = Az;
+            S->WorldY[p] = S->PosY[b] + Ay;
+            S->Query[p] = vec2f(S->PosX[b] + Ax, S->PosZ[b] + Az);
+            S->PointVelX[p] = S->VelX[b] + Wy * Az - Wz * Ay;
+            S->PointVelY[p] = S->VelY[b] + Wz * Ax - Wx * Az;
+            S->PointVelZ[p] = S->VelZ[b] + Wx * Ay - Wy * Ax;
+        }
+    }
+
+    // NOTE - Calm sea level until the ocean has completed a step
+    if(!water::Sample(PointEnd - PointBegin, S->Query + PointBegin, S->Height + PointBegin, NULL, NULL))
+    {
+        for(int p = PointBegin; p < PointEnd; ++p)
+            S->Height[p] = 0.f;
+    }
+
+    PointForces(S, PointBegin, PointEnd);
+
+    for(int b = Begin; b < End; ++b)
+    {
+        vec3f Force(0.f, 0.f, 0.f), Torque(0.f, 0.f, 0.f);
+        real32 Submerged = 0.f;
+        int First = S->FirstPoint[b];
+        for(int p = First; p < First + S->PointCounts[b]; ++p)
+        {
+            Force += vec3f(S->ForceX[p], S->ForceY[p], S->ForceZ[p]);
+            Torque += vec3f(S->TorqueX[p], S->TorqueY[p], S->TorqueZ[p]);
+            Submerged += S->SubVolume[p];
+        }
+        S->Submerged[b] = Submerged;
+
+        S->VelX[b] += Force.x * S->InvMass[b] * dTime;
+        S->VelY[b] += (Force.y * S->InvMass[b] - Gravity) * dTime;
+        S->VelZ[b] += Force.z * S->InvMass[b] * dTime;
+        S->PosX[b] += S->VelX[b] * dTime;
+        S->PosY[b] += S->VelY[b] * dTime;
+        S->PosZ[b] += S->VelZ[b] * dTime;
+
+        S->AngVelX[b] += Torque.x * S->InvInertia[b] * dTime;
+        S->AngVelY[b] += Torque.y * S->InvInertia[b] * dTime;
+        S->AngVelZ[b] += Torque.z * S->InvInertia[b] * dTime;
+
+        // NOTE - dq/dt = 1/2 (0, w) q, renormalised
+        real32 Wx = S->AngVelX[b], Wy = S->AngVelY[b], Wz = S->AngVelZ[b];
+        real32 W = S->RotW[b], X = S->RotX[b], Y = S->RotY[b], Z = S->RotZ[b];
+        real32 h = 0.5f * dTime;
+        real32 NewW = W + h * (-Wx * X - Wy * Y - Wz * Z);
+        real32 NewX = X + h * (Wx * W + Wy * Z - Wz * Y);
+        real32 NewY = Y + h * (Wy * W + Wz * X - Wx * Z);
+        real32 NewZ = Z + h * (Wz * W + Wx * Y - Wy * X);
+        real32 InvLen = 1.f / sqrtf(NewW * NewW + NewX * NewX + NewY * NewY + NewZ * NewZ);
+        S->RotW[b] = NewW * InvLen;
+        S->RotX[b] = NewX * InvLen;
+        S->RotY[b] = NewY * InvLen;
+        S->RotZ[b] = NewZ * InvLen;
+    }
+}
+
+namespace buoyancy {
+buoyancy::system *BuoyancySystem = NULL;
+
+void Init(rf::context *Context, config const *Config)
+{
+    BuoyancySystem = rf::PoolAlloc<buoyancy::system>(Context->SessionPool, 1);
+    buoyancy::system *S = BuoyancySystem;
+    rf::mem_pool *Pool = Context->SessionPool;
+
+    S->StepTime = 1.f / Max(Config->BuoyancyHz, 1.f);
+    S->Accumulator = 0.0;
+
+    int B = S->BodyCapacity = Max(Config->BuoyancyMaxBodies, 0);
+    S->BodyCount = 0;
+    S->PosX = rf::PoolAlloc<real32>(Pool, B);
+    S->PosY = rf::PoolAlloc<real32>(Pool, B);
+    S->PosZ = rf::PoolAlloc<real32>(Pool, B);
+    S->VelX = rf::PoolAlloc<real32>(Pool, B);
+    S->VelY = rf::PoolAlloc<real32>(Pool, B);
+    S->VelZ = rf::PoolAlloc<real32>(Pool, B);
+    S->AngVelX = rf::PoolAlloc<real32>(Pool, B);
+    S->AngVelY = rf::PoolAlloc<real32>(Pool, B);
+    S->AngVelZ = rf::PoolAlloc<real32>(Pool, B);
+    S->RotW = rf::PoolAlloc<real32>(Pool, B);
+    S->RotX = rf::PoolAlloc<real32>(Pool, B);
+    S->RotY = rf::PoolAlloc<real32>(Pool, B);
+    S->RotZ = rf::PoolAlloc<real32>(Pool, B);
+    S->InvMass = rf::PoolAlloc<real32>(Pool, B);
+    S->InvInertia = rf::PoolAlloc<real32>(Pool, B);
+    S->FirstPoint = rf::PoolAlloc<int>(Pool, B);
+    S->PointCounts = rf::PoolAlloc<int>(Pool, B);
+    S->Extent = rf::PoolAlloc<real32>(Pool, B);
+    S->Submerged = rf::PoolAlloc<real32>(Pool, B);
+    S->Obstacles = rf::PoolAlloc<water::wake_obstacle>(Pool, B);
+
+    int P = S->PointCapacity = Max(Config->BuoyancyMaxHullPoints, 0);
+    S->PointCount = 0;
+    S->LocalX = rf::PoolAlloc<real32>(Pool, P);
+    S->LocalY = rf::PoolAlloc<real32>(Pool, P);
+    S->LocalZ = rf::PoolAlloc<real32>(Pool, P);
+    S->Volume = rf::PoolAlloc<real32>(Pool, P);
+    S->Radius = rf::PoolAlloc<real32>(Pool, P);
+    S->ArmX = rf::PoolAlloc<real32>(Pool, P);
+    S->ArmY = rf::PoolAlloc<real32>(Pool, P);
+    S->ArmZ = rf::PoolAlloc<real32>(Pool, P);
+    S->WorldY = rf::PoolAlloc<real32>(Pool, P);
+    S->PointVelX = rf::PoolAlloc<real32>(Pool, P);
+    S->PointVelY = rf::PoolAlloc<real32>(Pool, P);
+    S->PointVelZ = rf::PoolAlloc<real32>(Pool, P);
+    S->Query = rf::PoolAlloc<vec2f>(Pool, P);
+    S->Height = rf::PoolAlloc<real32>(Pool, P);
+    S->SubVolume = rf::PoolAlloc<real32>(Pool, P);
+    S->ForceX = rf::PoolAlloc<real32>(Pool, P);
+    S->ForceY = rf::PoolAlloc<real32>(Pool, P);
+    S->ForceZ = rf::PoolAlloc<real32>(Pool, P);
+    S->TorqueX = rf::PoolAlloc<real32>(Pool, P);
+    S->TorqueY = rf::PoolAlloc<real32>(Pool, P);
+    S->TorqueZ = rf::PoolAlloc<real32>(Pool, P);
+}
+
+int AddBody(body_desc const *Desc)
+{
+    buoyancy::system *S = BuoyancySystem;
+    if(S->BodyCount == S->BodyCapacity || S->PointCount + Desc->HullPointCount > S->PointCapacity ||
+       Desc->HullPointCount <= 0 || Desc->Mass <= 0.f)
+    {
+        LogError("Can't add a floating body of %d hull points (%d/%d bodies, %d/%d points).", Desc->HullPointCount,
+                 S->BodyCount, S->BodyCapacity, S->PointCount, S->PointCapacity);
+        return -1;
+    }
+
+    int b = S->BodyCount++;
+    S->PosX[b] = Desc->Position.x;
+    S->PosY[b] = Desc->Position.y;
+    S->PosZ[b] = Desc->Position.z;
+    S->VelX[b] = S->VelY[b] = S->VelZ[b] = 0.f;
+    S->AngVelX[b] = S->AngVelY[b] = S->AngVelZ[b] = 0.f;
+    S->RotW[b] = cosf(0.5f * Desc->Yaw);
+    S->RotX[b] = 0.f;
+    S->RotY[b] = sinf(0.5f * Desc->Yaw);
+    S->RotZ[b] = 0.f;
+    S->FirstPoint[b] = S->PointCount;
+    S->PointCounts[b] = Desc->HullPointCount;
+    S->Extent[b] = 0.f;
+    S->Submerged[b] = 0.f;
+
+    // NOTE - Mass spread over the hull points by volume, the inertia tensor averaged over the axes
+    real32 TotalVolume = 0.f, SquaredRadius = 0.f;
+    for(int i = 0; i < Desc->HullPointCount; ++i)
+    {
+        int p = S->PointCount++;
+        vec3f const &L = Desc->HullPoints[i];
+        S->LocalX[p] = L.x;
+        S->LocalY[p] = L.y;
+        S->LocalZ[p] = L.z;
+        S->Volume[p] = Desc->HullVolumes[i];
+        S->Radius[p] = Max(cbrtf(3.f * Desc->HullVolumes[i] / (4.f * (real32)M_PI)), 1e-3f);
+        S->Extent[b] = Max(S->Extent[b], sqrtf(Square(L.x) + Square(L.z)) + S->Radius[p]);
+        TotalVolume += Desc->HullVolumes[i];
+        SquaredRadius += Desc->HullVolumes[i] * Dot(L, L);
+    }
+    real32 Inertia = Desc->Mass * Max((2.f / 3.f) * SquaredRadius / Max(TotalVolume, 1e-6f), 1e-2f);
+    S->InvMass[b] = 1.f / Desc->Mass;
+    S->InvInertia[b] = 1.f / Inertia;
+    return b;
+}
+
+void Update(game::state * /*State*/, rf::input *Input)
+{
+    buoyancy::system *S = BuoyancySystem;
+    S->Accumulator += Input->dTime;
+    if(S->BodyCount == 0)
+    {
+        S->Accumulator = 0.0;
+        return;
+    }
+
+    buoyancy_step Job = {};
+    Job.System = S;
+    Job.dTime = S->StepTime;
+    int Grain = Max(1, S->BodyCount / (4 * jobs::ThreadCount()));
+    for(int Step = 0; Step < MaxSubSteps && S->Accumulator >= S->StepTime; ++Step)
+    {
+        jobs::ParallelFor(S->BodyCount, Grain, StepBodies, &Job);
+        S->Accumulator -= S->StepTime;
+    }
+    S->Accumulator = Min(S->Accumulator, (real64)S->StepTime);
+
+    int ObstacleCount = 0;
+    for(int b = 0; b < S->BodyCount; ++b)
+    {
+        if(S->Submerged[b] <= 0.f)
+            continue;
+        water::wake_obstacle *Obstacle = &S->Obstacles[ObstacleCount++];
+        Obstacle->Position = vec2f(S->PosX[b], S->PosZ[b]);
+        Obstacle->Radius = S->Extent[b];
+        Obstacle->Volume = S->Submerged[b];
+    }
+    water::SetWakeObstacles(ObstacleCount, S->Obstacles);
+}
+
+void Destroy()
+{
+    BuoyancySystem = NULL;
+}
+
+void GetBody(int Body, vec3f *Position, vec3f *Forward, vec3f *Up)
+{
+    buoyancy::system *S = BuoyancySystem;
+    real32 W = S->RotW[Body], X = S->RotX[Body], Y = S->RotY[Body], Z = S->RotZ[Body];
+    *Position = vec3f(S->PosX[Body], S->PosY[Body], S->PosZ[Body]);
+    *Forward = vec3f(2.f * (X * Z + W * Y), 2.f * (Y * Z - W * X), 1.f - 2.f * (X * X + Y * Y));
+    *Up = vec3f(2.f * (X * Y - W * Z), 1.f - 2.f * (X * X + Z * Z), 2.f * (Y * Z + W * X));
+}
+}
@@ -0,0 +1,78 @@
+#ifndef BUOYANCY_H
+#define BUOYANCY_H
+
+#include "definitions.h"
+#include "water_wake.h"
+
+namespace game {
+    struct state;
+}
+
+// NOTE - Rigid bodies floating on the simulated ocean. Each body is a set of hull points, each point standing for a
+// small sphere of the hull volume : the part of it under the surface pushes up by Archimedes and is dragged by
+// the water. Bodies live in the water plane frame (see water::Sample), sea level at y = 0.
+// Every fixed step the bodies are updated in batches over the job threads, each batch looking up the ocean
+// under all its hull points with one water::Sample call, then accumulating forces over the points 4 at a time.
+// The bodies are the obstacles of the ocean wave layer, see water::SetWakeObstacles.
+namespace buoyancy {
+    struct body_desc
+    {
+        vec3f Position;
+        real32 Yaw;                 // Around +Y, radians
+        real32 Mass;                // kg
+        int HullPointCount;
+        vec3f const *HullPoints;    // Body frame, around the center of mass
+        real32 const *HullVolumes;  // m^3 of hull each point stands for
+    };
+
+    struct system
+    {
+        real32 StepTime;        // Fixed step, seconds
+        real64 Accumulator;     // Time not simulated yet
+
+        int BodyCapacity;
+        int BodyCount;
+        int PointCapacity;
+        int PointCount;
+
+        // NOTE - Bodies, SoA
+        real32 *PosX, *PosY, *PosZ;
+        real32 *VelX, *VelY, *VelZ;
+        real32 *AngVelX, *AngVelY, *AngVelZ; // World frame
+        real32 *RotW, *RotX, *RotY, *RotZ;   // Unit quaternion, body to world
+        real32 *InvMass;
+        real32 *InvInertia;                  // Scalar, the hull taken as isotropic
+        int *FirstPoint;                     // Hull points of body i are [FirstPoint[i], FirstPoint[i] + PointCounts[i])
+        int *PointCounts;
+        real32 *Extent;                      // Horizontal radius of the hull
+        real32 *Submerged;                   // Submerged volume at the last step
+        water::wake_obstacle *Obstacles;     // Scratch for SetWakeObstacles
+
+        // NOTE - Hull points, SoA, grouped by body
+        real32 *LocalX, *LocalY, *LocalZ;    // Body frame
+        real32 *Volume;
+        real32 *Radius;                      // Of the sphere of that volume
+
+        // NOTE - Per-step scratch of the hull points
+        real32 *ArmX, *ArmY, *ArmZ;          // World offset from the body center
+        real32 *WorldY;
+        real32 *PointVelX, *PointVelY, *PointVelZ;
+        vec2f *Query;                        // World (x, z), for water::Sample
+        real32 *Height;                      // Ocean surface above the point
+        real32 *SubVolume;                   // Submerged part of the point volume
+        real32 *ForceX, *ForceY, *ForceZ;
+        real32 *TorqueX, *TorqueY, *TorqueZ;
+    };
+
+    void Init(rf::context *Context, config const *Config);
+    void Update(game::state *State, rf::input *Input);
+    void Destroy();
+
+    // Returns the body index, -1 when the body or hull point capacity is exhausted
+    int AddBody(body_desc const *Desc);
+
+    // World position and basis of a body, Forward being its body frame +Z and Up its +Y
+    void GetBody(int Body, vec3f *Position, vec3f *Forward, vec3f *Up);
+}
+
+#endif
@@ -0,0 +1,316 @@
+#include "spray.h"
+#include "rf/context.h"
+#include "rf/utils.h"
+#include "Game/sun.h"
+#include "jobs.h"
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+int static const MaxBreakingPoints = 8192;  // Breaking grid points emitting each frame, the others scale them up
+real32 static const MaxTimeStep = 0.1f;     // A late frame steps the particles this much at most
+int static const StreamCount = 5;           // Rendered arrays, see spray::system
+
+real32 static const SpraySpeed = 5.f;       // m/s, launch speed
+real32 static const SprayLife = 1.5f;
+real32 static const SpraySize = 0.2f;
+real32 static const SprayDrag = 0.5f;
+real32 static const FoamPerSpray = 0.25f;
+real32 static const FoamLife = 4.f;
+real32 static const FoamSize = 1.5f;
+real32 static const FoamDrag = 3.f;
+
+struct spray_step
+{
+    spray::system *System;
+    real32 dTime;
+};
+
+inline real32 Uniform(sfmt::state *Rng)
+{
+    return (sfmt::Next32(Rng) >> 8) * (1.f / 16777216.f);
+}
+
+// NOTE - Particles [Begin, End) move by dTime : gravity, then air drag taken implicit so any step is stable.
+// Fade reaching 1 is death, the particle is removed by the compaction after the step.
+void StepParticles(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    spray_step const *Job = (spray_step const*)UserData;
+    spray::system *S = Job->System;
+    real32 dTime = Job->dTime;
+
+    int p = Begin;
+#if HAVE_SSE2
+    __m128 One = _mm_set1_ps(1.f);
+    __m128 dTime4 = _mm_set1_ps(dTime);
+    for(; p + 4 <= End; p += 4)
+    {
+        __m128 Vx = _mm_loadu_ps(S->VelX + p);
+        __m128 Vy = _mm_sub_ps(_mm_loadu_ps(S->VelY + p), _mm_mul_ps(_mm_loadu_ps(S->Gravity + p), dTime4));
+        __m128 Vz = _mm_loadu_ps(S->VelZ + p);
+        __m128 Damp = _mm_div_ps(One, _mm_add_ps(One, _mm_mul_ps(_mm_loadu_ps(S->Drag + p), dTime4)));
+        Vx = _mm_mul_ps(Vx, Damp);
+        Vy = _mm_mul_ps(Vy, Damp);
+        Vz = _mm_mul_ps(Vz, Damp);
+        _mm_storeu_ps(S->VelX + p, Vx);
+        _mm_storeu_ps(S->VelY + p, Vy);
+        _mm_storeu_ps(S->VelZ + p, Vz);
+        _mm_storeu_ps(S->PosX + p, _mm_add_ps(_mm_loadu_ps(S->PosX + p), _mm_mul_ps(Vx, dTime4)));
+        _mm_storeu_ps(S->PosY + p, _mm_add_ps(_mm_loadu_ps(S->PosY + p), _mm_mul_ps(Vy, dTime4)));
+        _mm_storeu_ps(S->PosZ + p, _mm_add_ps(_mm_loadu_ps(S->PosZ + p), _mm_mul_ps(Vz, dTime4)));
+        _mm_storeu_ps(S->Fade + p, _mm_add_ps(_mm_loadu_ps(S->Fade + p), _mm_mul_ps(_mm_loadu_ps(S->InvLife + p), dTime4)));
+    }
+#endif
+    for(; p < End; ++p)
+    {
+        real32 Vx = S->VelX[p];
+        real32 Vy = S->VelY[p] - S->Gravity[p] * dTime;
+        real32 Vz = S->VelZ[p];
+        real32 Damp = 1.f / (1.f + S->Drag[p] * dTime);
+        Vx *= Damp;
+        Vy *= Damp;
+        Vz *= Damp;
+        S->VelX[p] = Vx;
+        S->VelY[p] = Vy;
+        S->VelZ[p] = Vz;
+        S->PosX[p] += Vx * dTime;
+        S->PosY[p] += Vy * dTime;
+        S->PosZ[p] += Vz * dTime;
+        S->Fade[p] += S->InvLife[p] * dTime;
+    }
+}
+
+void MoveParticle(spray::system *S, int From, int To)
+{
+    S->PosX[To] = S->PosX[From];
+    S->PosY[To] = S->PosY[From];
+    S->PosZ[To] = S->PosZ[From];
+    S->Size[To] = S->Size[From];
+    S->Fade[To] = S->Fade[From];
+    S->VelX[To] = S->VelX[From];
+    S->VelY[To] = S->VelY[From];
+    S->VelZ[To] = S->VelZ[From];
+    S->InvLife[To] = S->InvLife[From];
+    S->Drag[To] = S->Drag[From];
+    S->Gravity[To] = S->Gravity[From];
+}
+
+// NOTE - Each dead particle takes the last one, which is checked in turn. Blocks of 4 alive particles are skipped
+// at once, the work is in the dead ones, about as many as were born a lifetime ago.
+void RemoveDead(spray::system *S)
+{
+    int p = 0;
+#if HAVE_SSE2
+    __m128 One = _mm_set1_ps(1.f);
+#endif
+    while(p < S->Count)
+    {
+#if HAVE_SSE2
+        if(p + 4 <= S->Count && _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(S->Fade + p), One)) == 0xF)
+        {
+            p += 4;
+            continue;
+        }
+#endif
+        if(S->Fade[p] < 1.f)
+        {
+            ++p;
+            continue;
+        }
+        MoveParticle(S, --S->Count, p);
+    }
+}
+
+void Emit(spray::system *S, water::breaking_point const *Point, bool Foam)
+{
+    if(S->Count == S->Capacity)
+        return;
+
+    int p = S->Count++;
+    real32 Cell = sqrtf(Point->Area);
+    S->PosX[p] = Point->Position.x + (Uniform(&S->Rng) - 0.5f) * Cell;
+    S->PosY[p] = Point->Position.y;
+    S->PosZ[p] = Point->Position.z + (Uniform(&S->Rng) - 0.5f) * Cell;
+    S->Fade[p] = 0.f;
+
+    real32 Variation = 0.5f + Uniform(&S->Rng);
+    vec3f const &N = Point->Normal;
+    if(Foam)
+    {
+        // NOTE - Pushed down the crest, the drag stopping them within a meter or two
+        S->VelX[p] = N.x * FoamDrag;
+        S->VelY[p] = 0.f;
+        S->VelZ[p] = N.z * FoamDrag;
+        S->Size[p] = FoamSize * Variation;
+        S->InvLife[p] = 1.f / (FoamLife * Variation);
+        S->Drag[p] = FoamDrag;
+        S->Gravity[p] = 0.f;
+    }
+    else
+    {
+        // NOTE - Between the surface normal and straight up, in a cone around it
+        vec3f Dir = Normalize(vec3f(N.x + Uniform(&S->Rng) - 0.5f, N.y + 1.f, N.z + Uniform(&S->Rng) - 0.5f));
+        real32 Speed = SpraySpeed * Variation;
+        S->VelX[p] = Dir.x * Speed;
+        S->VelY[p] = Dir.y * Speed;
+        S->VelZ[p] = Dir.z * Speed;
+        S->Size[p] = SpraySize * Variation;
+        S->InvLife[p] = 1.f / (SprayLife * Variation);
+        S->Drag[p] = SprayDrag;
+        S->Gravity[p] = g_G;
+    }
+}
+
+namespace spray {
+spray::system *SpraySystem = NULL;
+
+// NOTE - Points the instance attributes at the arrays in the current slot of the stream buffer
+void BindSprayStream(spray::system *S)
+{
+    size_t Offset = stream::Offset(&S->StreamBuffer);
+    glBindVertexArray(S->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, S->StreamBuffer.VBO);
+    for(int k = 0; k < StreamCount; ++k)
+    {
+        glVertexAttribPointer(k, 1, GL_FLOAT, GL_FALSE, sizeof(real32), (void*)(Offset + k * S->Capacity * sizeof(real32)));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
+
+void Init(rf::context *Context, config const *Config)
+{
+    SpraySystem = rf::PoolAlloc<spray::system>(Context->SessionPool, 1);
+    spray::system *S = SpraySystem;
+    rf::mem_pool *Pool = Context->SessionPool;
+
+    int C = S->Capacity = Max(Config->SprayMaxParticles, 0);
+    S->Count = 0;
+    S->Threshold = Config->SprayJacobian;
+    S->Rate = Config->SprayRate;
+
+    S->RenderData = rf::PoolAlloc<real32>(Pool, StreamCount * C);
+    S->PosX = S->RenderData;
+    S->PosY = S->RenderData + C;
+    S->PosZ = S->RenderData + 2 * C;
+    S->Size = S->RenderData + 3 * C;
+    S->Fade = S->RenderData + 4 * C;
+    S->VelX = rf::PoolAlloc<real32>(Pool, C);
+    S->VelY = rf::PoolAlloc<real32>(Pool, C);
+    S->VelZ = rf::PoolAlloc<real32>(Pool, C);
+    S->InvLife = rf::PoolAlloc<real32>(Pool, C);
+    S->Drag = rf::PoolAlloc<real32>(Pool, C);
+    S->Gravity = rf::PoolAlloc<real32>(Pool, C);
+
+    S->BreakingCapacity = MaxBreakingPoints;
+    S->Breaking = rf::PoolAlloc<water::breaking_point>(Pool, S->BreakingCapacity);
+    sfmt::Init(&S->Rng, (uint32)Config->WaterSeed);
+
+    if(C == 0)
+        return;
+    S->VAO = rf::MakeVertexArrayObject();
+    for(int k = 0; k < StreamCount; ++k)
+    {
+        glEnableVertexAttribArray(k);
+        glVertexAttribDivisor(k, 1);
+    }
+    glBindVertexArray(0);
+    stream::Init(&S->StreamBuffer, StreamCount * C * sizeof(real32));
+}
+
+void Update(game::state *State, rf::input *Input)
+{
+    spray::system *S = SpraySystem;
+    if(S->Capacity == 0)
+        return;
+    real32 dTime = Min((real32)Input->dTime, MaxTimeStep);
+
+    if(S->Count > 0)
+    {
+        spray_step Job = {};
+        Job.System = S;
+        Job.dTime = dTime;
+        jobs::ParallelFor(S->Count, Max(256, S->Count / (4 * jobs::ThreadCount())), StepParticles, &Job);
+        RemoveDead(S);
+    }
+
+    // NOTE - Past MaxBreakingPoints, the ones found first emit for all of them. The scan starts on a random row so
+    // that they aren't always the same.
+    vec2f Center(State->Camera.Position.x, State->Camera.Position.z);
+    int Found = water::FindBreaking(S->Threshold, Center, (int)sfmt::Next32(&S->Rng), S->BreakingCapacity, S->Breaking);
+    int Written = Min(Found, S->BreakingCapacity);
+    real32 Scale = Written > 0 ? (real32)Found / Written : 0.f;
+    for(int i = 0; i < Written && S->Count < S->Capacity; ++i)
+    {
+        water::breaking_point const *Point = &S->Breaking[i];
+        real32 Strength = Min(S->Threshold - Point->Jacobian, 1.f);
+        real32 Expected = S->Rate * Strength * Point->Area * dTime * Scale;
+
+        int SprayCount = (int)(Expected + Uniform(&S->Rng));
+        for(int j = 0; j < SprayCount; ++j)
+            Emit(S, Point, false);
+        int FoamCount = (int)(Expected * FoamPerSpray + Uniform(&S->Rng));
+        for(int j = 0; j < FoamCount; ++j)
+            Emit(S, Point, true);
+    }
+
+    if(S->Count == 0)
+        return;
+
+    // NOTE - Only the alive part of each array is copied when the slot maps
+    uint8 *Dst = (uint8*)stream::Map(&S->StreamBuffer);
+    if(Dst)
+    {
+        for(int k = 0; k < StreamCount; ++k)
+        {
+            memcpy(Dst + k * S->Capacity * sizeof(real32), S->RenderData + k * S->Capacity, S->Count * sizeof(real32));
+        }
+        stream::Unmap(&S->StreamBuffer);
+    }
+    else
+    {
+        stream::Write(&S->StreamBuffer, S->RenderData, StreamCount * S->Capacity * sizeof(real32));
+    }
+    BindSprayStream(S);
+}
+
+void Render(game::state *State)
+{
+    spray::system *S = SpraySystem;
+    if(S->Count == 0)
+        return;
+
+    glUseProgram(S->Program);
+    rf::SendMat4(glGetUniformLocation(S->Program, "ViewMatrix"), State->Camera.ViewMatrix);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glDepthMask(GL_FALSE);
+    glBindVertexArray(S->VAO);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, S->Count);
+    glBindVertexArray(0);
+    glDepthMask(GL_TRUE);
+    glDisable(GL_BLEND);
+
+    stream::Fence(&S->StreamBuffer);
+}
+
+void ReloadShaders(rf::context *Context)
+{
+    path VSPath, FSPath;
+
+    rf::ConcatStrings(VSPath, rf::ctx::GetExePath(Context), "data/shaders/spray_vert.glsl");
+    rf::ConcatStrings(FSPath, rf::ctx::GetExePath(Context), "data/shaders/spray_frag.glsl");
+    SpraySystem->Program = rf::BuildShader(Context, VSPath, FSPath);
+    rf::CheckGLError("Spray Shader");
+
+    rf::ctx::RegisterShader3D(Context, SpraySystem->Program);
+}
+
+void Destroy()
+{
+    if(SpraySystem->Capacity > 0)
+        stream::Destroy(&SpraySystem->StreamBuffer);
+    SpraySystem = NULL;
+}
+}
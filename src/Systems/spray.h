@@ -0,0 +1,57 @@
+#ifndef SPRAY_H
+#define SPRAY_H
+
+#include "definitions.h"
+#include "water.h"
+#include "stream_buffer.h"
+#include "sfmt.h"
+
+namespace game {
+    struct state;
+}
+
+// NOTE - Spray and whitecap particles thrown by the breaking waves. Every frame the latest ocean step is scanned
+// for the grid points whose displacement Jacobian is under Config->SprayJacobian (see water::FindBreaking), each
+// emitting particles at a rate growing with how far under it is : fast and short-lived spray thrown along the
+// surface normal, and slow, wide foam flecks settling on the crest.
+// Particles are SoA, stepped 4 at a time over the job threads, and the dead ones are replaced by the last alive
+// ones, so the arrays never move nor grow.
+//
+// Rendering : one instanced draw of a 4 vertex triangle strip, each corner from gl_VertexID, with
+// data/shaders/spray_vert.glsl and spray_frag.glsl. Instance attributes 0 to 4 are single floats, the
+// PosX, PosY, PosZ, Size and Fade arrays, streamed as they are, Fade going from 0 at birth to 1 at death.
+namespace spray {
+    struct system
+    {
+        int Capacity;
+        int Count;
+        real32 Threshold;       // Jacobian under which the waves break
+        real32 Rate;            // Spray particles per second and m^2 of breaking water, Jacobian a unit under Threshold
+
+        // NOTE - Particles, SoA. The rendered arrays are consecutive in RenderData, laid out like a stream slot
+        real32 *RenderData;     // 5 * Capacity
+        real32 *PosX, *PosY, *PosZ;
+        real32 *Size;
+        real32 *Fade;           // Age / lifetime
+        real32 *VelX, *VelY, *VelZ;
+        real32 *InvLife;
+        real32 *Drag;           // 1/s
+        real32 *Gravity;        // m/s^2, 0 for the foam
+
+        int BreakingCapacity;
+        water::breaking_point *Breaking;
+        sfmt::state Rng;
+
+        uint32 VAO;
+        stream::buffer StreamBuffer;
+        uint32 Program;
+    };
+
+    void Init(rf::context *Context, config const *Config);
+    void Update(game::state *State, rf::input *Input);
+    void Render(game::state *State);
+    void ReloadShaders(rf::context *Context);
+    void Destroy();
+}
+
+#endif
@@ -2,6 +2,17 @@
 #include "rf/context.h"
 #include "rf/utils.h"
 #include "Game/sun.h"
+#include "jobs.h"
+#include "sfmt.h"
+#include "water_spectrum.h"
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 // NOTE - Tmp storage here
 // Beaufort Level : WidthScale, WaveScale, Choppiness
@@ -23,181 +34,448 @@ struct wave_vector
     vec3f   N; // Wave Normal
 };
 
-// TODO - Should return a vec2f, with complex having vec2f cast
-// TODO - Use precomputed and better random variables, not rand()
-complex GaussianRandomVariable()
+real32 static const PhillipsAmplitude = 0.00000025f;
+
+// NOTE - Cascade c covers a patch CascadeRatio^c times narrower than the first one. Its band starts at the Nyquist
+// wave number of cascade c-1, N/2 of its modes, N/(2.CascadeRatio) modes of cascade c : the first cascade keeps all
+// the vertex grid resolves, the others only what it can't, which can't be point-sampled on it without aliasing.
+int static const CascadeRatio = 4;
+
+water::cascade MakeCascade(int Cascade, int CascadeCount, int N)
+{
+    water::cascade C = {};
+    C.Ratio = 1;
+    for(int i = 0; i < Cascade; ++i)
+        C.Ratio *= CascadeRatio;
+    C.ModeMin = Cascade > 0 ? N / (2.f * CascadeRatio) : 0.f;
+    C.ModeMax = Cascade < CascadeCount - 1 ? N / 2.f : 1e9f;
+    return C;
+}
+
+// NOTE - The dispersion is quantised to multiples of W0, so the ocean loops every 200s and the phase
+// of every wave vector at time T is one of the exp(i.j.W0.T) (see UpdatePhases)
+real32 static const DispersionW0 = 2.f * M_PI / 200.f;
+
+int ComputeDispersionIndex(real32 Width, int N, int n_prime, int m_prime)
 {
-    float U, V, W;
-    do {
-        U = 2.f * rand()/(real32)RAND_MAX - 1.f;
-        V = 2.f * rand()/(real32)RAND_MAX - 1.f;
-        W = Square(U) + Square(V);
-    } while(W >= 1.f);
-    W = sqrtf((-2.f * logf(W)) / W);
-    return complex(U * W, V * W);
+    real32 Kx = M_PI * (2 * n_prime - N) / Width;
+    real32 Kz = M_PI * (2 * m_prime - N) / Width;
+    return (int)floorf(sqrtf(g_G * sqrtf(Square(Kx) + Square(Kz))) / DispersionW0);
+}
+
+// NOTE - Phase is exp(i.omega.T) for this wave vector
+complex ComputeHTilde(complex H0, complex H0mk, complex Phase)
+{
+    return H0 * Phase + H0mk * Conjugate(Phase);
+}
+
+// NOTE - Blends the h~0 of the two current Beaufort states into the compact N * N cache of each cascade.
+// The sea state only moves on user input, so most steps skip this entirely.
+void UpdateBlendedSpectrum(water::system *WaterSystem, int WaterState, real32 WaterInterp)
+{
+    if(!WaterSystem->BlendDirty && WaterSystem->BlendState == WaterState && WaterSystem->BlendInterp == WaterInterp)
+        return;
+
+    water::beaufort_state *StateA = &WaterSystem->States[WaterState];
+    water::beaufort_state *StateB = &WaterSystem->States[WaterState + 1];
+
+    // NOTE - By Parseval, the variance of a field over the grid is the sum of its squared spectrum, and
+    // |h~(k, t)| <= |h~0(k)| + |h~0*(-k)| at any time. The choppy displacements scale it by Kx/|K| and Kz/|K|.
+    // Only the first cascade is in the vertex stream this bounds.
+    real64 VarH = 0.0, VarX = 0.0, VarZ = 0.0;
+
+    int N = WaterSystem->WaterN;
+    int NPlus1 = N+1;
+    for(int c = 0; c < WaterSystem->CascadeCount; ++c)
+    {
+        water::cascade *Cascade = &WaterSystem->Cascades[c];
+        vec3f *HTilde0A = (vec3f*)StateA->HTilde0[c];
+        vec3f *HTilde0B = (vec3f*)StateB->HTilde0[c];
+        vec3f *HTilde0mkA = (vec3f*)StateA->HTilde0mk[c];
+        vec3f *HTilde0mkB = (vec3f*)StateB->HTilde0mk[c];
+
+        for(int m_prime = 0; m_prime < N; ++m_prime)
+        {
+            real32 Kz = (real32)(2 * m_prime - N);
+            for(int n_prime = 0; n_prime < N; ++n_prime)
+            {
+                int Idx = m_prime * N + n_prime;
+                int Idx1 = m_prime * NPlus1 + n_prime;
+
+                vec3f dHT0 = Lerp(HTilde0A[Idx1], HTilde0B[Idx1], WaterInterp);
+                vec3f dHT0mk = Lerp(HTilde0mkA[Idx1], HTilde0mkB[Idx1], WaterInterp);
+                Cascade->HTilde0Blend[Idx] = complex(dHT0.x, dHT0.y);
+                Cascade->HTilde0mkBlend[Idx] = complex(dHT0mk.x, dHT0mk.y);
+
+                if(c > 0)
+                    continue;
+                real32 Kx = (real32)(2 * n_prime - N);
+                real32 KLen2 = Square(Kx) + Square(Kz);
+                real32 Amp2 = Square(sqrtf(Square(dHT0.x) + Square(dHT0.y)) + sqrtf(Square(dHT0mk.x) + Square(dHT0mk.y)));
+                VarH += Amp2;
+                if(KLen2 > 0.f)
+                {
+                    VarX += Amp2 * Square(Kx) / KLen2;
+                    VarZ += Amp2 * Square(Kz) / KLen2;
+                }
+            }
+        }
+    }
+    WaterSystem->DisplacementSigma = vec3f((real32)sqrt(VarX), (real32)sqrt(VarH), (real32)sqrt(VarZ));
+
+    WaterSystem->BlendState = WaterState;
+    WaterSystem->BlendInterp = WaterInterp;
+    WaterSystem->BlendDirty = false;
 }
 
-real32 Phillips(water::beaufort_state *State, int n_prime, int m_prime)
+// NOTE - Rebuilds the dispersion index of every wave vector of the cascades when the blended width changed
+void UpdateDispersionTable(water::system *WaterSystem, real32 Width)
 {
-    vec2f K(M_PI * (2.f * n_prime - water::system::WaterN) / State->Width,
-            M_PI * (2.f * m_prime - water::system::WaterN) / State->Width);
-    real32 KLen = Length(K);
-    if(KLen < 1e-6f) return 0.f;
+    int N = WaterSystem->WaterN;
+    for(int c = 0; c < WaterSystem->CascadeCount; ++c)
+    {
+        water::cascade *Cascade = &WaterSystem->Cascades[c];
+        real32 CascadeWidth = Width / Cascade->Ratio;
+        if(Cascade->OmegaWidth == CascadeWidth)
+            continue;
 
-    real32 KLen2 = Square(KLen);
-    real32 KLen4 = Square(KLen2);
+        for(int m_prime = 0; m_prime < N; ++m_prime)
+        {
+            for(int n_prime = 0; n_prime < N; ++n_prime)
+            {
+                int OmegaIdx = ComputeDispersionIndex(CascadeWidth, N, n_prime, m_prime);
+                Assert(OmegaIdx < WaterSystem->PhaseCount);
+                Cascade->OmegaIndex[m_prime * N + n_prime] = (uint16)OmegaIdx;
+            }
+        }
+        Cascade->OmegaWidth = CascadeWidth;
+    }
+}
 
-    vec2f UnitK = Normalize(K);
-    vec2f UnitW = Normalize(State->Direction);
-    real32 KDotW = Dot(UnitK, UnitW);
-    real32 KDotW2 = Square(Square(KDotW));
+// NOTE - One sincos per distinct dispersion instead of one per wave vector. Each phase is computed
+// from T directly, so nothing drifts over time.
+void UpdatePhases(water::system *WaterSystem, real32 T)
+{
+    for(int j = 0; j < WaterSystem->PhaseCount; ++j)
+    {
+        real32 OmegaT = (j * DispersionW0) * T;
+        WaterSystem->Phases[j] = complex(cosf(OmegaT), sinf(OmegaT));
+    }
+}
 
-    real32 WLen = Length(State->Direction);
-    real32 L = Square(WLen) / g_G;
-    real32 L2 = Square(L);
+// NOTE - Octahedral normal encoding around +Y, mostly up ocean normals keep most of the precision
+inline real32 SignNotZero(real32 V) { return V >= 0.f ? 1.f : -1.f; }
 
-    real32 Damping = 1e-3f;
-    real32 DampL2 = L2 * Square(Damping);
+vec2f OctEncode(vec3f N)
+{
+    real32 InvL1 = 1.f / (fabsf(N.x) + fabsf(N.y) + fabsf(N.z));
+    vec2f E(N.x * InvL1, N.z * InvL1);
+    if(N.y < 0.f)
+    {
+        E = vec2f((1.f - fabsf(E.y)) * SignNotZero(E.x), (1.f - fabsf(E.x)) * SignNotZero(E.y));
+    }
+    return E;
+}
 
-    return State->Amplitude * (expf(-1.f / (KLen2 * L2)) / KLen4) * KDotW2 * expf(-KLen2 * DampL2);
+vec3f OctDecode(vec2f E)
+{
+    vec3f N(E.x, 1.f - fabsf(E.x) - fabsf(E.y), E.y);
+    if(N.y < 0.f)
+    {
+        N.x = (1.f - fabsf(E.y)) * SignNotZero(E.x);
+        N.z = (1.f - fabsf(E.x)) * SignNotZero(E.y);
+    }
+    return Normalize(N);
 }
 
-real32 ComputeDispersion(real32 Width, int n_prime, int m_prime)
+size_t WaterStreamSize(water::system const *WaterSystem)
 {
-    real32 W0 = 2.f * M_PI / 200.f;
-    real32 Kx = M_PI * (2 * n_prime - water::system::WaterN) / Width;
-    real32 Kz = M_PI * (2 * m_prime - water::system::WaterN) / Width;
-    return floorf(sqrtf(g_G * sqrtf(Square(Kx) + Square(Kz))) / W0) * W0;
+    size_t VertexSize = WaterSystem->CompactVertices ? sizeof(water::compact_vertex) : sizeof(water::vertex);
+    return Square(WaterSystem->WaterN + 1) * VertexSize;
 }
 
-complex ComputeHTilde0(water::beaufort_state *State, int n_prime, int m_prime)
+// NOTE - Points attributes 0 and 1 at the current slot of the stream buffer
+void BindWaterStream(water::system *WaterSystem)
 {
-    complex R = GaussianRandomVariable();
-    return R * sqrtf(Phillips(State, n_prime, m_prime) / 2.0f);
+    size_t Offset = stream::Offset(&WaterSystem->StreamBuffer);
+    glBindVertexArray(WaterSystem->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, WaterSystem->StreamBuffer.VBO);
+    if(WaterSystem->CompactVertices)
+    {
+        size_t Stride = sizeof(water::compact_vertex);
+        glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, Stride, (void*)(Offset + offsetof(water::compact_vertex, Displacement)));
+        glVertexAttribPointer(1, 2, GL_BYTE, GL_TRUE, Stride, (void*)(Offset + offsetof(water::compact_vertex, Normal)));
+    }
+    else
+    {
+        size_t Stride = sizeof(water::vertex);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, Stride, (void*)(Offset + offsetof(water::vertex, Position)));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, Stride, (void*)(Offset + offsetof(water::vertex, Normal)));
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
 }
 
-complex ComputeHTilde(water::beaufort_state *StateA, water::beaufort_state *StateB, real32 WaterInterp, 
-        real32 T, int n_prime, int m_prime)
+// NOTE - Points attribute 3, one offset per instance, at the current slot of the tile buffer
+void BindTileInstances(water::system *WaterSystem)
 {
-    int NPlus1 = water::system::WaterN+1;
-    int Idx = m_prime * NPlus1 + n_prime;
+    size_t Offset = stream::Offset(&WaterSystem->TileBuffer);
+    glBindVertexArray(WaterSystem->VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, WaterSystem->TileBuffer.VBO);
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(vec2f), (void*)Offset);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindVertexArray(0);
+}
 
-    vec3f *HTilde0A = (vec3f*)StateA->HTilde0;
-    vec3f *HTilde0B = (vec3f*)StateB->HTilde0;
-    vec3f *HTilde0mkA = (vec3f*)StateA->HTilde0mk;
-    vec3f *HTilde0mkB = (vec3f*)StateB->HTilde0mk;
+// NOTE - Next slot of the vertex stream, write-only. NULL if the driver refuses the mapping,
+// the caller then builds the stream on the CPU and hands it to UpdateWaterMesh.
+void *MapWaterMesh(water::system *WaterSystem)
+{
+    return stream::Map(&WaterSystem->StreamBuffer);
+}
 
-    vec3f dHT0 = Lerp(HTilde0A[Idx], HTilde0B[Idx], WaterInterp);
-    vec3f dHT0mk = Lerp(HTilde0mkA[Idx], HTilde0mkB[Idx], WaterInterp);
-    real32 dWidth = Lerp((real32)StateA->Width, (real32)StateB->Width, WaterInterp);
-    
-    complex H0(dHT0.x, dHT0.y);
-    complex H0mk(dHT0mk.x, dHT0mk.y);
+void UnmapWaterMesh(water::system *WaterSystem)
+{
+    stream::Unmap(&WaterSystem->StreamBuffer);
+    BindWaterStream(WaterSystem);
+}
 
-    real32 OmegaT = ComputeDispersion(dWidth, n_prime, m_prime) * T;
-    real32 CosOT = cosf(OmegaT);
-    real32 SinOT = sinf(OmegaT);
+// NOTE - Copy into the slot MapWaterMesh failed to map
+void UpdateWaterMesh(water::system *WaterSystem, void const *Data)
+{
+    stream::Write(&WaterSystem->StreamBuffer, Data, WaterStreamSize(WaterSystem));
+    BindWaterStream(WaterSystem);
+}
 
-    complex C0(CosOT, SinOT);
-    complex C1(CosOT, -SinOT);
+// NOTE - Copy of a stream built elsewhere into the next slot
+void UploadWaterMesh(water::system *WaterSystem, void const *Data)
+{
+    stream::Upload(&WaterSystem->StreamBuffer, Data, WaterStreamSize(WaterSystem));
+    BindWaterStream(WaterSystem);
+}
 
-    return H0 * C0 + H0mk * C1;
+// NOTE - One of the output textures, RGBA16F with room for the whole mip chain, see water::texture_mips.
+// A 2D texture, or an array of Layers of them for the detail cascades.
+uint32 MakeWaterTexture(int N, int Levels, int Layers)
+{
+    GLenum Target = Layers > 0 ? GL_TEXTURE_2D_ARRAY : GL_TEXTURE_2D;
+    uint32 Texture;
+    glGenTextures(1, &Texture);
+    glBindTexture(Target, Texture);
+    for(int Level = 0; Level < Levels; ++Level)
+    {
+        if(Layers > 0)
+            glTexImage3D(Target, Level, GL_RGBA16F, N >> Level, N >> Level, Layers, 0, GL_RGBA, GL_FLOAT, NULL);
+        else
+            glTexImage2D(Target, Level, GL_RGBA16F, N >> Level, N >> Level, 0, GL_RGBA, GL_FLOAT, NULL);
+    }
+    glTexParameteri(Target, GL_TEXTURE_MAX_LEVEL, Levels - 1);
+    glTexParameteri(Target, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(Target, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(Target, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(Target, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glBindTexture(Target, 0);
+    return Texture;
 }
 
-uint32 FFTReverse(uint32 i, int Log2N)
+// NOTE - Every level of a texture output built on the CPU, no glGenerateMipmap
+void UploadWaterTextures(water::system *WaterSystem, water::texture_mips const *Textures)
 {
-    uint32 Res = 0;
-    for(int j = 0; j < Log2N; ++j)
+    int N = WaterSystem->WaterN;
+    glBindTexture(GL_TEXTURE_2D, WaterSystem->DisplacementMap);
+    for(int Level = 0; Level < WaterSystem->TextureLevels; ++Level)
+        glTexSubImage2D(GL_TEXTURE_2D, Level, 0, 0, N >> Level, N >> Level, GL_RGBA, GL_FLOAT, Textures->Displacement[0][Level]);
+    glBindTexture(GL_TEXTURE_2D, WaterSystem->SlopeMap);
+    for(int Level = 0; Level < WaterSystem->TextureLevels; ++Level)
+        glTexSubImage2D(GL_TEXTURE_2D, Level, 0, 0, N >> Level, N >> Level, GL_RGBA, GL_FLOAT, Textures->Slope[0][Level]);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    if(Textures->Layers < 2)
+        return;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, WaterSystem->DetailDisplacementMap);
+    for(int Layer = 1; Layer < Textures->Layers; ++Layer)
     {
-        Res = (Res << 1) + (i & 1);
-        i >>= 1;
+        for(int Level = 0; Level < WaterSystem->TextureLevels; ++Level)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, Level, 0, 0, Layer - 1, N >> Level, N >> Level, 1, GL_RGBA, GL_FLOAT,
+                            Textures->Displacement[Layer][Level]);
     }
-    return Res;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, WaterSystem->DetailSlopeMap);
+    for(int Layer = 1; Layer < Textures->Layers; ++Layer)
+    {
+        for(int Level = 0; Level < WaterSystem->TextureLevels; ++Level)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, Level, 0, 0, Layer - 1, N >> Level, N >> Level, 1, GL_RGBA, GL_FLOAT,
+                            Textures->Slope[Layer][Level]);
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+// NOTE - Displacements of the compact stream saturate past CompactPeakFactor standard deviations,
+// a few samples at most for a gaussian sea
+real32 static const CompactPeakFactor = 6.f;
+
+vec3f CompactDisplacementScale(vec3f Sigma)
+{
+    return vec3f(Max(Sigma.x * CompactPeakFactor, 1e-6f), Max(Sigma.y * CompactPeakFactor, 1e-6f), Max(Sigma.z * CompactPeakFactor, 1e-6f));
 }
 
-complex FFTW(uint32 X, uint32 N)
+inline int16 QuantizeSnorm16(real32 V)
 {
-    float V = M_TWO_PI * X / N;
-    return complex(cosf(V), sinf(V));
+    return (int16)floorf(Clamp(V, -32767.f, 32767.f) + 0.5f);
 }
 
-void FFTEvaluate(water::system *WS, complex *Input, complex *Output, int Stride, int Offset, int N)
+// NOTE - Displacement D from the implicit grid, InvScale being 32767 / DisplacementScale
+void StoreCompactVertex(vec3f const &D, vec3f const &Normal, vec3f const &InvScale, water::compact_vertex *Out)
 {
-    for(int i = 0; i < N; ++i)
-        WS->FFTC[WS->Switch][i] = Input[WS->Reversed[i] * Stride + Offset];
+    Out->Displacement[0] = QuantizeSnorm16(D.x * InvScale.x);
+    Out->Displacement[1] = QuantizeSnorm16(D.y * InvScale.y);
+    Out->Displacement[2] = QuantizeSnorm16(D.z * InvScale.z);
+
+    vec2f E = OctEncode(Normal);
+    Out->Normal[0] = (int8)floorf(E.x * 127.f + 0.5f);
+    Out->Normal[1] = (int8)floorf(E.y * 127.f + 0.5f);
+}
 
-    int Loops = N >> 1;
-    int Size = 2;
-    int SizeOver2 = 1;
-    int W_ = 0;
-    for(int j = 1; j <= WS->Log2N; ++j)
+// NOTE - Flat ocean, all levels of both textures of all layers in one zeroed block
+void AllocTextureMips(water::texture_mips *Textures, rf::mem_pool *Pool, int N, int Levels, int Layers)
+{
+    size_t Texels = 0;
+    for(int Level = 0; Level < Levels; ++Level)
+        Texels += Square((size_t)(N >> Level));
+    real32 *Data = rf::PoolAlloc<real32>(Pool, 8 * Texels * Layers);
+    memset(Data, 0, 8 * Texels * Layers * sizeof(real32));
+    Textures->Layers = Layers;
+    for(int Layer = 0; Layer < Layers; ++Layer)
     {
-        WS->Switch ^= 1;
-        for(int i = 0; i < Loops; ++i)
+        for(int Level = 0; Level < Levels; ++Level)
         {
-            complex *FFTCDst = WS->FFTC[WS->Switch];
-            complex *FFTCSrc = WS->FFTC[WS->Switch^1];
-            for(int k = 0; k < SizeOver2; ++k)
-            {
-                FFTCDst[Size * i + k] = FFTCSrc[Size * i + k] +
-                                        FFTCSrc[Size * i + SizeOver2 + k] * WS->FFTW[W_][k];
-            }
-            for(int k = SizeOver2; k < Size; ++k)
-            {
-                FFTCDst[Size * i + k] = FFTCSrc[Size * i - SizeOver2 + k] -
-                                        FFTCSrc[Size * i + k] * WS->FFTW[W_][k - SizeOver2];
-            }
+            size_t Floats = 4 * Square((size_t)(N >> Level));
+            Textures->Displacement[Layer][Level] = Data;
+            Textures->Slope[Layer][Level] = Data + Floats;
+            Data += 2 * Floats;
         }
-        Loops >>= 1;
-        Size <<= 1;
-        SizeOver2 <<= 1;
-        W_++;
     }
+}
 
-    for(int i = 0; i < N; ++i)
-        Output[i * Stride + Offset] = WS->FFTC[WS->Switch][i];
+// NOTE - Texel Idx of level 0 of a layer of the texture output, see water::texture_mips
+inline void StoreTexel(water::texture_mips *Textures, int Layer, int Idx, real32 DispX, real32 Height, real32 DispZ,
+                       real32 SlopeX, real32 SlopeZ)
+{
+    real32 *D = Textures->Displacement[Layer][0] + 4 * Idx;
+    real32 *S = Textures->Slope[Layer][0] + 4 * Idx;
+    D[0] = DispX;
+    D[1] = Height;
+    D[2] = DispZ;
+    D[3] = SlopeX * SlopeZ;
+    S[0] = SlopeX;
+    S[1] = SlopeZ;
+    S[2] = SlopeX * SlopeX;
+    S[3] = SlopeZ * SlopeZ;
 }
 
-void UpdateWaterMesh(water::system *WaterSystem)
+// NOTE - Row Row of a mip level Width texels wide, from the two rows under it in the finer level
+void DownsampleTexelRow(real32 const *Src, real32 *Dst, int Width, int Row)
 {
-    glBindVertexArray(WaterSystem->VAO);
-    size_t VertSize = WaterSystem->VertexCount * sizeof(real32);
-    rf::UpdateVBO(WaterSystem->VBO[1], 0, VertSize, WaterSystem->VertexData);
-    rf::UpdateVBO(WaterSystem->VBO[1], VertSize, VertSize, WaterSystem->VertexData + WaterSystem->VertexCount);
+    real32 const *A = Src + 8 * (size_t)(2 * Row) * Width;
+    real32 const *B = A + 8 * Width;
+    real32 *Out = Dst + 4 * (size_t)Row * Width;
+    int i = 0;
+#if HAVE_SSE2
+    // NOTE - A texel is one register, the 4 channels filter at once
+    __m128 Quarter = _mm_set1_ps(0.25f);
+    for(; i < Width; ++i)
+    {
+        __m128 Top = _mm_add_ps(_mm_loadu_ps(A + 8 * i), _mm_loadu_ps(A + 8 * i + 4));
+        __m128 Bottom = _mm_add_ps(_mm_loadu_ps(B + 8 * i), _mm_loadu_ps(B + 8 * i + 4));
+        _mm_storeu_ps(Out + 4 * i, _mm_mul_ps(_mm_add_ps(Top, Bottom), Quarter));
+    }
+#endif
+    for(; i < Width; ++i)
+    {
+        for(int c = 0; c < 4; ++c)
+            Out[4 * i + c] = ((A[8 * i + c] + A[8 * i + 4 + c]) + (B[8 * i + c] + B[8 * i + 4 + c])) * 0.25f;
+    }
+}
 
-    glBindVertexArray(0);
+// NOTE - Levels FirstLevel and up of a layer of the texture output above rows [Begin, End) of level 0, as long as
+// both stay multiples of the texel size of the level. The row jobs build what lies over their own rows right after
+// writing them, while they are still in cache, see TextureRowGrain.
+void BuildTextureMips(water::texture_mips *Textures, int Layer, int N, int Levels, int FirstLevel, int Begin, int End)
+{
+    for(int Level = FirstLevel; Level < Levels; ++Level)
+    {
+        int Mask = (1 << Level) - 1;
+        if((Begin & Mask) || (End & Mask))
+            break;
+        int Width = N >> Level;
+        for(int Row = Begin >> Level; Row < End >> Level; ++Row)
+        {
+            DownsampleTexelRow(Textures->Displacement[Layer][Level - 1], Textures->Displacement[Layer][Level], Width, Row);
+            DownsampleTexelRow(Textures->Slope[Layer][Level - 1], Textures->Slope[Layer][Level], Width, Row);
+        }
+    }
 }
 
-void WaterBeaufortStateInitialize(water::system *WaterSystem, uint32 State)
+// NOTE - Grain of the row jobs over the N+1 output rows, a power of two so that every job but the one of the seam
+// row covers whole texels of the first levels
+int TextureRowGrain(int N)
 {
-    water::beaufort_state *WaterState = &WaterSystem->States[State];
-    int N = water::system::WaterN;
-    int NPlus1 = N+1;
+    int Grain = 1;
+    while(2 * Grain <= N / (4 * jobs::ThreadCount()))
+        Grain *= 2;
+    return Grain;
+}
 
-    WaterState->Width = (int)BeaufortParams[State][0] * water::system::WaterN;
-    WaterState->Direction = vec2f(BeaufortParams[State][1] * water::system::WaterN, 0.0f);
-    WaterState->Amplitude = 0.00000025f * BeaufortParams[State][2] * water::system::WaterN;
+// NOTE - Levels coarser than the rows of one job, once they all are done, on every layer
+void FinishTextureMips(water::texture_mips *Textures, int N, int Levels, int Grain)
+{
+    int FirstLevel = 1;
+    while((1 << FirstLevel) <= Grain)
+        ++FirstLevel;
+    for(int Layer = 0; Layer < Textures->Layers; ++Layer)
+        BuildTextureMips(Textures, Layer, N, Levels, FirstLevel, 0, N);
+}
 
-    size_t BaseOffset = 2 * WaterSystem->VertexCount;
-    WaterState->OrigPositions = WaterSystem->VertexData + BaseOffset + (State * 3 + 0) * WaterSystem->VertexCount;
-    WaterState->HTilde0 = WaterSystem->VertexData + BaseOffset + (State * 3 + 1) * WaterSystem->VertexCount;
-    WaterState->HTilde0mk = WaterSystem->VertexData + BaseOffset + (State * 3 + 2) * WaterSystem->VertexCount;
+struct beaufort_init
+{
+    water::system *WaterSystem;
+    water::beaufort_state *WaterState;
+    int Cascade;
+    water::phillips_params Phillips;
+    real32 const *Gaussians; // 4 per texel, for h~0(k) and h~0(-k)
+};
+
+void WaterBeaufortStateRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    beaufort_init *Job = (beaufort_init*)UserData;
+    water::beaufort_state *WaterState = Job->WaterState;
+    int N = Job->WaterSystem->WaterN;
+    int NPlus1 = N+1;
+
+    vec3f *OrigPositions = Job->Cascade == 0 ? (vec3f*)WaterState->OrigPositions : NULL;
+    vec3f *HTilde0 = (vec3f*)WaterState->HTilde0[Job->Cascade];
+    vec3f *HTilde0mk = (vec3f*)WaterState->HTilde0mk[Job->Cascade];
 
-    vec3f *OrigPositions = (vec3f*)WaterState->OrigPositions;
-    vec3f *HTilde0 = (vec3f*)WaterState->HTilde0;
-    vec3f *HTilde0mk = (vec3f*)WaterState->HTilde0mk;
+    real32 P[water::FFTMaxSize + 1];
+    real32 Pmk[water::FFTMaxSize + 1];
 
-    for(int m_prime = 0; m_prime < NPlus1; m_prime++)
+    for(int m_prime = Begin; m_prime < End; m_prime++)
     {
+        water::PhillipsRow(&Job->Phillips, N, m_prime, 1, P);
+        water::PhillipsRow(&Job->Phillips, N, m_prime, -1, Pmk);
+
         for(int n_prime = 0; n_prime < NPlus1; n_prime++)
         {
             int Idx = m_prime * NPlus1 + n_prime;
-            complex H0 = ComputeHTilde0(WaterState, n_prime, m_prime);
-            complex H0mk = Conjugate(ComputeHTilde0(WaterState, -n_prime, -m_prime));
+            real32 const *G = Job->Gaussians + 4 * Idx;
+            complex H0 = complex(G[0], G[1]) * sqrtf(P[n_prime] / 2.0f);
+            complex H0mk = Conjugate(complex(G[2], G[3]) * sqrtf(Pmk[n_prime] / 2.0f));
 
-            OrigPositions[Idx].x = (n_prime - N / 2.0f) * WaterState->Width / N;
-            OrigPositions[Idx].y = 0.f;
-            OrigPositions[Idx].z = (m_prime - N / 2.0f) * WaterState->Width / N;
+            if(OrigPositions)
+            {
+                OrigPositions[Idx].x = (n_prime - N / 2.0f) * WaterState->Width / N;
+                OrigPositions[Idx].y = 0.f;
+                OrigPositions[Idx].z = (m_prime - N / 2.0f) * WaterState->Width / N;
+            }
 
             HTilde0[Idx].x = H0.r;
             HTilde0[Idx].y = H0.i;
@@ -207,152 +485,328 @@ void WaterBeaufortStateInitialize(water::system *WaterSystem, uint32 State)
     }
 }
 
-namespace water {
-water::system *WaterSystem = NULL;
-rf::mesh ScreenQuad = {};
+// NOTE - h~0 and h~0* of every state for the cascades past the first, in the layout of VertexData
+size_t CascadeDataCount(water::system const *WaterSystem)
+{
+    return water::system::BeaufortStateCount * (WaterSystem->CascadeCount - 1) * 2 * WaterSystem->VertexCount;
+}
 
-void Init(game::state * /*State*/, rf::context *Context, uint32 /*BeaufortState*/)
+void WaterBeaufortStateSetup(water::system *WaterSystem, uint32 State)
 {
-    ScreenQuad = rf::Make2DQuad(Context, vec2i(-1,1), vec2i(1, -1), 5);
-    WaterSystem = rf::PoolAlloc<water::system>(Context->SessionPool, 1);
-#if 0
-    int N = water::system::WaterN;
-    int NPlus1 = N+1;
+    water::beaufort_state *WaterState = &WaterSystem->States[State];
+    int N = WaterSystem->WaterN;
 
+    WaterState->Width = (int)BeaufortParams[State][0] * N;
+    WaterState->Direction = vec2f(BeaufortParams[State][1] * N, 0.0f);
+    WaterState->Amplitude = PhillipsAmplitude * BeaufortParams[State][2] * N;
 
-    size_t WaterStateAttribs = 3 * sizeof(vec3f); // hTilde0, hTilde0mk, OrigPos
-    size_t WaterAttribs = 2 * sizeof(vec3f); // Pos, Norm
-    size_t WaterVertexDataSize = Square(NPlus1) * (WaterAttribs + water::system::BeaufortStateCount * WaterStateAttribs);
-    size_t WaterVertexCount = 3 * Square(NPlus1); // 3 floats per attrib
-    real32 *WaterVertexData = (real32*)PushArenaData(Context->SessionArena, WaterVertexDataSize);
+    size_t BaseOffset = 2 * WaterSystem->VertexCount;
+    WaterState->OrigPositions = WaterSystem->VertexData + BaseOffset + (State * 3 + 0) * WaterSystem->VertexCount;
+    WaterState->HTilde0[0] = WaterSystem->VertexData + BaseOffset + (State * 3 + 1) * WaterSystem->VertexCount;
+    WaterState->HTilde0mk[0] = WaterSystem->VertexData + BaseOffset + (State * 3 + 2) * WaterSystem->VertexCount;
+
+    // NOTE - The other cascades have the same layout, in CascadeData
+    for(int c = 1; c < WaterSystem->CascadeCount; ++c)
+    {
+        size_t Offset = ((State * (WaterSystem->CascadeCount - 1) + c - 1) * 2) * WaterSystem->VertexCount;
+        WaterState->HTilde0[c] = WaterSystem->CascadeData + Offset;
+        WaterState->HTilde0mk[c] = WaterSystem->CascadeData + Offset + WaterSystem->VertexCount;
+    }
+}
 
-    size_t WaterIndexDataSize = Square(N) * 6 * sizeof(uint32);
-    uint32 *WaterIndexData = (uint32*)PushArenaData(Context->SessionArena, WaterIndexDataSize);
+// NOTE - Each state and cascade draws its Gaussians from its own SFMT stream, seeded with a hash of the seed, state
+// and cascade (see SpectrumSeed), so a given seed always gives the same spectra whatever the thread count
+void WaterBeaufortStateGenerate(water::system *WaterSystem, uint32 State, uint32 Seed, rf::mem_pool *ScratchPool)
+{
+    water::beaufort_state *WaterState = &WaterSystem->States[State];
+    int NPlus1 = WaterSystem->WaterN + 1;
 
+    int GaussianCount = 4 * Square(NPlus1);
+    real32 *Gaussians = rf::PoolAlloc<real32>(ScratchPool, GaussianCount);
 
-    WaterSystem->VertexDataSize = WaterVertexDataSize;
-    WaterSystem->VertexCount = WaterVertexCount;
-    WaterSystem->VertexData = WaterVertexData;
-    WaterSystem->IndexDataSize = WaterIndexDataSize;
-    WaterSystem->IndexData = WaterIndexData;
-    WaterSystem->Positions = WaterSystem->VertexData;
-    WaterSystem->Normals = WaterSystem->VertexData + WaterVertexCount;
-
-    WaterSystem->hTilde = (complex*)PushArenaData(Context->SessionArena, N * N * sizeof(complex));
-    WaterSystem->hTildeSlopeX = (complex*)PushArenaData(Context->SessionArena, N * N * sizeof(complex));
-    WaterSystem->hTildeSlopeZ = (complex*)PushArenaData(Context->SessionArena, N * N * sizeof(complex));
-    WaterSystem->hTildeDX = (complex*)PushArenaData(Context->SessionArena, N * N * sizeof(complex));
-    WaterSystem->hTildeDZ = (complex*)PushArenaData(Context->SessionArena, N * N * sizeof(complex));
-
-    WaterSystem->Switch = 0;
-    WaterSystem->Log2N = log(N) / log(2);
-    WaterSystem->FFTC[0] = (complex*)PushArenaData(Context->SessionArena, N * sizeof(complex));
-    WaterSystem->FFTC[1] = (complex*)PushArenaData(Context->SessionArena, N * sizeof(complex));
-    WaterSystem->Reversed = (uint32*)PushArenaData(Context->SessionArena, N * sizeof(uint32));
-    for(int i = 0; i < N; ++i)
-    {
-        WaterSystem->Reversed[i] = FFTReverse(i, WaterSystem->Log2N);
-    }
-    WaterSystem->FFTW = (complex**)PushArenaData(Context->SessionArena, WaterSystem->Log2N * sizeof(complex*));
-    int Pow2 = 1;
-    for(int j = 0; j < WaterSystem->Log2N; ++j)
-    {
-        WaterSystem->FFTW[j] = (complex*)PushArenaData(Context->SessionArena, Pow2 * sizeof(complex));
-        for(int i = 0; i < Pow2; ++i)
-            WaterSystem->FFTW[j][i] = FFTW(i, 2 * Pow2);
-        Pow2 *=2;
-    }
-    
-    for(uint32 i = 0; i < water::system::BeaufortStateCount; ++i)
+    for(int c = 0; c < WaterSystem->CascadeCount; ++c)
     {
-        WaterBeaufortStateInitialize(WaterSystem, i);
+        sfmt::state Rng;
+        sfmt::Init(&Rng, water::SpectrumSeed(Seed, State, c));
+        sfmt::FillNormal(&Rng, Gaussians, GaussianCount);
+
+        beaufort_init Job;
+        Job.WaterSystem = WaterSystem;
+        Job.WaterState = WaterState;
+        Job.Cascade = c;
+        Job.Phillips = water::MakePhillipsParams(WaterState, &WaterSystem->Cascades[c]);
+        Job.Gaussians = Gaussians;
+        jobs::ParallelFor(NPlus1, Max(1, NPlus1 / (4 * jobs::ThreadCount())), WaterBeaufortStateRows, &Job);
     }
+}
+
+// NOTE - On-disk cache of the generated part of the Beaufort states (OrigPositions, HTilde0, HTilde0mk), stored
+// as the raw bytes of their region of VertexData followed by CascadeData. The header holds everything that data
+// is generated from : any difference, or a version bump when the generation code changes, makes the file stale.
+uint32 static const SpectraCacheMagic = 0x53415752; // "RWAS"
+uint32 static const SpectraCacheVersion = 4;
+
+struct spectra_cache_header
+{
+    uint32 Magic;
+    uint32 Version;
+    int32  N;
+    uint32 Seed;
+    real32 BeaufortParams[water::system::BeaufortStateCount][3];
+    real32 PhillipsAmplitude;
+    real32 PhillipsDamping;
+    real32 Gravity;
+    int32  CascadeCount;
+    int32  CascadeRatio;
+    uint64 DataSize;        // VertexData part
+    uint64 CascadeDataSize;
+};
+
+void MakeSpectraCacheHeader(spectra_cache_header *Header, water::system *WaterSystem, uint32 Seed)
+{
+    memset(Header, 0, sizeof(*Header)); // Padding included, headers are compared bytewise
+    Header->Magic = SpectraCacheMagic;
+    Header->Version = SpectraCacheVersion;
+    Header->N = WaterSystem->WaterN;
+    Header->Seed = Seed;
+    memcpy(Header->BeaufortParams, BeaufortParams, sizeof(Header->BeaufortParams));
+    Header->PhillipsAmplitude = PhillipsAmplitude;
+    Header->PhillipsDamping = water::PhillipsDamping;
+    Header->Gravity = g_G;
+    Header->CascadeCount = WaterSystem->CascadeCount;
+    Header->CascadeRatio = CascadeRatio;
+    Header->DataSize = water::system::BeaufortStateCount * 3 * WaterSystem->VertexCount * sizeof(real32);
+    Header->CascadeDataSize = CascadeDataCount(WaterSystem) * sizeof(real32);
+}
+
+void GetSpectraCachePath(path Out, rf::context *Context, int N, int CascadeCount)
+{
+    path Filename;
+    snprintf(Filename, MAX_PATH, "water_spectra_%d_%d.cache", N, CascadeCount);
+    rf::ConcatStrings(Out, rf::ctx::GetExePath(Context), Filename);
+}
 
-    vec3f *Positions = (vec3f*)WaterSystem->Positions;
-    vec3f *Normals = (vec3f*)WaterSystem->Normals;
-    uint32 *Indices = (uint32*)WaterSystem->IndexData;
+// NOTE - Reads the cached states straight into their VertexData region
+bool LoadSpectraCache(water::system *WaterSystem, rf::context *Context, spectra_cache_header const *Key)
+{
+    path CachePath;
+    GetSpectraCachePath(CachePath, Context, Key->N, Key->CascadeCount);
+    FILE *File = fopen(CachePath, "rb");
+    if(!File)
+        return false;
+
+    spectra_cache_header Header;
+    real32 *Data = WaterSystem->VertexData + 2 * WaterSystem->VertexCount;
+    bool Valid = fread(&Header, sizeof(Header), 1, File) == 1 &&
+                 memcmp(&Header, Key, sizeof(Header)) == 0 &&
+                 fread(Data, 1, Key->DataSize, File) == Key->DataSize &&
+                 fread(WaterSystem->CascadeData, 1, Key->CascadeDataSize, File) == Key->CascadeDataSize;
+    fclose(File);
+
+    if(!Valid)
+        LogInfo("Water spectra cache %s is stale, regenerating.", CachePath);
+    return Valid;
+}
 
-    vec3f *OrigPositions = (vec3f*)WaterSystem->States[BeaufortState].OrigPositions;
-    for(int m_prime = 0; m_prime < NPlus1; m_prime++)
+void SaveSpectraCache(water::system *WaterSystem, rf::context *Context, spectra_cache_header const *Key)
+{
+    path CachePath;
+    GetSpectraCachePath(CachePath, Context, Key->N, Key->CascadeCount);
+    FILE *File = fopen(CachePath, "wb");
+    if(!File)
     {
-        for(int n_prime = 0; n_prime < NPlus1; n_prime++)
-        {
-            int Idx = m_prime * NPlus1 + n_prime;
-            Positions[Idx].x = OrigPositions[Idx].x;
-            Positions[Idx].y = OrigPositions[Idx].y;
-            Positions[Idx].z = OrigPositions[Idx].z;
+        LogError("Can't write water spectra cache %s.", CachePath);
+        return;
+    }
 
-            Normals[Idx] = vec3f(0, 1, 0);
-        }
+    real32 const *Data = WaterSystem->VertexData + 2 * WaterSystem->VertexCount;
+    bool Written = fwrite(Key, sizeof(*Key), 1, File) == 1 &&
+                   fwrite(Data, 1, Key->DataSize, File) == Key->DataSize &&
+                   fwrite(WaterSystem->CascadeData, 1, Key->CascadeDataSize, File) == Key->CascadeDataSize;
+    fclose(File);
+
+    if(!Written)
+    {
+        LogError("Error writing water spectra cache %s.", CachePath);
+        remove(CachePath);
     }
+}
+
+// NOTE - Baked playback. With the dispersion quantised to multiples of W0, the ocean is periodic with
+// period 2.pi/W0 = 200s : one period is simulated at init for the current sea state, and stored quantised per
+// frame, int16 displacements scaled by a per-frame range and int8 octahedral normals. Playback decodes and
+// interpolates two frames, no FFT runs anymore and sea state changes are ignored.
+real32 static const BakePeriod = 200.f;
+size_t static const BakePoolReserve = 64 * MB; // Of the pool left to what the session allocates after the bake
+
+struct bake_frame
+{
+    water::system *WaterSystem;
+    int Frame;
+    int Frame1;         // Playback only, second frame and its weight
+    real32 Alpha;
+    void *Out;          // Playback only, in the stream format
+    vec3f InvScale;     // Playback of a compact stream only
+    water::query_grid *Query; // Playback only, NULL to skip
+    water::texture_mips *Textures; // Playback only, NULL to skip
+    vec3f *OrigA;
+    vec3f *OrigB;
+    real32 Interp;
+};
+
+void BakeQuantizeRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    bake_frame *Job = (bake_frame*)UserData;
+    water::system *WS = Job->WaterSystem;
+    int N = WS->WaterN;
+    int NPlus1 = N+1;
 
-    uint32 IndexCount = 0;
-    for(int m_prime = 0; m_prime < N; m_prime++)
+    water::vertex const *Vertices = WS->Vertices;
+    vec3f Scale = WS->BakeScales[Job->Frame];
+    vec3f InvScale(32767.f / Scale.x, 32767.f / Scale.y, 32767.f / Scale.z);
+    int16 *Disp = WS->BakeDisplacements + 3 * (size_t)Job->Frame * N * N;
+    int8 *Norm = WS->BakeNormals + 2 * (size_t)Job->Frame * N * N;
+
+    for(int m_prime = Begin; m_prime < End; ++m_prime)
     {
-        for(int n_prime = 0; n_prime < N; n_prime++)
+        for(int n_prime = 0; n_prime < N; ++n_prime)
         {
-            int Idx = m_prime * NPlus1 + n_prime;
-            
-            Indices[IndexCount++] = Idx;
-            Indices[IndexCount++] = Idx + NPlus1;
-            Indices[IndexCount++] = Idx + NPlus1 + 1;
-            Indices[IndexCount++] = Idx;
-            Indices[IndexCount++] = Idx + NPlus1 + 1;
-            Indices[IndexCount++] = Idx + 1;
+            int Idx = m_prime * N + n_prime;
+            int Idx1 = m_prime * NPlus1 + n_prime;
+
+            vec3f D = Vertices[Idx1].Position - Mix(Job->OrigA[Idx1], Job->OrigB[Idx1], Job->Interp);
+            Disp[3 * Idx + 0] = (int16)floorf(D.x * InvScale.x + 0.5f);
+            Disp[3 * Idx + 1] = (int16)floorf(D.y * InvScale.y + 0.5f);
+            Disp[3 * Idx + 2] = (int16)floorf(D.z * InvScale.z + 0.5f);
+
+            vec2f E = OctEncode(Vertices[Idx1].Normal);
+            Norm[2 * Idx + 0] = (int8)floorf(E.x * 127.f + 0.5f);
+            Norm[2 * Idx + 1] = (int8)floorf(E.y * 127.f + 0.5f);
         }
     }
-    WaterSystem->IndexCount = IndexCount;
-    WaterSystem->VAO = rf::MakeVertexArrayObject();
-    WaterSystem->VBO[0] = rf::AddIBO(GL_STATIC_DRAW, WaterSystem->IndexCount * sizeof(uint32), WaterSystem->IndexData);
-    WaterSystem->VBO[1] = rf::AddEmptyVBO(WaterSystem->VertexDataSize, GL_STATIC_DRAW);
-    size_t VertSize = WaterSystem->VertexCount * sizeof(real32);
-    rf::FillVBO(0, 3, GL_FLOAT, 0, VertSize, WaterSystem->VertexData);
-    rf::FillVBO(1, 3, GL_FLOAT, VertSize, VertSize, WaterSystem->VertexData + WaterSystem->VertexCount);
-    rf::FillVBO(2, 3, GL_FLOAT, 2*VertSize, VertSize, WaterSystem->VertexData + 2 * WaterSystem->VertexCount);
-    glBindVertexArray(0);
-#endif
 }
 
-void Update(game::state * /*State*/, rf::input * /*Input*/)
+void BakePlaybackRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
 {
-#if 0
-    beaufort_state *WStateA = &WaterSystem->States[State->WaterState];
-    beaufort_state *WStateB = &WaterSystem->States[State->WaterState + 1];
-
-    State->WaterCounter += Input->dTime;
+    bake_frame *Job = (bake_frame*)UserData;
+    water::system *WS = Job->WaterSystem;
+    int N = WS->WaterN;
+    int NPlus1 = N+1;
 
-    vec3f *WaterPositions = (vec3f*)WaterSystem->Positions;
-    vec3f *WaterNormals = (vec3f*)WaterSystem->Normals;
+    bool Compact = WS->CompactVertices;
+    water::vertex *Out = (water::vertex*)Job->Out;
+    water::compact_vertex *CompactOut = (water::compact_vertex*)Job->Out;
+    int16 const *Disp0 = WS->BakeDisplacements + 3 * (size_t)Job->Frame * N * N;
+    int16 const *Disp1 = WS->BakeDisplacements + 3 * (size_t)Job->Frame1 * N * N;
+    int8 const *Norm0 = WS->BakeNormals + 2 * (size_t)Job->Frame * N * N;
+    int8 const *Norm1 = WS->BakeNormals + 2 * (size_t)Job->Frame1 * N * N;
+    vec3f Scale0 = WS->BakeScales[Job->Frame] * ((1.f - Job->Alpha) / 32767.f);
+    vec3f Scale1 = WS->BakeScales[Job->Frame1] * (Job->Alpha / 32767.f);
+    real32 NormScale0 = (1.f - Job->Alpha) / 127.f;
+    real32 NormScale1 = Job->Alpha / 127.f;
+
+    // NOTE - Rows and columns N are the periodic copies of 0
+    for(int m_prime = Begin; m_prime < End; ++m_prime)
+    {
+        int Row = (m_prime % N) * N;
+        for(int n_prime = 0; n_prime < NPlus1; ++n_prime)
+        {
+            int Idx = Row + n_prime % N;
+            int Idx1 = m_prime * NPlus1 + n_prime;
 
-    vec3f *WaterOrigPositionsA = (vec3f*)WStateA->OrigPositions;
-    vec3f *WaterOrigPositionsB = (vec3f*)WStateB->OrigPositions;
+            vec3f D(Disp0[3 * Idx + 0] * Scale0.x + Disp1[3 * Idx + 0] * Scale1.x,
+                    Disp0[3 * Idx + 1] * Scale0.y + Disp1[3 * Idx + 1] * Scale1.y,
+                    Disp0[3 * Idx + 2] * Scale0.z + Disp1[3 * Idx + 2] * Scale1.z);
+            vec2f E(Norm0[2 * Idx + 0] * NormScale0 + Norm1[2 * Idx + 0] * NormScale1,
+                    Norm0[2 * Idx + 1] * NormScale0 + Norm1[2 * Idx + 1] * NormScale1);
 
-    real32 dT = (real32)State->WaterCounter;
+            if((Job->Query || Job->Textures) && m_prime < N && n_prime < N)
+            {
+                // NOTE - Slopes back from the normal, which is never horizontal once decoded
+                vec3f Normal = OctDecode(E);
+                real32 InvNy = 1.f / Max(Normal.y, 1e-3f);
+                real32 SlopeX = -Normal.x * InvNy;
+                real32 SlopeZ = -Normal.z * InvNy;
+                if(Job->Query)
+                {
+                    Job->Query->DispX[Idx] = D.x;
+                    Job->Query->Height[Idx] = D.y;
+                    Job->Query->DispZ[Idx] = D.z;
+                    Job->Query->SlopeX[Idx] = SlopeX;
+                    Job->Query->SlopeZ[Idx] = SlopeZ;
+                }
+                if(Job->Textures)
+                    StoreTexel(Job->Textures, 0, Idx, D.x, D.y, D.z, SlopeX, SlopeZ);
+            }
 
-    int N = water::system::WaterN;
-    int NPlus1 = N+1;
+            if(Compact)
+            {
+                // NOTE - The bake already is octahedral, the blended normal is requantised as is
+                water::compact_vertex *V = CompactOut + Idx1;
+                V->Displacement[0] = QuantizeSnorm16(D.x * Job->InvScale.x);
+                V->Displacement[1] = QuantizeSnorm16(D.y * Job->InvScale.y);
+                V->Displacement[2] = QuantizeSnorm16(D.z * Job->InvScale.z);
+                V->Normal[0] = (int8)floorf(E.x * 127.f + 0.5f);
+                V->Normal[1] = (int8)floorf(E.y * 127.f + 0.5f);
+            }
+            else
+            {
+                Out[Idx1].Position = Mix(Job->OrigA[Idx1], Job->OrigB[Idx1], Job->Interp) + D;
+                Out[Idx1].Normal = OctDecode(E);
+            }
+        }
+    }
 
-    float Lambda = -1.0f;
+    if(Job->Textures)
+        BuildTextureMips(Job->Textures, 0, N, WS->TextureLevels, 1, Begin, Min(End, N));
+}
 
-    complex *hT = (complex*)WaterSystem->hTilde;
-    complex *hTSX = (complex*)WaterSystem->hTildeSlopeX;
-    complex *hTSZ = (complex*)WaterSystem->hTildeSlopeZ;
-    complex *hTDX = (complex*)WaterSystem->hTildeDX;
-    complex *hTDZ = (complex*)WaterSystem->hTildeDZ;
+// NOTE - Per-frame parameters of the ocean update, shared by the row jobs below.
+// Every job writes disjoint rows of the spectra and of the vertex data, so they need no locking.
+struct water_update
+{
+    water::system *WaterSystem;
+    water::beaufort_state *StateA;
+    water::beaufort_state *StateB;
+    real32 Interp;
+    real32 Width;       // Of the first cascade, the grid of the output
+    void *Out;          // water::vertex or water::compact_vertex
+    bool Compact;
+    vec3f InvScale;     // Compact only, 32767 / DisplacementScale
+    water::query_grid *Query; // Rows and columns [0, N) also go there, NULL to skip
+    water::texture_mips *Textures; // Same, then the mip levels over them, NULL to skip
+};
 
-    real32 dWidth = Mix((real32)WStateA->Width, (real32)WStateB->Width, State->WaterStateInterp);
+// NOTE - The items of the spectra passes are the rows of all the cascades, N per cascade
+void WaterPrepareRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    water_update *Job = (water_update*)UserData;
+    water::system *WaterSystem = Job->WaterSystem;
+    int N = WaterSystem->WaterN;
 
-    // Prepare
-    for(int m_prime = 0; m_prime < N; ++m_prime)
+    for(int Item = Begin; Item < End; ++Item)
     {
-        real32 Kz = M_PI * (2.f * m_prime - N) / dWidth;
+        water::cascade *Cascade = &WaterSystem->Cascades[Item / N];
+        int m_prime = Item % N;
+        real32 Width = Job->Width / Cascade->Ratio;
+
+        complex *hT = Cascade->hTilde;
+        complex *hTSX = Cascade->hTildeSlopeX;
+        complex *hTSZ = Cascade->hTildeSlopeZ;
+        complex *hTDX = Cascade->hTildeDX;
+        complex *hTDZ = Cascade->hTildeDZ;
+        complex const *HTilde0 = Cascade->HTilde0Blend;
+        complex const *HTilde0mk = Cascade->HTilde0mkBlend;
+
+        real32 Kz = M_PI * (2.f * m_prime - N) / Width;
         for(int n_prime = 0; n_prime < N; ++n_prime)
         {
-            real32 Kx = M_PI * (2.f * n_prime - N) / dWidth;
+            real32 Kx = M_PI * (2.f * n_prime - N) / Width;
             real32 Len = sqrtf(Square(Kx) + Square(Kz));
             int Idx = m_prime * N + n_prime;
 
-            hT[Idx] = ComputeHTilde(WStateA, WStateB, State->WaterStateInterp, dT, n_prime, m_prime);
+            complex Phase = WaterSystem->Phases[Cascade->OmegaIndex[Idx]];
+            hT[Idx] = ComputeHTilde(HTilde0[Idx], HTilde0mk[Idx], Phase);
             hTSX[Idx] = hT[Idx] * complex(0, Kx);
             hTSZ[Idx] = hT[Idx] * complex(0, Kz);
             if(Len < 1e-6f)
@@ -365,143 +819,1807 @@ void Update(game::state * /*State*/, rf::input * /*Input*/)
             }
         }
     }
+}
 
-    // Evaluate
-    for(int m_prime = 0; m_prime < N; ++m_prime)
-    {
-        FFTEvaluate(WaterSystem, hT, hT, 1, m_prime * N, N);
-        FFTEvaluate(WaterSystem, hTSX, hTSX, 1, m_prime * N, N);
-        FFTEvaluate(WaterSystem, hTSZ, hTSZ, 1, m_prime * N, N);
-        FFTEvaluate(WaterSystem, hTDX, hTDX, 1, m_prime * N, N);
-        FFTEvaluate(WaterSystem, hTDZ, hTDZ, 1, m_prime * N, N);
-    }
-
-    for(int n_prime = 0; n_prime < N; ++n_prime)
+void WaterPackRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    water::system *WaterSystem = ((water_update*)UserData)->WaterSystem;
+    int N = WaterSystem->WaterN;
+    for(int Item = Begin; Item < End; ++Item)
     {
-        FFTEvaluate(WaterSystem, hT, hT, N, n_prime, N);
-        FFTEvaluate(WaterSystem, hTSX, hTSX, N, n_prime, N);
-        FFTEvaluate(WaterSystem, hTSZ, hTSZ, N, n_prime, N);
-        FFTEvaluate(WaterSystem, hTDX, hTDX, N, n_prime, N);
-        FFTEvaluate(WaterSystem, hTDZ, hTDZ, N, n_prime, N);
+        water::cascade *Cascade = &WaterSystem->Cascades[Item / N];
+        int m_prime = Item % N;
+        water::FFTPackSpectra(Cascade->hTilde, Cascade->hTildeDX, N, m_prime, m_prime + 1);
+        water::FFTPackSpectra(Cascade->hTildeSlopeX, Cascade->hTildeSlopeZ, N, m_prime, m_prime + 1);
     }
+}
 
-    // Fill results
-    float Signs[] = { 1.f, -1.f };
-    for(int m_prime = 0; m_prime < N; ++m_prime)
-    {
-        for(int n_prime = 0; n_prime < N; ++n_prime)
-        {
-            int Idx = m_prime * N + n_prime;        // for htilde
-            int Idx1 = m_prime * NPlus1 + n_prime;  // for vertices
-
-            int Sign = Signs[(n_prime + m_prime) & 1];
+// NOTE - Transformed fields at a grid point, summed over cascades
+struct ocean_sample
+{
+    real32 Height;
+    real32 DispX;
+    real32 DispZ;
+    real32 SlopeX;
+    real32 SlopeZ;
+};
 
-            hT[Idx] = hT[Idx] * Sign;
-            WaterPositions[Idx1].y = hT[Idx].r;
+// NOTE - Texel (SrcRow, SrcCol) of one cascade, with the sign flip. Only the first cascade makes the vertex grid :
+// the others are finer than its cells, read once per vertex they would alias, so they only go to their own layer
+// of the texture output (see WaterDetailTextureRows).
+template<bool Packed>
+ocean_sample SampleCascade(water::system const *WaterSystem, int Cascade, int SrcRow, int SrcCol)
+{
+    water::cascade const *C = &WaterSystem->Cascades[Cascade];
+    int Idx = SrcRow * WaterSystem->WaterN + SrcCol;
+    real32 Sign = ((SrcRow + SrcCol) & 1) ? -1.f : 1.f;
+
+    ocean_sample S;
+    S.Height = C->hTilde[Idx].r * Sign;
+    S.DispX = (Packed ? C->hTilde[Idx].i : C->hTildeDX[Idx].r) * Sign;
+    S.DispZ = C->hTildeDZ[Idx].r * Sign;
+    S.SlopeX = C->hTildeSlopeX[Idx].r * Sign;
+    S.SlopeZ = (Packed ? C->hTildeSlopeX[Idx].i : C->hTildeSlopeZ[Idx].r) * Sign;
+    return S;
+}
 
-            hTDX[Idx] = hTDX[Idx] * Sign;
-            hTDZ[Idx] = hTDZ[Idx] * Sign;
-            {
-                vec3f OP = Mix(WaterOrigPositionsA[Idx1], WaterOrigPositionsB[Idx1], State->WaterStateInterp);
-                WaterPositions[Idx1].x = OP.x + Lambda * hTDX[Idx].r;
-                WaterPositions[Idx1].z = OP.z + Lambda * hTDZ[Idx].r;
-            }
+// NOTE - Final vertex of grid point (m', n')
+template<bool Packed, bool Compact>
+void AssembleVertex(water_update const *Job, int m_prime, int n_prime, void *Out)
+{
+    water::system *WaterSystem = Job->WaterSystem;
+    int N = WaterSystem->WaterN;
+    real32 Lambda = -1.0f;
+    real32 CellSize = Job->Width / N;
+    ocean_sample S = SampleCascade<Packed>(WaterSystem, 0, m_prime & (N - 1), n_prime & (N - 1));
 
-            hTSX[Idx] = hTSX[Idx] * Sign;
-            hTSZ[Idx] = hTSZ[Idx] * Sign;
-            vec3f Normal = Normalize(vec3f(-hTSX[Idx].r, 1, -hTSZ[Idx].r));
+    vec3f D(Lambda * S.DispX, S.Height, Lambda * S.DispZ);
+    real32 InvLen = 1.f / sqrtf(Square(S.SlopeX) + Square(S.SlopeZ) + 1.f);
+    vec3f Normal(-S.SlopeX * InvLen, InvLen, -S.SlopeZ * InvLen);
 
-            WaterNormals[Idx1] = Normal;
+    if(Job->Query && m_prime < N && n_prime < N)
+    {
+        int Idx = m_prime * N + n_prime;
+        Job->Query->DispX[Idx] = D.x;
+        Job->Query->Height[Idx] = D.y;
+        Job->Query->DispZ[Idx] = D.z;
+        Job->Query->SlopeX[Idx] = S.SlopeX;
+        Job->Query->SlopeZ[Idx] = S.SlopeZ;
+    }
+    if(Job->Textures && m_prime < N && n_prime < N)
+        StoreTexel(Job->Textures, 0, m_prime * N + n_prime, D.x, D.y, D.z, S.SlopeX, S.SlopeZ);
 
-            if(n_prime == 0 && m_prime == 0)
-            {
-                vec3f OP = Mix(WaterOrigPositionsA[Idx1 + N + NPlus1 * N], WaterOrigPositionsB[Idx1 + N + NPlus1 * N], State->WaterStateInterp);
-                WaterPositions[Idx1 + N + NPlus1 * N].x = OP.x + Lambda * hTDX[Idx].r;
-                WaterPositions[Idx1 + N + NPlus1 * N].y = hT[Idx].r;
-                WaterPositions[Idx1 + N + NPlus1 * N].z = OP.z + Lambda * hTDZ[Idx].r;
+    if(Compact)
+    {
+        StoreCompactVertex(D, Normal, Job->InvScale, (water::compact_vertex*)Out);
+    }
+    else
+    {
+        water::vertex *V = (water::vertex*)Out;
+        V->Position = vec3f((n_prime - N / 2.f) * CellSize + D.x, D.y, (m_prime - N / 2.f) * CellSize + D.z);
+        V->Normal = Normal;
+    }
+}
 
-                WaterNormals[Idx1 + N + NPlus1 * N] = Normal;
-            }
-            if(n_prime == 0)
-            {
-                vec3f OP = Mix(WaterOrigPositionsA[Idx1 + N], WaterOrigPositionsB[Idx1 + N], State->WaterStateInterp);
-                WaterPositions[Idx1 + N].x = OP.x + Lambda * hTDX[Idx].r;
-                WaterPositions[Idx1 + N].y = hT[Idx].r;
-                WaterPositions[Idx1 + N].z = OP.z + Lambda * hTDZ[Idx].r;
+#if HAVE_SSE2
+inline void LoadComplex4(complex const *P, __m128 *Re, __m128 *Im)
+{
+    __m128 A = _mm_loadu_ps(&P[0].r);
+    __m128 B = _mm_loadu_ps(&P[2].r);
+    *Re = _mm_shuffle_ps(A, B, _MM_SHUFFLE(2, 0, 2, 0));
+    *Im = _mm_shuffle_ps(A, B, _MM_SHUFFLE(3, 1, 3, 1));
+}
 
-                WaterNormals[Idx1 + N] = Normal;
-            }
-            if(m_prime == 0)
-            {
-                vec3f OP = Mix(WaterOrigPositionsA[Idx1 + NPlus1 * N], WaterOrigPositionsB[Idx1 + NPlus1 * N], State->WaterStateInterp);
-                WaterPositions[Idx1 + NPlus1 * N].x = OP.x + Lambda * hTDX[Idx].r;
-                WaterPositions[Idx1 + NPlus1 * N].y = hT[Idx].r;
-                WaterPositions[Idx1 + NPlus1 * N].z = OP.z + Lambda * hTDZ[Idx].r;
+// NOTE - 4 vertices from the SoA position/normal components, to 24 interleaved floats
+inline void StoreVertices4(real32 *Out, __m128 Px, __m128 Py, __m128 Pz, __m128 Nx, __m128 Ny, __m128 Nz)
+{
+    _MM_TRANSPOSE4_PS(Px, Py, Pz, Nx); // Px..Nx now hold the first 4 floats of vertices 0..3
+    __m128 NyNz01 = _mm_unpacklo_ps(Ny, Nz);
+    __m128 NyNz23 = _mm_unpackhi_ps(Ny, Nz);
+    _mm_storeu_ps(Out + 0, Px);
+    _mm_storeu_ps(Out + 4, _mm_movelh_ps(NyNz01, Py));
+    _mm_storeu_ps(Out + 8, _mm_shuffle_ps(Py, NyNz01, _MM_SHUFFLE(3, 2, 3, 2)));
+    _mm_storeu_ps(Out + 12, Pz);
+    _mm_storeu_ps(Out + 16, _mm_movelh_ps(NyNz23, Nx));
+    _mm_storeu_ps(Out + 20, _mm_shuffle_ps(Nx, NyNz23, _MM_SHUFFLE(3, 2, 3, 2)));
+}
 
-                WaterNormals[Idx1 + NPlus1 * N] = Normal;
-            }
-        }
-    }
-    UpdateWaterMesh(WaterSystem);
-#endif
+// NOTE - 4 compact vertices from their int32 components, Nw holding both normal bytes. Interleaved to
+// Dx Dy Dz Nw per vertex, the int16 packing saturates.
+inline void StoreCompactVertices4(int16 *Out, __m128i Dx, __m128i Dy, __m128i Dz, __m128i Nw)
+{
+    __m128i XZ = _mm_packs_epi32(Dx, Dz);
+    __m128i YN = _mm_packs_epi32(Dy, Nw);
+    __m128i Lo = _mm_unpacklo_epi16(XZ, YN); // x0 y0 x1 y1 x2 y2 x3 y3
+    __m128i Hi = _mm_unpackhi_epi16(XZ, YN); // z0 n0 z1 n1 z2 n2 z3 n3
+    _mm_storeu_si128((__m128i*)(Out + 0), _mm_unpacklo_epi32(Lo, Hi));
+    _mm_storeu_si128((__m128i*)(Out + 8), _mm_unpackhi_epi32(Lo, Hi));
 }
 
-real32 IntersectPlane(vec3f const &N, vec3f const &P0, vec3f const &RayOrg, vec3f const &RayDir)
+// NOTE - 4 texels of level 0 of the texture output from their SoA fields, see StoreTexel
+inline void StoreTexels4(water::texture_mips *Textures, int Idx, __m128 DispX, __m128 Height, __m128 DispZ, __m128 SlopeX, __m128 SlopeZ)
 {
-    real32 Denom = Dot(N, RayDir);
-    if(std::fabs(Denom) > 1e-5)
-    {
-        vec3f P0Org = P0 - RayOrg;
-        real32 T = Dot(P0Org, N) / Denom;
-        if(T >= 0.f)
-            return T;
-        return -1.f;
-    }
-    return -1.f;
+    __m128 SlopeXZ = _mm_mul_ps(SlopeX, SlopeZ);
+    __m128 SlopeXX = _mm_mul_ps(SlopeX, SlopeX);
+    __m128 SlopeZZ = _mm_mul_ps(SlopeZ, SlopeZ);
+    _MM_TRANSPOSE4_PS(DispX, Height, DispZ, SlopeXZ);
+    _MM_TRANSPOSE4_PS(SlopeX, SlopeZ, SlopeXX, SlopeZZ);
+    real32 *D = Textures->Displacement[0][0] + 4 * Idx;
+    real32 *S = Textures->Slope[0][0] + 4 * Idx;
+    _mm_storeu_ps(D + 0, DispX);
+    _mm_storeu_ps(D + 4, Height);
+    _mm_storeu_ps(D + 8, DispZ);
+    _mm_storeu_ps(D + 12, SlopeXZ);
+    _mm_storeu_ps(S + 0, SlopeX);
+    _mm_storeu_ps(S + 4, SlopeZ);
+    _mm_storeu_ps(S + 8, SlopeXX);
+    _mm_storeu_ps(S + 12, SlopeZZ);
 }
 
-static const float S_Upper = 5.f; // TODO - this is the upper level of displacement, should be parameterized
-static const float M2_FixedLength = 10.f; // Fixed length along the Fwd vector for method 2 projector direction
+inline __m128i QuantizeSnorm4(__m128 V, __m128 Scale)
+{
+    __m128 Limit = _mm_set1_ps(32767.f);
+    V = _mm_min_ps(_mm_max_ps(_mm_mul_ps(V, Scale), _mm_sub_ps(_mm_setzero_ps(), Limit)), Limit);
+    return _mm_cvtps_epi32(V);
+}
+#endif
 
-void GetProjectorPositionAndDirection(const camera &Camera, 
-                                      vec3f &ProjectorPosition, vec3f &ProjectorTarget)
+// NOTE - Fused assembly of output row m' : sign flip, choppy displacement around the implicit grid and normal of the
+// first cascade, written once as final interleaved vertices. Row N and column N are the seams, taking their texels
+// from row and column 0, so the main loop has no branch.
+template<bool Packed, bool Compact>
+void AssembleRow(water_update const *Job, int m_prime)
 {
-    ProjectorPosition = Camera.Position + Camera.PositionDecimal;
-    //ProjectorPosition.y = Max(ProjectorPosition.y, S_Upper); // limit Projector height above upper displacement 
+    water::system *WaterSystem = Job->WaterSystem;
+    int N = WaterSystem->WaterN;
+    water::vertex *Out = (water::vertex*)Job->Out + m_prime * (N + 1);
+    water::compact_vertex *CompactOut = (water::compact_vertex*)Job->Out + m_prime * (N + 1);
+
+    int n_prime = 0;
+#if HAVE_SSE2
+    int SrcRow = m_prime & (N - 1);
+    int Row = SrcRow * N;
+    water::cascade const *Cascade = &WaterSystem->Cascades[0];
+    complex const *hT = Cascade->hTilde + Row;
+    complex const *hTSX = Cascade->hTildeSlopeX + Row;
+    complex const *hTSZ = Cascade->hTildeSlopeZ + Row;
+    complex const *hTDX = Cascade->hTildeDX + Row;
+    complex const *hTDZ = Cascade->hTildeDZ + Row;
+    water::query_grid *Query = m_prime < N ? Job->Query : NULL; // Row N is the seam
+    water::texture_mips *Textures = m_prime < N ? Job->Textures : NULL;
+
+    real32 CellSize = Job->Width / N;
+    __m128 Sign = (SrcRow & 1) ? _mm_setr_ps(-1.f, 1.f, -1.f, 1.f) : _mm_setr_ps(1.f, -1.f, 1.f, -1.f);
+    __m128 Lambda = _mm_set1_ps(-1.f);
+    __m128 One = _mm_set1_ps(1.f);
+    __m128 Cell = _mm_set1_ps(CellSize);
+    __m128 OPz = _mm_set1_ps((m_prime - N / 2.f) * CellSize);
+    __m128 Col = _mm_setr_ps(-N / 2.f, 1.f - N / 2.f, 2.f - N / 2.f, 3.f - N / 2.f);
+    __m128 InvScaleX = _mm_set1_ps(Job->InvScale.x);
+    __m128 InvScaleY = _mm_set1_ps(Job->InvScale.y);
+    __m128 InvScaleZ = _mm_set1_ps(Job->InvScale.z);
+
+    for(; n_prime < N; n_prime += 4)
+    {
+        __m128 HtRe, HtIm, SxRe, SxIm, Re, Im;
+        LoadComplex4(hT + n_prime, &HtRe, &HtIm);
+        LoadComplex4(hTSX + n_prime, &SxRe, &SxIm);
+
+        __m128 Height = _mm_mul_ps(HtRe, Sign);
+        __m128 SlopeX = _mm_mul_ps(SxRe, Sign);
+        __m128 DispX, SlopeZ;
+        if(Packed)
+        {
+            DispX = _mm_mul_ps(HtIm, Sign);
+            SlopeZ = _mm_mul_ps(SxIm, Sign);
+        }
+        else
+        {
+            LoadComplex4(hTDX + n_prime, &Re, &Im);
+            DispX = _mm_mul_ps(Re, Sign);
+            LoadComplex4(hTSZ + n_prime, &Re, &Im);
+            SlopeZ = _mm_mul_ps(Re, Sign);
+        }
+        LoadComplex4(hTDZ + n_prime, &Re, &Im);
+        __m128 DispZ = _mm_mul_ps(Re, Sign);
 
-    // Get projector orientation 
-    vec3f D = Camera.Forward;
-    vec3f N = vec3f(0,1,0); // plane normal
-    real32 NdotD = Dot(D, N);
-    if(NdotD > 0.f)
-    { // Mirror direction if not towards plane
-        D.y = -D.y;
-        NdotD = -NdotD;
-    }
+        if(Query)
+        {
+            int Idx = m_prime * N + n_prime;
+            _mm_storeu_ps(Query->DispX + Idx, _mm_mul_ps(Lambda, DispX));
+            _mm_storeu_ps(Query->Height + Idx, Height);
+            _mm_storeu_ps(Query->DispZ + Idx, _mm_mul_ps(Lambda, DispZ));
+            _mm_storeu_ps(Query->SlopeX + Idx, SlopeX);
+            _mm_storeu_ps(Query->SlopeZ + Idx, SlopeZ);
+        }
+        if(Textures)
+            StoreTexels4(Textures, m_prime * N + n_prime, _mm_mul_ps(Lambda, DispX), Height, _mm_mul_ps(Lambda, DispZ), SlopeX, SlopeZ);
 
-    // method 1 : to the intersection of the camera direction and the sea plane
-    real32 T = IntersectPlane(N, vec3f(0,0,0), ProjectorPosition, D);
-    Assert(T >= 0.f);
-    vec3f M1 = ProjectorPosition + D * T;
+        if(Compact)
+        {
+            // NOTE - Octahedral encoding of the upper hemisphere normal (-SlopeX, 1, -SlopeZ) is the slope
+            // vector over its L1 norm, no normalisation needed
+            __m128 AbsMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+            __m128 L1 = _mm_add_ps(_mm_add_ps(_mm_and_ps(SlopeX, AbsMask), _mm_and_ps(SlopeZ, AbsMask)), One);
+            __m128 OctScale = _mm_div_ps(_mm_set1_ps(-127.f), L1);
+            __m128i Ex = _mm_cvtps_epi32(_mm_mul_ps(SlopeX, OctScale));
+            __m128i Ez = _mm_cvtps_epi32(_mm_mul_ps(SlopeZ, OctScale));
+            __m128i Nw = _mm_or_si128(_mm_and_si128(Ex, _mm_set1_epi32(0xFF)), _mm_slli_epi32(Ez, 8));
+
+            __m128i Dx = QuantizeSnorm4(_mm_mul_ps(Lambda, DispX), InvScaleX);
+            __m128i Dy = QuantizeSnorm4(Height, InvScaleY);
+            __m128i Dz = QuantizeSnorm4(_mm_mul_ps(Lambda, DispZ), InvScaleZ);
+            StoreCompactVertices4(CompactOut[n_prime].Displacement, Dx, Dy, Dz, Nw);
+            continue;
+        }
 
-    // method 2 : to the 2d plane projection of a fixed length direction along the fwd vector
-    vec3f M2 = ProjectorPosition + Camera.Forward * M2_FixedLength;
-    M2.y = 0.f;
+        __m128 OPx = _mm_mul_ps(_mm_add_ps(Col, _mm_set1_ps((real32)n_prime)), Cell);
+        __m128 Px = _mm_add_ps(OPx, _mm_mul_ps(Lambda, DispX));
+        __m128 Pz = _mm_add_ps(OPz, _mm_mul_ps(Lambda, DispZ));
 
-    // The result is a linear mix between the two methods depending on the angle of the cam
-    // view direction and the sea normal
-    ProjectorTarget = Lerp(M2, M1, NdotD);
+        __m128 InvLen = _mm_div_ps(One, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(SlopeX, SlopeX), _mm_mul_ps(SlopeZ, SlopeZ)), One)));
+        __m128 Nx = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(SlopeX, InvLen));
+        __m128 Nz = _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(SlopeZ, InvLen));
+
+        StoreVertices4((real32*)(Out + n_prime), Px, Height, Pz, Nx, InvLen, Nz);
+    }
+#endif
+    for(; n_prime <= N; ++n_prime)
+    {
+        void *Dst = Compact ? (void*)(CompactOut + n_prime) : (void*)(Out + n_prime);
+        AssembleVertex<Packed, Compact>(Job, m_prime, n_prime, Dst);
+    }
 }
 
-void Render(game::state *State, uint32 /*Envmap*/, uint32 /*GGXLUT*/)
+void WaterFillRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
 {
-    glDisable(GL_CULL_FACE);
-    glUseProgram(WaterSystem->ProgramWater);
+    water_update *Job = (water_update*)UserData;
+    bool Packed = Job->WaterSystem->FFTPacked;
+    for(int m_prime = Begin; m_prime < End; ++m_prime)
+    {
+        if(Job->Compact)
+        {
+            if(Packed)
+                AssembleRow<true, true>(Job, m_prime);
+            else
+                AssembleRow<false, true>(Job, m_prime);
+        }
+        else
+        {
+            if(Packed)
+                AssembleRow<true, false>(Job, m_prime);
+            else
+                AssembleRow<false, false>(Job, m_prime);
+        }
+    }
+
+    if(Job->Textures)
+    {
+        int N = Job->WaterSystem->WaterN;
+        BuildTextureMips(Job->Textures, 0, N, Job->WaterSystem->TextureLevels, 1, Begin, Min(End, N));
+    }
+}
+
+// NOTE - Layers 1 and up of the texture output : rows of the cascades past the first, each at its own resolution,
+// item i being row i % N of cascade 1 + i / N. A job never straddles two cascades, see TextureRowGrain.
+void WaterDetailTextureRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    water_update *Job = (water_update*)UserData;
+    water::system const *WaterSystem = Job->WaterSystem;
+    int N = WaterSystem->WaterN;
+    int Cascade = 1 + Begin / N;
+    int RowBegin = Begin % N;
+    int RowEnd = RowBegin + (End - Begin);
+    for(int Row = RowBegin; Row < RowEnd; ++Row)
+    {
+        for(int Col = 0; Col < N; ++Col)
+        {
+            ocean_sample S = WaterSystem->FFTPacked ? SampleCascade<true>(WaterSystem, Cascade, Row, Col)
+                                                    : SampleCascade<false>(WaterSystem, Cascade, Row, Col);
+            StoreTexel(Job->Textures, Cascade, Row * N + Col, -S.DispX, S.Height, -S.DispZ, S.SlopeX, S.SlopeZ);
+        }
+    }
+    BuildTextureMips(Job->Textures, Cascade, N, WaterSystem->TextureLevels, 1, RowBegin, RowEnd);
+}
+
+// NOTE - Vertex stream between two keyframes, see UpdateKeyframes
+struct keyframe_blend
+{
+    int N;
+    water::vertex const *A;
+    water::vertex const *B;
+    real32 Alpha;           // 0 : A, 1 : B
+    real32 Width;           // Of the blended stream
+    vec3f InvScale;
+    bool Compact;
+    void *Out;
+    water::texture_mips const *TexturesA;   // Texture output of the keyframes, and of the blend. NULL to skip
+    water::texture_mips const *TexturesB;
+    water::texture_mips *Textures;
+    int TextureLevels;
+    water::query_grid const *QueryA;        // Query grids of the keyframes, and of the blend. NULL to skip
+    water::query_grid const *QueryB;
+    water::query_grid *Query;
+};
+
+void KeyframeBlendRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    keyframe_blend const *Job = (keyframe_blend const*)UserData;
+    int N = Job->N;
+    int NPlus1 = N + 1;
+    real32 CellSize = Job->Width / N;
+    for(int m_prime = Begin; m_prime < End; ++m_prime)
+    {
+        for(int n_prime = 0; n_prime < NPlus1; ++n_prime)
+        {
+            int Idx1 = m_prime * NPlus1 + n_prime;
+            vec3f Position = Mix(Job->A[Idx1].Position, Job->B[Idx1].Position, Job->Alpha);
+            vec3f Normal = Normalize(Mix(Job->A[Idx1].Normal, Job->B[Idx1].Normal, Job->Alpha));
+            if(Job->Compact)
+            {
+                vec3f Grid((n_prime - N / 2) * CellSize, 0.f, (m_prime - N / 2) * CellSize);
+                StoreCompactVertex(Position - Grid, Normal, Job->InvScale, (water::compact_vertex*)Job->Out + Idx1);
+            }
+            else
+            {
+                water::vertex *Out = (water::vertex*)Job->Out + Idx1;
+                Out->Position = Position;
+                Out->Normal = Normal;
+            }
+        }
+    }
+
+    if(Job->Query)
+    {
+        size_t First = (size_t)Begin * N;
+        size_t Last = (size_t)Min(End, N) * N;
+        real32 const *FieldsA[5] = { Job->QueryA->DispX, Job->QueryA->Height, Job->QueryA->DispZ, Job->QueryA->SlopeX, Job->QueryA->SlopeZ };
+        real32 const *FieldsB[5] = { Job->QueryB->DispX, Job->QueryB->Height, Job->QueryB->DispZ, Job->QueryB->SlopeX, Job->QueryB->SlopeZ };
+        real32 *Fields[5] = { Job->Query->DispX, Job->Query->Height, Job->Query->DispZ, Job->Query->SlopeX, Job->Query->SlopeZ };
+        for(int f = 0; f < 5; ++f)
+        {
+            for(size_t i = First; i < Last; ++i)
+                Fields[f][i] = Mix(FieldsA[f][i], FieldsB[f][i], Job->Alpha);
+        }
+    }
+
+    // NOTE - Level 0 of every layer is blended, the mips over it rebuilt as in the steps
+    if(Job->Textures)
+    {
+        int RowEnd = Min(End, N);
+        size_t First = 4 * (size_t)Begin * N;
+        size_t Last = 4 * (size_t)RowEnd * N;
+        for(int Layer = 0; Layer < Job->Textures->Layers; ++Layer)
+        {
+            real32 const *DA = Job->TexturesA->Displacement[Layer][0];
+            real32 const *DB = Job->TexturesB->Displacement[Layer][0];
+            real32 const *SA = Job->TexturesA->Slope[Layer][0];
+            real32 const *SB = Job->TexturesB->Slope[Layer][0];
+            for(size_t i = First; i < Last; ++i)
+            {
+                Job->Textures->Displacement[Layer][0][i] = Mix(DA[i], DB[i], Job->Alpha);
+                Job->Textures->Slope[Layer][0][i] = Mix(SA[i], SB[i], Job->Alpha);
+            }
+            BuildTextureMips(Job->Textures, Layer, N, Job->TextureLevels, 1, Begin, RowEnd);
+        }
+    }
+}
+
+// NOTE - Bilinear lookups in the periodic query grids, (U, V) in texels. N is a power of two, texel indices wrap
+// with a mask and any point of the plane has its lookup.
+struct query_texels
+{
+    int Idx[4];     // (u0, v0), (u1, v0), (u0, v1), (u1, v1)
+    real32 FU;
+    real32 FV;
+};
+
+inline query_texels QueryTexels(int N, real32 U, real32 V)
+{
+    query_texels T;
+    real32 U0 = floorf(U);
+    real32 V0 = floorf(V);
+    int i0 = (int)U0 & (N - 1);
+    int j0 = (int)V0 & (N - 1);
+    int i1 = (i0 + 1) & (N - 1);
+    int j1 = (j0 + 1) & (N - 1);
+    T.Idx[0] = j0 * N + i0;
+    T.Idx[1] = j0 * N + i1;
+    T.Idx[2] = j1 * N + i0;
+    T.Idx[3] = j1 * N + i1;
+    T.FU = U - U0;
+    T.FV = V - V0;
+    return T;
+}
+
+inline real32 QueryBilinear(real32 const *Field, query_texels const &T)
+{
+    real32 A = Mix(Field[T.Idx[0]], Field[T.Idx[1]], T.FU);
+    real32 B = Mix(Field[T.Idx[2]], Field[T.Idx[3]], T.FU);
+    return Mix(A, B, T.FV);
+}
+
+#if HAVE_SSE2
+// NOTE - 4 lookups at a time, the texel indices computed in SIMD and gathered with scalar loads
+struct query_texels4
+{
+    int32 Idx[4][4]; // [corner][lane], corners as in query_texels
+    __m128 FU;
+    __m128 FV;
+};
+
+inline void QueryTexels4(int Log2N, __m128 U, __m128 V, query_texels4 *T)
+{
+    __m128i Mask = _mm_set1_epi32((1 << Log2N) - 1);
+    __m128i One = _mm_set1_epi32(1);
+    __m128i Shift = _mm_cvtsi32_si128(Log2N);
+
+    // NOTE - Floor, truncation rounds negative coordinates up
+    __m128i U0 = _mm_cvttps_epi32(U);
+    __m128i V0 = _mm_cvttps_epi32(V);
+    U0 = _mm_add_epi32(U0, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(U0), U)));
+    V0 = _mm_add_epi32(V0, _mm_castps_si128(_mm_cmpgt_ps(_mm_cvtepi32_ps(V0), V)));
+    T->FU = _mm_sub_ps(U, _mm_cvtepi32_ps(U0));
+    T->FV = _mm_sub_ps(V, _mm_cvtepi32_ps(V0));
+
+    __m128i i0 = _mm_and_si128(U0, Mask);
+    __m128i i1 = _mm_and_si128(_mm_add_epi32(U0, One), Mask);
+    __m128i Row0 = _mm_sll_epi32(_mm_and_si128(V0, Mask), Shift);
+    __m128i Row1 = _mm_sll_epi32(_mm_and_si128(_mm_add_epi32(V0, One), Mask), Shift);
+    _mm_storeu_si128((__m128i*)T->Idx[0], _mm_add_epi32(Row0, i0));
+    _mm_storeu_si128((__m128i*)T->Idx[1], _mm_add_epi32(Row0, i1));
+    _mm_storeu_si128((__m128i*)T->Idx[2], _mm_add_epi32(Row1, i0));
+    _mm_storeu_si128((__m128i*)T->Idx[3], _mm_add_epi32(Row1, i1));
+}
+
+inline __m128 QueryBilinear4(real32 const *Field, query_texels4 const *T)
+{
+    __m128 C[4];
+    for(int c = 0; c < 4; ++c)
+    {
+        int32 const *I = T->Idx[c];
+        C[c] = _mm_setr_ps(Field[I[0]], Field[I[1]], Field[I[2]], Field[I[3]]);
+    }
+    __m128 A = _mm_add_ps(C[0], _mm_mul_ps(T->FU, _mm_sub_ps(C[1], C[0])));
+    __m128 B = _mm_add_ps(C[2], _mm_mul_ps(T->FU, _mm_sub_ps(C[3], C[2])));
+    return _mm_add_ps(A, _mm_mul_ps(T->FV, _mm_sub_ps(B, A)));
+}
+#endif
+
+// NOTE - State of a FindBreaking scan over one query grid
+struct breaking_scan
+{
+    water::query_grid const *Grid;
+    int N;
+    real32 CellSize;
+    real32 InvTwoCells;     // Central differences
+    real32 Threshold;
+    vec2f Center;
+    int Capacity;
+    int Found;
+    water::breaking_point *Points;
+};
+
+// NOTE - Jacobian of the horizontal displacement D at grid point (n', m'),
+//   J = (1 + dDx/dx)(1 + dDz/dz) - dDx/dz . dDz/dx
+// by central differences, the grid wrapping around
+inline real32 BreakingJacobian(breaking_scan const *Scan, int m_prime, int n_prime)
+{
+    int Mask = Scan->N - 1;
+    int Row = m_prime * Scan->N;
+    int Prev = ((m_prime - 1) & Mask) * Scan->N + n_prime;
+    int Next = ((m_prime + 1) & Mask) * Scan->N + n_prime;
+    int Left = Row + ((n_prime - 1) & Mask);
+    int Right = Row + ((n_prime + 1) & Mask);
+    real32 const *DX = Scan->Grid->DispX;
+    real32 const *DZ = Scan->Grid->DispZ;
+
+    real32 Jxx = (DX[Right] - DX[Left]) * Scan->InvTwoCells;
+    real32 Jzz = (DZ[Next] - DZ[Prev]) * Scan->InvTwoCells;
+    real32 Jxz = (DX[Next] - DX[Prev]) * Scan->InvTwoCells;
+    real32 Jzx = (DZ[Right] - DZ[Left]) * Scan->InvTwoCells;
+    return (1.f + Jxx) * (1.f + Jzz) - Jxz * Jzx;
+}
+
+inline void AddBreaking(breaking_scan *Scan, int m_prime, int n_prime, real32 Jacobian)
+{
+    if(Scan->Found++ >= Scan->Capacity)
+        return;
+
+    water::query_grid const *Grid = Scan->Grid;
+    int Idx = m_prime * Scan->N + n_prime;
+    real32 X = (n_prime - Scan->N / 2) * Scan->CellSize + Grid->DispX[Idx];
+    real32 Z = (m_prime - Scan->N / 2) * Scan->CellSize + Grid->DispZ[Idx];
+    X += Grid->Width * floorf((Scan->Center.x - X) / Grid->Width + 0.5f);
+    Z += Grid->Width * floorf((Scan->Center.y - Z) / Grid->Width + 0.5f);
+
+    water::breaking_point *Point = &Scan->Points[Scan->Found - 1];
+    Point->Position = vec3f(X, Grid->Height[Idx], Z);
+    Point->Normal = Normalize(vec3f(-Grid->SlopeX[Idx], 1.f, -Grid->SlopeZ[Idx]));
+    Point->Jacobian = Jacobian;
+    Point->Area = Square(Scan->CellSize);
+}
+
+// NOTE - Row m' in increasing n'. The columns 1 to N-2 have their neighbours in the row and are tested 4 at a time,
+// most rows having nothing breaking.
+void BreakingRow(breaking_scan *Scan, int m_prime)
+{
+    int N = Scan->N;
+    real32 J = BreakingJacobian(Scan, m_prime, 0);
+    if(J < Scan->Threshold)
+        AddBreaking(Scan, m_prime, 0, J);
+
+    int n_prime = 1;
+#if HAVE_SSE2
+    real32 const *DX = Scan->Grid->DispX;
+    real32 const *DZ = Scan->Grid->DispZ;
+    int Row = m_prime * N;
+    int Prev = ((m_prime - 1) & (N - 1)) * N;
+    int Next = ((m_prime + 1) & (N - 1)) * N;
+    __m128 One = _mm_set1_ps(1.f);
+    __m128 InvTwoCells = _mm_set1_ps(Scan->InvTwoCells);
+    __m128 Threshold = _mm_set1_ps(Scan->Threshold);
+    for(; n_prime + 4 <= N - 1; n_prime += 4)
+    {
+        __m128 Jxx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(DX + Row + n_prime + 1), _mm_loadu_ps(DX + Row + n_prime - 1)), InvTwoCells);
+        __m128 Jzz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(DZ + Next + n_prime), _mm_loadu_ps(DZ + Prev + n_prime)), InvTwoCells);
+        __m128 Jxz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(DX + Next + n_prime), _mm_loadu_ps(DX + Prev + n_prime)), InvTwoCells);
+        __m128 Jzx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(DZ + Row + n_prime + 1), _mm_loadu_ps(DZ + Row + n_prime - 1)), InvTwoCells);
+        __m128 J4 = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(One, Jxx), _mm_add_ps(One, Jzz)), _mm_mul_ps(Jxz, Jzx));
+        int Breaking = _mm_movemask_ps(_mm_cmplt_ps(J4, Threshold));
+        if(Breaking)
+        {
+            real32 Lanes[4];
+            _mm_storeu_ps(Lanes, J4);
+            for(int l = 0; l < 4; ++l)
+            {
+                if(Breaking & (1 << l))
+                    AddBreaking(Scan, m_prime, n_prime + l, Lanes[l]);
+            }
+        }
+    }
+#endif
+    for(; n_prime < N; ++n_prime)
+    {
+        J = BreakingJacobian(Scan, m_prime, n_prime);
+        if(J < Scan->Threshold)
+            AddBreaking(Scan, m_prime, n_prime, J);
+    }
+}
+
+// NOTE - Update throttling. The ocean is simulated at UpdateRates[RateLevel] Hz, the level going up with the camera
+// altitude above the water plane, one more when little water is in view, and to the last one, no update at all,
+// when there is none. Every rule switches HysteresisMargin past its threshold in either direction, so a camera
+// hovering around one doesn't flap between two rates.
+int static const RateLevelCount = 4;
+real32 static const UpdateRates[RateLevelCount] = { 60.f, 30.f, 15.f, 0.f };
+real32 static const RateAltitudes[RateLevelCount - 1] = { 300.f, 1500.f, 6000.f };
+real32 static const SparseCoverage = 0.25f;     // Fraction of the view
+real32 static const HiddenCoverage = 0.01f;
+real32 static const HysteresisMargin = 0.2f;
+int static const CoverageRays = 8;              // Per side of the view
+
+inline bool BelowWithHysteresis(real32 Value, real32 Threshold, bool WasBelow)
+{
+    return Value < Threshold * (WasBelow ? 1.f + HysteresisMargin : 1.f - HysteresisMargin);
+}
+
+// NOTE - Fraction of a grid of view rays hitting the water plane closer than the far plane
+real32 WaterCoverage(water::system const *WaterSystem, camera const &Camera)
+{
+    vec3f Eye = Camera.Position + Camera.PositionDecimal;
+    if(Eye.y <= 0.f)
+        return 1.f;
+
+    int Hits = 0;
+    for(int j = 0; j < CoverageRays; ++j)
+    {
+        real32 V = ((j + 0.5f) / CoverageRays * 2.f - 1.f) * WaterSystem->ViewTanY;
+        for(int i = 0; i < CoverageRays; ++i)
+        {
+            real32 U = ((i + 0.5f) / CoverageRays * 2.f - 1.f) * WaterSystem->ViewTanY * WaterSystem->ViewAspect;
+            vec3f Ray = Camera.Forward + Camera.Right * U + Camera.Up * V;
+            if(Ray.y < 0.f && Eye.y / -Ray.y * Length(Ray) < WaterSystem->ViewFar)
+                ++Hits;
+        }
+    }
+    return Hits / (real32)Square(CoverageRays);
+}
+
+void ChooseUpdateRate(water::system *WaterSystem, camera const &Camera)
+{
+    if(!WaterSystem->Throttle)
+    {
+        WaterSystem->RateLevel = 0;
+        return;
+    }
+
+    real32 Altitude = Camera.Position.y + Camera.PositionDecimal.y;
+    int Level = 0;
+    for(int i = 0; i < RateLevelCount - 1; ++i)
+    {
+        if(!BelowWithHysteresis(Altitude, RateAltitudes[i], WaterSystem->AltitudeLevel <= i))
+            Level = i + 1;
+    }
+    WaterSystem->AltitudeLevel = Level;
+
+    real32 Coverage = WaterCoverage(WaterSystem, Camera);
+    WaterSystem->Sparse = BelowWithHysteresis(Coverage, SparseCoverage, WaterSystem->Sparse);
+    WaterSystem->Hidden = BelowWithHysteresis(Coverage, HiddenCoverage, WaterSystem->Hidden);
+    if(WaterSystem->Hidden)
+        Level = RateLevelCount - 1;
+    else if(WaterSystem->Sparse)
+        Level = Min(Level + 1, RateLevelCount - 1);
+    WaterSystem->RateLevel = Level;
+}
+
+namespace water {
+water::system *WaterSystem = NULL;
+rf::mesh ScreenQuad = {};
+
+// NOTE - Asynchronous simulation. The ocean thread publishes its results through a lock-free triple buffer :
+// it owns SimWriteSlot, the render thread owns SimReadSlot, and the third slot is swapped through SimLatest,
+// where SimFreshBit tells that it holds results the render thread has not uploaded yet.
+uint32 static const SimFreshBit = 0x4;
+static std::thread SimThread;
+static std::atomic<bool> SimRunning(false);
+static std::atomic<uint32> SimLatest(0);
+static uint32 SimWriteSlot = 1;     // Ocean thread only
+static uint32 SimReadSlot = 2;      // Render thread only
+static std::mutex SimParamsMutex;   // Sea state set by the render thread
+static int SimWaterState = 0;
+static real32 SimWaterInterp = 0.f;
+static int SimRateLevel = 0;        // See ChooseUpdateRate, caps the ocean thread rate
+
+// NOTE - Wave layer inputs, set by the render thread and taken by the next ocean step
+static std::mutex WakeMutex;
+static bool WakeFollowCamera = true;    // Render thread only
+static vec2f WakeCenter(0.f, 0.f);
+static int WakePendingCount = 0;
+static water::wake_obstacle *WakePending = NULL; // system::WakeMaxObstacles
+
+// NOTE - Query grids go from the steps to Sample in the same spirit : the step writes a grid that is neither the
+// latest nor pinned by a Sample call, then publishes it as QueryLatest. Sample pins the latest grid in
+// QueryReaders for its duration. There is a single writer at a time (render or ocean thread) and any number of
+// readers. If Samples still pin both other grids, the step isn't kept for them, the latest grid staying valid.
+static std::atomic<int> QueryLatest(-1);    // -1 before the first step
+static std::atomic<int> QueryReaders[3];
+
+void AllocQueryGrid(water::query_grid *Grid, rf::mem_pool *Pool, int N)
+{
+    real32 *GridData = rf::PoolAlloc<real32>(Pool, 5 * N * N);
+    Grid->DispX = GridData;
+    Grid->Height = GridData + N * N;
+    Grid->DispZ = GridData + 2 * N * N;
+    Grid->SlopeX = GridData + 3 * N * N;
+    Grid->SlopeZ = GridData + 4 * N * N;
+    Grid->Wake = water::wake_grid();
+}
+
+// NOTE - Grid the next step writes, NULL when none is free
+water::query_grid *BeginQueryGrid()
+{
+    int Latest = QueryLatest.load();
+    for(int i = 0; i < 3; ++i)
+    {
+        if(i != Latest && QueryReaders[i].load() == 0)
+            return &WaterSystem->QueryGrids[i];
+    }
+    return NULL;
+}
+
+void PublishQueryGrid(water::query_grid *Grid, real32 Width)
+{
+    Grid->Width = Width;
+    QueryLatest.store((int)(Grid - WaterSystem->QueryGrids));
+}
+
+// NOTE - The latest grid, pinned until UnpinQueryGrid. A grid that stopped being the latest between the load and
+// the pin may already be rewritten, pin again.
+int PinQueryGrid()
+{
+    for(;;)
+    {
+        int Latest = QueryLatest.load();
+        if(Latest < 0)
+            return -1;
+        QueryReaders[Latest].fetch_add(1);
+        if(QueryLatest.load() == Latest)
+            return Latest;
+        QueryReaders[Latest].fetch_sub(1);
+    }
+}
+
+void UnpinQueryGrid(int Grid)
+{
+    QueryReaders[Grid].fetch_sub(1);
+}
+
+// NOTE - Brings the wave layer to time T with the latest inputs. Its 0.5 m cells would alias read once per ocean
+// vertex, it goes to the query grid of the step box-filtered to the cells of a patch of this Width instead. It
+// stays out of the periodic stream, which would repeat it on every tile of the patch.
+void StepWake(real32 T, real32 Width, water::query_grid *Query)
+{
+    water::wake *Wake = &WaterSystem->Wake;
+    vec2f Center;
+    {
+        std::lock_guard<std::mutex> Lock(WakeMutex);
+        Center = WakeCenter;
+        WaterSystem->WakeObstacleCount = WakePendingCount;
+        memcpy(WaterSystem->WakeObstacles, WakePending, WakePendingCount * sizeof(water::wake_obstacle));
+    }
+    WakeRecenter(Wake, Center);
+    WakeSetObstacles(Wake, WaterSystem->WakeObstacleCount, WaterSystem->WakeObstacles);
+    WakeAdvance(Wake, T);
+    if(Query)
+        WakeDownsample(Wake, Width / WaterSystem->WaterN, &Query->Wake);
+}
+
+// NOTE - Full ocean step at time T, writing the (N+1)^2 final vertices into Output, as water::vertex or
+// water::compact_vertex, its texture output into Textures and its query grid into Query unless NULL, the caller
+// publishing it. Returns what decodes the compact stream.
+water::stream_info Simulate(real32 T, int WaterState, real32 WaterInterp, void *Output, bool Compact,
+                            water::texture_mips *Textures, water::query_grid *Query)
+{
+    water_update Job = {};
+    Job.WaterSystem = WaterSystem;
+    Job.StateA = &WaterSystem->States[WaterState];
+    Job.StateB = &WaterSystem->States[WaterState + 1];
+    Job.Interp = WaterInterp;
+    Job.Width = Mix((real32)Job.StateA->Width, (real32)Job.StateB->Width, Job.Interp);
+    Job.Out = Output;
+    Job.Compact = Compact;
+    Job.Query = Query;
+    Job.Textures = Textures;
+
+    // NOTE - Bake frames are the bare ocean, the layer is stepped at playback
+    if(WaterSystem->Wake.N > 0 && WaterSystem->BakeFrameCount == 0)
+        StepWake(T, Job.Width, Job.Query);
+    else if(Job.Query)
+        Job.Query->Wake.Size = 0;
+
+    int N = WaterSystem->WaterN;
+    int RowGrain = Max(1, N / (4 * jobs::ThreadCount()));
+    int CascadeRows = WaterSystem->CascadeCount * N;
+
+    UpdateBlendedSpectrum(WaterSystem, WaterState, WaterInterp);
+    UpdateDispersionTable(WaterSystem, Job.Width);
+
+    water::stream_info Info;
+    Info.Width = Job.Width;
+    Info.DisplacementScale = CompactDisplacementScale(WaterSystem->DisplacementSigma);
+    Job.InvScale = vec3f(32767.f / Info.DisplacementScale.x, 32767.f / Info.DisplacementScale.y, 32767.f / Info.DisplacementScale.z);
+
+    UpdatePhases(WaterSystem, T);
+    jobs::ParallelFor(CascadeRows, RowGrain, WaterPrepareRows, &Job);
+
+    // Evaluate, all the fields of all the cascades in one batch
+    complex *Spectra[FFTMaxSpectra];
+    int SpectraCount = 0;
+    if(WaterSystem->FFTPacked)
+    {
+        // NOTE - Only the real part of each transform is used : height + i.dispX, slopeX + i.slopeZ, dispZ
+        jobs::ParallelFor(CascadeRows, RowGrain, WaterPackRows, &Job);
+    }
+    for(int c = 0; c < WaterSystem->CascadeCount; ++c)
+    {
+        water::cascade *Cascade = &WaterSystem->Cascades[c];
+        Spectra[SpectraCount++] = Cascade->hTilde;
+        Spectra[SpectraCount++] = Cascade->hTildeSlopeX;
+        Spectra[SpectraCount++] = Cascade->hTildeDZ;
+        if(!WaterSystem->FFTPacked)
+        {
+            Spectra[SpectraCount++] = Cascade->hTildeSlopeZ;
+            Spectra[SpectraCount++] = Cascade->hTildeDX;
+        }
+    }
+    FFTEvaluateSpectra(&WaterSystem->FFTPlan, Spectra, SpectraCount);
+
+    int FillGrain = TextureRowGrain(N);
+    jobs::ParallelFor(N + 1, FillGrain, WaterFillRows, &Job);
+    if(Textures && WaterSystem->CascadeCount > 1)
+        jobs::ParallelFor(CascadeRows - N, FillGrain, WaterDetailTextureRows, &Job);
+    if(Textures)
+        FinishTextureMips(Textures, N, WaterSystem->TextureLevels, FillGrain);
+    if(Query)
+        Query->Width = Job.Width;
+    return Info;
+}
+
+void SimThreadMain(real32 SimHz)
+{
+    typedef std::chrono::steady_clock clock;
+    clock::time_point Start = clock::now();
+    clock::time_point Next = Start;
+
+    while(SimRunning.load(std::memory_order_acquire))
+    {
+        int WaterState;
+        real32 WaterInterp;
+        int RateLevel;
+        {
+            std::lock_guard<std::mutex> Lock(SimParamsMutex);
+            WaterState = SimWaterState;
+            WaterInterp = SimWaterInterp;
+            RateLevel = SimRateLevel;
+        }
+
+        // NOTE - Paused, checking back at the slowest running rate
+        if(RateLevel == RateLevelCount - 1)
+        {
+            std::this_thread::sleep_for(std::chrono::duration<real64>(1.0 / UpdateRates[RateLevelCount - 2]));
+            Next = clock::now();
+            continue;
+        }
+
+        real32 Hz = SimHz;
+        if(RateLevel > 0)
+            Hz = SimHz > 0.f ? Min(SimHz, UpdateRates[RateLevel]) : UpdateRates[RateLevel];
+        clock::duration Period = std::chrono::duration_cast<clock::duration>(std::chrono::duration<real64>(Hz > 0.f ? 1.0 / Hz : 0.0));
+
+        real32 T = (real32)std::chrono::duration<real64>(clock::now() - Start).count();
+        water::texture_mips *Textures = WaterSystem->Textures ? &WaterSystem->SimTextures[SimWriteSlot] : NULL;
+        water::query_grid *Query = BeginQueryGrid();
+        WaterSystem->SimStreams[SimWriteSlot] = Simulate(T, WaterState, WaterInterp, WaterSystem->SimBuffers[SimWriteSlot],
+                                                         WaterSystem->CompactVertices, Textures, Query);
+        if(Query)
+            PublishQueryGrid(Query, Query->Width);
+
+        // Publish the finished slot and take back the one that was waiting
+        SimWriteSlot = SimLatest.exchange(SimWriteSlot | SimFreshBit, std::memory_order_acq_rel) & ~SimFreshBit;
+
+        // NOTE - A late step doesn't try to catch up, it just restarts the period
+        Next += Period;
+        clock::time_point Now = clock::now();
+        if(Next < Now)
+            Next = Now;
+        std::this_thread::sleep_until(Next);
+    }
+}
+
+// NOTE - Returns false, nothing allocated, when the bake has no frame at FPS or doesn't fit in Pool
+bool Bake(rf::mem_pool *Pool, real32 FPS, int WaterState, real32 WaterInterp)
+{
+    int N = WaterSystem->WaterN;
+    int FrameCount = (int)(BakePeriod * FPS + 0.5f);
+    if(FrameCount < 1)
+    {
+        LogError("Water bake at %g FPS has no frame over its %gs period, simulating live.", FPS, BakePeriod);
+        return false;
+    }
+
+    size_t FrameSize = (size_t)N * N * (3 * sizeof(int16) + 2 * sizeof(int8)) + sizeof(vec3f);
+    size_t BakeSize = FrameCount * FrameSize;
+    size_t PoolUsed = (size_t)(rf::PoolOccupancy(Pool) * Pool->Capacity);
+    size_t PoolFree = Pool->Capacity > PoolUsed ? (size_t)Pool->Capacity - PoolUsed : 0;
+    if(BakeSize + BakePoolReserve > PoolFree)
+    {
+        LogError("Water bake needs %.1f MB, %.1f MB are free in the session pool, simulating live.",
+                 BakeSize / (real32)MB, PoolFree / (real32)MB);
+        return false;
+    }
+    if(WaterSystem->CascadeCount > 1)
+    {
+        LogError("Water bake holds the vertex grid only, not the detail cascades, simulating live.");
+        return false;
+    }
+    LogInfo("Baking the ocean : %d frames, %.1f MB", FrameCount, BakeSize / (real32)MB);
+
+    WaterSystem->BakeFrameCount = FrameCount;
+    WaterSystem->BakeFPS = FrameCount / BakePeriod;
+    WaterSystem->BakeState = WaterState;
+    WaterSystem->BakeInterp = WaterInterp;
+    WaterSystem->BakeDisplacements = rf::PoolAlloc<int16>(Pool, 3 * (size_t)FrameCount * N * N);
+    WaterSystem->BakeNormals = rf::PoolAlloc<int8>(Pool, 2 * (size_t)FrameCount * N * N);
+    WaterSystem->BakeScales = rf::PoolAlloc<vec3f>(Pool, FrameCount);
+
+    bake_frame Job = {};
+    Job.WaterSystem = WaterSystem;
+    Job.OrigA = (vec3f*)WaterSystem->States[WaterState].OrigPositions;
+    Job.OrigB = (vec3f*)WaterSystem->States[WaterState + 1].OrigPositions;
+    Job.Interp = WaterInterp;
+
+    water::vertex const *Vertices = WaterSystem->Vertices;
+    int NPlus1 = N+1;
+    for(int f = 0; f < FrameCount; ++f)
+    {
+        Simulate(f / WaterSystem->BakeFPS, WaterState, WaterInterp, WaterSystem->Vertices, false, NULL, NULL);
+
+        vec3f Range(1e-6f, 1e-6f, 1e-6f);
+        for(int Idx1 = 0; Idx1 < Square(NPlus1); ++Idx1)
+        {
+            vec3f D = Vertices[Idx1].Position - Mix(Job.OrigA[Idx1], Job.OrigB[Idx1], WaterInterp);
+            Range = vec3f(Max(Range.x, fabsf(D.x)), Max(Range.y, fabsf(D.y)), Max(Range.z, fabsf(D.z)));
+        }
+        WaterSystem->BakeScales[f] = Range;
+
+        Job.Frame = f;
+        jobs::ParallelFor(N, Max(1, N / (4 * jobs::ThreadCount())), BakeQuantizeRows, &Job);
+    }
+    return true;
+}
+
+water::stream_info PlayBake(real32 T, void *Out)
+{
+    real32 FrameT = fmodf(T, BakePeriod) * WaterSystem->BakeFPS;
+
+    bake_frame Job = {};
+    Job.WaterSystem = WaterSystem;
+    Job.Frame = Min((int)FrameT, WaterSystem->BakeFrameCount - 1);
+    Job.Frame1 = (Job.Frame + 1) % WaterSystem->BakeFrameCount;
+    Job.Alpha = FrameT - Job.Frame;
+    Job.OrigA = (vec3f*)WaterSystem->States[WaterSystem->BakeState].OrigPositions;
+    Job.OrigB = (vec3f*)WaterSystem->States[WaterSystem->BakeState + 1].OrigPositions;
+    Job.Interp = WaterSystem->BakeInterp;
+    Job.Out = Out;
+    Job.Query = BeginQueryGrid();
+    Job.Textures = WaterSystem->Textures ? &WaterSystem->TextureData : NULL;
+
+    // NOTE - The blend of the two frames stays within the larger of their ranges
+    water::stream_info Info;
+    water::beaufort_state *StateA = &WaterSystem->States[WaterSystem->BakeState];
+    water::beaufort_state *StateB = &WaterSystem->States[WaterSystem->BakeState + 1];
+    vec3f Scale0 = WaterSystem->BakeScales[Job.Frame];
+    vec3f Scale1 = WaterSystem->BakeScales[Job.Frame1];
+    Info.Width = Mix((real32)StateA->Width, (real32)StateB->Width, Job.Interp);
+    Info.DisplacementScale = vec3f(Max(Scale0.x, Scale1.x), Max(Scale0.y, Scale1.y), Max(Scale0.z, Scale1.z));
+    if(WaterSystem->Wake.N > 0)
+        StepWake(T, Info.Width, Job.Query);
+    Job.InvScale = vec3f(32767.f / Info.DisplacementScale.x, 32767.f / Info.DisplacementScale.y, 32767.f / Info.DisplacementScale.z);
+
+    int N = WaterSystem->WaterN;
+    int Grain = TextureRowGrain(N);
+    jobs::ParallelFor(N + 1, Grain, BakePlaybackRows, &Job);
+    if(Job.Textures)
+        FinishTextureMips(Job.Textures, N, WaterSystem->TextureLevels, Grain);
+    if(Job.Query)
+        PublishQueryGrid(Job.Query, Info.Width);
+    return Info;
+}
+
+// NOTE - Throttled update at time T, Rate Hz. The ocean being a function of time, each keyframe is simulated one
+// period ahead, when the stream reaches the previous one, and the stream is blended between the two latest.
+// The first keyframe after a rate change is the current time, the next one simulated right away.
+// The keyframes keep their query grids to themselves : what Sample reads is their blend with the stream's weight,
+// published along with it.
+water::stream_info UpdateKeyframes(real64 T, real32 Rate, int WaterState, real32 WaterInterp, void *Out)
+{
+    water::system *S = WaterSystem;
+    real64 Period = 1.0 / Rate;
+    water::texture_mips *KeyTextures1 = S->Textures ? &S->KeyTextures[1] : NULL;
+    if(!S->KeyValid)
+    {
+        S->KeyStreams[1] = Simulate((real32)T, WaterState, WaterInterp, S->Keyframes[1], false, KeyTextures1,
+                                    &S->KeyQueries[1]);
+        S->KeyTimes[1] = T;
+        S->KeyValid = true;
+    }
+    if(T >= S->KeyTimes[1])
+    {
+        water::vertex *Tmp = S->Keyframes[0];
+        S->Keyframes[0] = S->Keyframes[1];
+        S->Keyframes[1] = Tmp;
+        water::texture_mips TmpTextures = S->KeyTextures[0];
+        S->KeyTextures[0] = S->KeyTextures[1];
+        S->KeyTextures[1] = TmpTextures;
+        water::query_grid TmpQuery = S->KeyQueries[0];
+        S->KeyQueries[0] = S->KeyQueries[1];
+        S->KeyQueries[1] = TmpQuery;
+        S->KeyStreams[0] = S->KeyStreams[1];
+        S->KeyTimes[0] = S->KeyTimes[1];
+
+        // NOTE - A late frame restarts the period rather than catching up
+        real64 Next = S->KeyTimes[0] + Period;
+        if(Next <= T)
+            Next = T + Period;
+        S->KeyStreams[1] = Simulate((real32)Next, WaterState, WaterInterp, S->Keyframes[1], false, KeyTextures1,
+                                    &S->KeyQueries[1]);
+        S->KeyTimes[1] = Next;
+    }
+
+    keyframe_blend Job = {};
+    Job.N = S->WaterN;
+    Job.A = S->Keyframes[0];
+    Job.B = S->Keyframes[1];
+    Job.Alpha = Clamp((real32)((T - S->KeyTimes[0]) / (S->KeyTimes[1] - S->KeyTimes[0])), 0.f, 1.f);
+    Job.Compact = S->CompactVertices;
+    Job.Out = Out;
+    Job.QueryA = &S->KeyQueries[0];
+    Job.QueryB = &S->KeyQueries[1];
+    Job.Query = BeginQueryGrid();
+    if(S->Textures)
+    {
+        Job.TexturesA = &S->KeyTextures[0];
+        Job.TexturesB = &S->KeyTextures[1];
+        Job.Textures = &S->TextureData;
+        Job.TextureLevels = S->TextureLevels;
+    }
+
+    // NOTE - The blend stays within the larger of the two displacement ranges
+    water::stream_info Info;
+    vec3f Scale0 = S->KeyStreams[0].DisplacementScale;
+    vec3f Scale1 = S->KeyStreams[1].DisplacementScale;
+    Info.Width = Mix(S->KeyStreams[0].Width, S->KeyStreams[1].Width, Job.Alpha);
+    Info.DisplacementScale = vec3f(Max(Scale0.x, Scale1.x), Max(Scale0.y, Scale1.y), Max(Scale0.z, Scale1.z));
+    Job.Width = Info.Width;
+    Job.InvScale = vec3f(32767.f / Info.DisplacementScale.x, 32767.f / Info.DisplacementScale.y, 32767.f / Info.DisplacementScale.z);
+
+    int N = S->WaterN;
+    int Grain = TextureRowGrain(N);
+    jobs::ParallelFor(N + 1, Grain, KeyframeBlendRows, &Job);
+    if(Job.Textures)
+        FinishTextureMips(Job.Textures, N, S->TextureLevels, Grain);
+    if(Job.Query)
+    {
+        WakeGridBlend(&Job.QueryA->Wake, &Job.QueryB->Wake, Job.Alpha, &Job.Query->Wake);
+        PublishQueryGrid(Job.Query, Info.Width);
+    }
+    return Info;
+}
+
+// NOTE - Screen slabs, near to far : the unit grid drawn over each and its fragment shader. Near water gets the full
+// BRDF with foam, far water a simplified BRDF on fewer vertices, its rows being a thin band of the screen.
+int static const SlabColumns[water::system::SlabLodCount] = { 128, 64 };
+int static const SlabRows[water::system::SlabLodCount] = { 64, 16 };
+static char const *SlabFragmentShaders[water::system::SlabLodCount] = { "data/shaders/water_frag.glsl",
+                                                                         "data/shaders/water_far_frag.glsl" };
+
+void MakeSlabGrid(water::system *S, rf::mem_pool *Pool, int Lod)
+{
+    int Columns = SlabColumns[Lod];
+    int Rows = SlabRows[Lod];
+    int VertexCount = (Columns + 1) * (Rows + 1);
+    vec2f *Grid = rf::PoolAlloc<vec2f>(Pool, VertexCount);
+    for(int y = 0; y <= Rows; ++y)
+    {
+        for(int x = 0; x <= Columns; ++x)
+            Grid[y * (Columns + 1) + x] = vec2f(x / (real32)Columns, y / (real32)Rows);
+    }
+
+    mesh::indices *Indices = &S->SlabIndices[Lod];
+    mesh::BuildGridIndices(Indices, Pool, Columns, Rows, mesh::DefaultCacheSize, true);
+
+    S->SlabVAO[Lod] = rf::MakeVertexArrayObject();
+    S->SlabVBO[Lod][0] = rf::AddIBO(GL_STATIC_DRAW, Indices->Count * mesh::IndexSize(Indices->Type), Indices->Data);
+    size_t GridSize = VertexCount * sizeof(vec2f);
+    S->SlabVBO[Lod][1] = rf::AddEmptyVBO(GridSize, GL_STATIC_DRAW);
+    rf::FillVBO(0, 2, GL_FLOAT, 0, GridSize, Grid);
+    glEnableVertexAttribArray(0);
+    glBindVertexArray(0);
+}
+
+void Init(game::state *State, rf::context *Context, config const *Config, uint32 BeaufortState)
+{
+    ScreenQuad = rf::Make2DQuad(Context, vec2i(-1,1), vec2i(1, -1), 5);
+    WaterSystem = rf::PoolAlloc<water::system>(Context->SessionPool, 1);
+
+    int N = Config->WaterN;
+    if(!FFTSupportedSize(N))
+    {
+        LogError("Unsupported ocean resolution %d, needs to be 64, 128, 256 or 512. Using 64.", N);
+        N = 64;
+    }
+    WaterSystem->WaterN = N;
+    int NPlus1 = N+1;
+
+    size_t WaterStateAttribs = 3 * sizeof(vec3f); // hTilde0, hTilde0mk, OrigPos
+    size_t WaterAttribs = 2 * sizeof(vec3f); // Pos, Norm
+    size_t WaterVertexDataSize = Square(NPlus1) * (WaterAttribs + water::system::BeaufortStateCount * WaterStateAttribs);
+    size_t WaterVertexCount = 3 * Square(NPlus1); // 3 floats per attrib
+    real32 *WaterVertexData = rf::PoolAlloc<real32>(Context->SessionPool, WaterVertexDataSize / sizeof(real32));
+
+    WaterSystem->VertexDataSize = WaterVertexDataSize;
+    WaterSystem->VertexCount = WaterVertexCount;
+    WaterSystem->VertexData = WaterVertexData;
+    WaterSystem->Vertices = (water::vertex*)WaterSystem->VertexData;
+
+    // NOTE - The cascades past the first only reach the shaders through the texture output
+    WaterSystem->CascadeCount = Clamp(Config->WaterCascades, 1, water::MaxCascades);
+    if(WaterSystem->CascadeCount > 1 && !Config->WaterTextures)
+    {
+        LogError("Water cascades need the texture output (bWaterTextures), using a single cascade.");
+        WaterSystem->CascadeCount = 1;
+    }
+    for(int c = 0; c < WaterSystem->CascadeCount; ++c)
+    {
+        water::cascade *Cascade = &WaterSystem->Cascades[c];
+        *Cascade = MakeCascade(c, WaterSystem->CascadeCount, N);
+        Cascade->hTilde = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->hTildeSlopeX = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->hTildeSlopeZ = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->hTildeDX = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->hTildeDZ = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->HTilde0Blend = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->HTilde0mkBlend = rf::PoolAlloc<complex>(Context->SessionPool, N * N);
+        Cascade->OmegaIndex = rf::PoolAlloc<uint16>(Context->SessionPool, N * N);
+        Cascade->OmegaWidth = -1.f;
+    }
+    WaterSystem->CascadeData = rf::PoolAlloc<real32>(Context->SessionPool, CascadeDataCount(WaterSystem));
+
+    WaterSystem->FFTPacked = Config->WaterFFTPacked;
+    int FieldCount = WaterSystem->FFTPacked ? 3 : 5;
+    FFTPlanInit(&WaterSystem->FFTPlan, Context->SessionPool, N, Config->WaterFFTMode,
+                FieldCount * WaterSystem->CascadeCount, jobs::ThreadCount());
+
+    uint32 Seed = (uint32)Config->WaterSeed;
+    for(uint32 i = 0; i < water::system::BeaufortStateCount; ++i)
+    {
+        WaterBeaufortStateSetup(WaterSystem, i);
+    }
+
+    spectra_cache_header CacheKey;
+    MakeSpectraCacheHeader(&CacheKey, WaterSystem, Seed);
+    if(!LoadSpectraCache(WaterSystem, Context, &CacheKey))
+    {
+        for(uint32 i = 0; i < water::system::BeaufortStateCount; ++i)
+        {
+            WaterBeaufortStateGenerate(WaterSystem, i, Seed, Context->ScratchPool);
+        }
+        SaveSpectraCache(WaterSystem, Context, &CacheKey);
+    }
+
+    real32 MinWidth = 0.f;
+    for(uint32 i = 0; i < water::system::BeaufortStateCount; ++i)
+    {
+        real32 Width = (real32)WaterSystem->States[i].Width;
+        MinWidth = i == 0 ? Width : Min(MinWidth, Width);
+    }
+
+    // NOTE - The blended width never goes under the narrowest state's, and the narrowest patch is the last
+    // cascade's, where the dispersion index is the highest
+    MinWidth /= WaterSystem->Cascades[WaterSystem->CascadeCount - 1].Ratio;
+    int MaxOmegaIdx = 0;
+    for(int m_prime = 0; m_prime < N; ++m_prime)
+    {
+        for(int n_prime = 0; n_prime < N; ++n_prime)
+        {
+            MaxOmegaIdx = Max(MaxOmegaIdx, ComputeDispersionIndex(MinWidth, N, n_prime, m_prime));
+        }
+    }
+    WaterSystem->PhaseCount = MaxOmegaIdx + 1;
+    WaterSystem->Phases = rf::PoolAlloc<complex>(Context->SessionPool, WaterSystem->PhaseCount);
+    WaterSystem->BlendDirty = true;
+
+    for(int i = 0; i < 3; ++i)
+    {
+        AllocQueryGrid(&WaterSystem->QueryGrids[i], Context->SessionPool, N);
+        QueryReaders[i].store(0);
+    }
+    QueryLatest.store(-1);
+
+    // NOTE - Flat ocean in the texture output until the first step, one layer per cascade
+    WaterSystem->Textures = Config->WaterTextures;
+    WaterSystem->TextureLevels = WaterSystem->FFTPlan.Log2N + 1;
+    int TextureLayers = WaterSystem->CascadeCount;
+    if(WaterSystem->Textures)
+    {
+        AllocTextureMips(&WaterSystem->TextureData, Context->SessionPool, N, WaterSystem->TextureLevels, TextureLayers);
+        WaterSystem->DisplacementMap = MakeWaterTexture(N, WaterSystem->TextureLevels, 0);
+        WaterSystem->SlopeMap = MakeWaterTexture(N, WaterSystem->TextureLevels, 0);
+        if(TextureLayers > 1)
+        {
+            WaterSystem->DetailDisplacementMap = MakeWaterTexture(N, WaterSystem->TextureLevels, TextureLayers - 1);
+            WaterSystem->DetailSlopeMap = MakeWaterTexture(N, WaterSystem->TextureLevels, TextureLayers - 1);
+        }
+        UploadWaterTextures(WaterSystem, &WaterSystem->TextureData);
+    }
+
+    WakeInit(&WaterSystem->Wake, Context->SessionPool, Config->WaterWakeN, Config->WaterWakeCellSize, Config->WaterWakeBudgetMs);
+    WaterSystem->WakeObstacles = rf::PoolAlloc<water::wake_obstacle>(Context->SessionPool, water::system::WakeMaxObstacles);
+    // NOTE - Filtered to the cells of the narrowest patch at most, see StepWake
+    real32 WakeMinCellSize = (real32)WaterSystem->States[0].Width;
+    for(uint32 i = 1; i < water::system::BeaufortStateCount; ++i)
+        WakeMinCellSize = Min(WakeMinCellSize, (real32)WaterSystem->States[i].Width);
+    WakeMinCellSize /= N;
+    if(WaterSystem->Wake.N > 0)
+    {
+        for(int i = 0; i < 3; ++i)
+            WakeGridInit(&WaterSystem->QueryGrids[i].Wake, Context->SessionPool, &WaterSystem->Wake, WakeMinCellSize);
+
+        int Capacity = WaterSystem->QueryGrids[0].Wake.Capacity;
+        WaterSystem->WakeTexels = rf::PoolAlloc<real32>(Context->SessionPool, 4 * Square(Capacity));
+        glGenTextures(1, &WaterSystem->WakeMap);
+        glBindTexture(GL_TEXTURE_2D, WaterSystem->WakeMap);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, Capacity, Capacity, 0, GL_RGBA, GL_FLOAT, WaterSystem->WakeTexels);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    WaterSystem->WakeDrawn = water::wake_grid();
+    WakePending = rf::PoolAlloc<water::wake_obstacle>(Context->SessionPool, water::system::WakeMaxObstacles);
+    WakePendingCount = 0;
+    WakeFollowCamera = true;
+    WakeCenter = vec2f(State->Camera.Position.x, State->Camera.Position.z);
+
+    water::vertex *Vertices = WaterSystem->Vertices;
+
+    // NOTE - Flat ocean to start with, all zeroes in the compact format
+    WaterSystem->CompactVertices = Config->WaterCompactVertices;
+    WaterSystem->Stream.Width = (real32)WaterSystem->States[BeaufortState].Width;
+    WaterSystem->Stream.DisplacementScale = vec3f(1.f, 1.f, 1.f);
+    if(WaterSystem->CompactVertices)
+    {
+        memset((void*)Vertices, 0, WaterStreamSize(WaterSystem));
+    }
+    else
+    {
+        vec3f *OrigPositions = (vec3f*)WaterSystem->States[BeaufortState].OrigPositions;
+        for(int m_prime = 0; m_prime < NPlus1; m_prime++)
+        {
+            for(int n_prime = 0; n_prime < NPlus1; n_prime++)
+            {
+                int Idx = m_prime * NPlus1 + n_prime;
+                Vertices[Idx].Position = OrigPositions[Idx];
+                Vertices[Idx].Normal = vec3f(0, 1, 0);
+            }
+        }
+    }
+
+    // NOTE - Strips in column blocks along the vertex cache, 16-bit up to N = 128
+    mesh::indices *Indices = &WaterSystem->Indices;
+    mesh::BuildGridIndices(Indices, Context->SessionPool, N, N, mesh::DefaultCacheSize, true);
+    LogInfo("Water grid : %u indices, %d-bit, ACMR %.2f", Indices->Count, (int)(8 * mesh::IndexSize(Indices->Type)),
+            mesh::ComputeACMR(Indices, mesh::DefaultCacheSize));
+    WaterSystem->VAO = rf::MakeVertexArrayObject();
+    WaterSystem->VBO[0] = rf::AddIBO(GL_STATIC_DRAW, Indices->Count * mesh::IndexSize(Indices->Type), Indices->Data);
+
+    // NOTE - The static attribute lives in its own VBO, the per-frame stream in the ring of StreamBuffer,
+    // attributes 0 and 1 being pointed at the current slot after each write (see BindWaterStream)
+    size_t VertSize = WaterSystem->VertexCount * sizeof(real32);
+    WaterSystem->VBO[1] = rf::AddEmptyVBO(VertSize, GL_STATIC_DRAW);
+    rf::FillVBO(2, 3, GL_FLOAT, 0, VertSize, WaterSystem->VertexData + 2 * WaterSystem->VertexCount);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+
+    // NOTE - Tiled rendering, attribute 3 advances once per tile
+    WaterSystem->TileRadius = Max(Config->WaterTileRadius, 0);
+    WaterSystem->TileCapacity = Square(2 * WaterSystem->TileRadius + 1);
+    WaterSystem->TileCount = 0;
+    if(WaterSystem->TileRadius > 0)
+    {
+        glEnableVertexAttribArray(3);
+        glVertexAttribDivisor(3, 1);
+    }
+    glBindVertexArray(0);
+
+    stream::Init(&WaterSystem->StreamBuffer, WaterStreamSize(WaterSystem));
+    UploadWaterMesh(WaterSystem, WaterSystem->Vertices);
+    if(WaterSystem->TileRadius > 0)
+    {
+        WaterSystem->TileOffsets = rf::PoolAlloc<vec2f>(Context->SessionPool, WaterSystem->TileCapacity);
+        stream::Init(&WaterSystem->TileBuffer, WaterSystem->TileCapacity * sizeof(vec2f));
+    }
+
+    WaterSystem->SlabDistance = WaterSystem->TileRadius > 0 ? 0.f : Max(Config->WaterSlabDistance, 0.f);
+    if(WaterSystem->SlabDistance > 0.f)
+    {
+        for(int l = 0; l < water::system::SlabLodCount; ++l)
+            MakeSlabGrid(WaterSystem, Context->SessionPool, l);
+    }
+
+    // NOTE - A bake that can't be made leaves BakeFrameCount to 0, the ocean being simulated live
+    WaterSystem->BakeFrameCount = 0;
+    if(Config->WaterBakeFPS > 0.f)
+    {
+        Bake(Context->SessionPool, Config->WaterBakeFPS, BeaufortState, State->WaterStateInterp);
+    }
+
+    // NOTE - Playing a bake is cheap enough to stay on the render thread
+    WaterSystem->Async = Config->WaterAsync && WaterSystem->BakeFrameCount == 0;
+
+    // NOTE - Only the synchronous live update blends keyframes, the ocean thread just runs slower and a bake is
+    // played or not
+    WaterSystem->Throttle = Config->WaterThrottle;
+    WaterSystem->ViewTanY = tanf(0.5f * Config->FOV * (real32)M_PI / 180.f);
+    WaterSystem->ViewAspect = Config->WindowWidth / (real32)Max(Config->WindowHeight, 1);
+    WaterSystem->ViewNear = Config->NearPlane;
+    WaterSystem->ViewFar = Config->FarPlane;
+    WaterSystem->RateLevel = 0;
+    WaterSystem->AltitudeLevel = 0;
+    WaterSystem->Sparse = false;
+    WaterSystem->Hidden = false;
+    WaterSystem->KeyValid = false;
+    if(WaterSystem->Throttle && !WaterSystem->Async && WaterSystem->BakeFrameCount == 0)
+    {
+        for(int i = 0; i < 2; ++i)
+        {
+            WaterSystem->Keyframes[i] = rf::PoolAlloc<water::vertex>(Context->SessionPool, Square(NPlus1));
+            AllocQueryGrid(&WaterSystem->KeyQueries[i], Context->SessionPool, N);
+            WakeGridInit(&WaterSystem->KeyQueries[i].Wake, Context->SessionPool, &WaterSystem->Wake, WakeMinCellSize);
+            if(WaterSystem->Textures)
+                AllocTextureMips(&WaterSystem->KeyTextures[i], Context->SessionPool, N, WaterSystem->TextureLevels, TextureLayers);
+        }
+    }
+    SimRateLevel = 0;
+
+    if(WaterSystem->Async)
+    {
+        // NOTE - Every slot starts with the flat ocean, the render thread keeps it until the first step is published
+        for(int i = 0; i < 3; ++i)
+        {
+            WaterSystem->SimBuffers[i] = rf::PoolAlloc<uint8>(Context->SessionPool, WaterStreamSize(WaterSystem));
+            memcpy(WaterSystem->SimBuffers[i], WaterSystem->Vertices, WaterStreamSize(WaterSystem));
+            WaterSystem->SimStreams[i] = WaterSystem->Stream;
+            if(WaterSystem->Textures)
+                AllocTextureMips(&WaterSystem->SimTextures[i], Context->SessionPool, N, WaterSystem->TextureLevels, TextureLayers);
+        }
+        SimWaterState = State->WaterState;
+        SimWaterInterp = State->WaterStateInterp;
+        SimLatest.store(0);
+        SimWriteSlot = 1;
+        SimReadSlot = 2;
+        SimRunning.store(true);
+        SimThread = std::thread(SimThreadMain, Config->WaterSimHz);
+    }
+}
+
+void SetWakeCenter(vec2f Center)
+{
+    std::lock_guard<std::mutex> Lock(WakeMutex);
+    WakeFollowCamera = false;
+    WakeCenter = Center;
+}
+
+void SetWakeObstacles(int Count, wake_obstacle const *Obstacles)
+{
+    std::lock_guard<std::mutex> Lock(WakeMutex);
+    WakePendingCount = Min(Count, (int)water::system::WakeMaxObstacles);
+    memcpy(WakePending, Obstacles, WakePendingCount * sizeof(wake_obstacle));
+}
+
+// NOTE - Wave layer of the latest query grid to WakeMap. A step the grids couldn't keep leaves the previous layer
+// drawn, it is at most a step apart from the stream.
+void UploadWake(water::system *WaterSystem)
+{
+    if(WaterSystem->Wake.N == 0)
+        return;
+    int GridIdx = PinQueryGrid();
+    if(GridIdx < 0)
+        return;
+
+    water::wake_grid const *Grid = &WaterSystem->QueryGrids[GridIdx].Wake;
+    int Size = Grid->Size;
+    for(int i = 0; i < Square(Size); ++i)
+    {
+        real32 *Texel = WaterSystem->WakeTexels + 4 * i;
+        Texel[0] = Grid->Height[i];
+        Texel[1] = Grid->SlopeX[i];
+        Texel[2] = Grid->SlopeZ[i];
+        Texel[3] = 0.f;
+    }
+    WaterSystem->WakeDrawn = *Grid;
+    UnpinQueryGrid(GridIdx);
+    WaterSystem->WakeDrawn.Height = WaterSystem->WakeDrawn.SlopeX = WaterSystem->WakeDrawn.SlopeZ = NULL;
+    WaterSystem->WakeDrawn.Scratch = NULL;
+
+    if(Size > 0)
     {
-        uint32 Loc = glGetUniformLocation(WaterSystem->ProgramWater, "ViewMatrix");
-        rf::SendMat4(Loc, State->Camera.ViewMatrix);
-        rf::CheckGLError("ViewMatrix");
+        glBindTexture(GL_TEXTURE_2D, WaterSystem->WakeMap);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, Size, Size, GL_RGBA, GL_FLOAT, WaterSystem->WakeTexels);
+        glBindTexture(GL_TEXTURE_2D, 0);
     }
+}
+
+void Update(game::state *State, rf::input *Input)
+{
+    State->WaterCounter += Input->dTime;
+
+    if(WakeFollowCamera)
+    {
+        std::lock_guard<std::mutex> Lock(WakeMutex);
+        WakeCenter = vec2f(State->Camera.Position.x, State->Camera.Position.z);
+    }
+
+    // NOTE - Keyframes are dropped at full rate and when paused, the next throttled update starts from the current time
+    ChooseUpdateRate(WaterSystem, State->Camera);
+    bool Paused = WaterSystem->RateLevel == RateLevelCount - 1;
+    if(WaterSystem->RateLevel == 0 || Paused)
+        WaterSystem->KeyValid = false;
+
+    if(WaterSystem->BakeFrameCount > 0)
+    {
+        if(Paused)
+            return;
+        void *Dst = MapWaterMesh(WaterSystem);
+        WaterSystem->Stream = PlayBake((real32)State->WaterCounter, Dst ? Dst : WaterSystem->Vertices);
+        if(Dst)
+            UnmapWaterMesh(WaterSystem);
+        else
+            UpdateWaterMesh(WaterSystem, WaterSystem->Vertices);
+        if(WaterSystem->Textures)
+            UploadWaterTextures(WaterSystem, &WaterSystem->TextureData);
+    }
+    else if(WaterSystem->Async)
+    {
+        {
+            std::lock_guard<std::mutex> Lock(SimParamsMutex);
+            SimWaterState = State->WaterState;
+            SimWaterInterp = State->WaterStateInterp;
+            SimRateLevel = WaterSystem->RateLevel;
+        }
+
+        if(SimLatest.load(std::memory_order_relaxed) & SimFreshBit)
+        {
+            SimReadSlot = SimLatest.exchange(SimReadSlot, std::memory_order_acq_rel) & ~SimFreshBit;
+            UploadWaterMesh(WaterSystem, WaterSystem->SimBuffers[SimReadSlot]);
+            WaterSystem->Stream = WaterSystem->SimStreams[SimReadSlot];
+            if(WaterSystem->Textures)
+                UploadWaterTextures(WaterSystem, &WaterSystem->SimTextures[SimReadSlot]);
+        }
+    }
+    else if(!Paused)
+    {
+        // NOTE - The assembly writes straight into the mapped VBO, Dst must only be written to
+        void *Dst = MapWaterMesh(WaterSystem);
+        void *Out = Dst ? Dst : WaterSystem->Vertices;
+        water::texture_mips *Textures = WaterSystem->Textures ? &WaterSystem->TextureData : NULL;
+        if(WaterSystem->RateLevel == 0)
+        {
+            water::query_grid *Query = BeginQueryGrid();
+            WaterSystem->Stream = Simulate((real32)State->WaterCounter, State->WaterState, State->WaterStateInterp,
+                                           Out, WaterSystem->CompactVertices, Textures, Query);
+            if(Query)
+                PublishQueryGrid(Query, Query->Width);
+        }
+        else
+            WaterSystem->Stream = UpdateKeyframes(State->WaterCounter, UpdateRates[WaterSystem->RateLevel],
+                                                  State->WaterState, State->WaterStateInterp, Out);
+        if(Dst)
+            UnmapWaterMesh(WaterSystem);
+        else
+            UpdateWaterMesh(WaterSystem, WaterSystem->Vertices);
+        if(Textures)
+            UploadWaterTextures(WaterSystem, Textures);
+    }
+    UploadWake(WaterSystem);
+}
+
+void Destroy()
+{
+    if(SimThread.joinable())
+    {
+        SimRunning.store(false, std::memory_order_release);
+        SimThread.join();
+    }
+    stream::Destroy(&WaterSystem->StreamBuffer);
+    if(WaterSystem->TileRadius > 0)
+        stream::Destroy(&WaterSystem->TileBuffer);
+    if(WaterSystem->Wake.N > 0)
+        glDeleteTextures(1, &WaterSystem->WakeMap);
+    if(WaterSystem->Textures)
+    {
+        glDeleteTextures(1, &WaterSystem->DisplacementMap);
+        glDeleteTextures(1, &WaterSystem->SlopeMap);
+        if(WaterSystem->CascadeCount > 1)
+        {
+            glDeleteTextures(1, &WaterSystem->DetailDisplacementMap);
+            glDeleteTextures(1, &WaterSystem->DetailSlopeMap);
+        }
+    }
+}
+
+// NOTE - The surface point above (x, z) comes from the grid point x0 with x0 + D(x0) = (x, z), found by fixed-point
+// iteration x0 <- (x, z) - D(x0). The iteration contracts as long as the surface doesn't fold over itself, the
+// error shrinking by the horizontal displacement gradient at each step : a few steps on calm seas, more on choppy
+// ones. It stops once x0 moves less than SampleTolerance texels, or after SampleMaxIterations on folds, where
+// (x, z) has several surface points and the iteration can cycle between them.
+int static const SampleMaxIterations = 16;
+real32 static const SampleTolerance = 1e-3f;
+
+bool Sample(int Count, vec2f const *Points, real32 *Heights, vec3f *Normals, vec2f *Displacements)
+{
+    if(!WaterSystem)
+        return false;
+    int GridIdx = PinQueryGrid();
+    if(GridIdx < 0)
+        return false;
+
+    water::query_grid const *Grid = &WaterSystem->QueryGrids[GridIdx];
+    int N = WaterSystem->WaterN;
+    real32 ToTexel = N / Grid->Width;
+    real32 Origin = N / 2.f;
+
+    int i = 0;
+#if HAVE_SSE2
+    int Log2N = WaterSystem->FFTPlan.Log2N;
+    __m128 ToTexel4 = _mm_set1_ps(ToTexel);
+    __m128 Origin4 = _mm_set1_ps(Origin);
+    __m128 One = _mm_set1_ps(1.f);
+    __m128 AbsMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 Tolerance4 = _mm_set1_ps(SampleTolerance);
+    query_texels4 T;
+    for(; i + 4 <= Count; i += 4)
+    {
+        __m128 P01 = _mm_loadu_ps(&Points[i].x);
+        __m128 P23 = _mm_loadu_ps(&Points[i + 2].x);
+        __m128 U = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(P01, P23, _MM_SHUFFLE(2, 0, 2, 0)), ToTexel4), Origin4);
+        __m128 V = _mm_add_ps(_mm_mul_ps(_mm_shuffle_ps(P01, P23, _MM_SHUFFLE(3, 1, 3, 1)), ToTexel4), Origin4);
+
+        __m128 U0 = U, V0 = V;
+        for(int k = 0; k < SampleMaxIterations; ++k)
+        {
+            QueryTexels4(Log2N, U0, V0, &T);
+            __m128 U1 = _mm_sub_ps(U, _mm_mul_ps(QueryBilinear4(Grid->DispX, &T), ToTexel4));
+            __m128 V1 = _mm_sub_ps(V, _mm_mul_ps(QueryBilinear4(Grid->DispZ, &T), ToTexel4));
+            __m128 Step = _mm_max_ps(_mm_and_ps(_mm_sub_ps(U1, U0), AbsMask), _mm_and_ps(_mm_sub_ps(V1, V0), AbsMask));
+            U0 = U1;
+            V0 = V1;
+            if(_mm_movemask_ps(_mm_cmpgt_ps(Step, Tolerance4)) == 0)
+                break;
+        }
+        QueryTexels4(Log2N, U0, V0, &T);
+
+        // NOTE - The wave layer is added where the points are, it isn't periodic
+        __m128 WakeH = _mm_setzero_ps(), WakeSX = _mm_setzero_ps(), WakeSZ = _mm_setzero_ps();
+        if(Grid->Wake.Size > 0)
+        {
+            real32 H[4], SX[4], SZ[4];
+            for(int l = 0; l < 4; ++l)
+                WakeGridSample(&Grid->Wake, Points[i + l].x, Points[i + l].y, &H[l], &SX[l], &SZ[l]);
+            WakeH = _mm_loadu_ps(H);
+            WakeSX = _mm_loadu_ps(SX);
+            WakeSZ = _mm_loadu_ps(SZ);
+        }
+
+        if(Heights)
+        {
+            _mm_storeu_ps(Heights + i, _mm_add_ps(QueryBilinear4(Grid->Height, &T), WakeH));
+        }
+        if(Normals)
+        {
+            __m128 SlopeX = _mm_add_ps(QueryBilinear4(Grid->SlopeX, &T), WakeSX);
+            __m128 SlopeZ = _mm_add_ps(QueryBilinear4(Grid->SlopeZ, &T), WakeSZ);
+            __m128 InvLen = _mm_div_ps(One, _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(SlopeX, SlopeX), _mm_mul_ps(SlopeZ, SlopeZ)), One)));
+            real32 Nx[4], Ny[4], Nz[4];
+            _mm_storeu_ps(Nx, _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(SlopeX, InvLen)));
+            _mm_storeu_ps(Ny, InvLen);
+            _mm_storeu_ps(Nz, _mm_sub_ps(_mm_setzero_ps(), _mm_mul_ps(SlopeZ, InvLen)));
+            for(int l = 0; l < 4; ++l)
+                Normals[i + l] = vec3f(Nx[l], Ny[l], Nz[l]);
+        }
+        if(Displacements)
+        {
+            __m128 DispX = QueryBilinear4(Grid->DispX, &T);
+            __m128 DispZ = QueryBilinear4(Grid->DispZ, &T);
+            _mm_storeu_ps(&Displacements[i].x, _mm_unpacklo_ps(DispX, DispZ));
+            _mm_storeu_ps(&Displacements[i + 2].x, _mm_unpackhi_ps(DispX, DispZ));
+        }
+    }
+#endif
+    for(; i < Count; ++i)
+    {
+        real32 U = Points[i].x * ToTexel + Origin;
+        real32 V = Points[i].y * ToTexel + Origin;
+
+        real32 U0 = U, V0 = V;
+        for(int k = 0; k < SampleMaxIterations; ++k)
+        {
+            query_texels T0 = QueryTexels(N, U0, V0);
+            real32 U1 = U - QueryBilinear(Grid->DispX, T0) * ToTexel;
+            real32 V1 = V - QueryBilinear(Grid->DispZ, T0) * ToTexel;
+            real32 Step = Max(fabsf(U1 - U0), fabsf(V1 - V0));
+            U0 = U1;
+            V0 = V1;
+            if(Step <= SampleTolerance)
+                break;
+        }
+        query_texels T1 = QueryTexels(N, U0, V0);
+        real32 WakeH, WakeSX, WakeSZ;
+        WakeGridSample(&Grid->Wake, Points[i].x, Points[i].y, &WakeH, &WakeSX, &WakeSZ);
+
+        if(Heights)
+        {
+            Heights[i] = QueryBilinear(Grid->Height, T1) + WakeH;
+        }
+        if(Normals)
+        {
+            real32 SlopeX = QueryBilinear(Grid->SlopeX, T1) + WakeSX;
+            real32 SlopeZ = QueryBilinear(Grid->SlopeZ, T1) + WakeSZ;
+            real32 InvLen = 1.f / sqrtf(Square(SlopeX) + Square(SlopeZ) + 1.f);
+            Normals[i] = vec3f(-SlopeX * InvLen, InvLen, -SlopeZ * InvLen);
+        }
+        if(Displacements)
+        {
+            Displacements[i] = vec2f(QueryBilinear(Grid->DispX, T1), QueryBilinear(Grid->DispZ, T1));
+        }
+    }
+
+    UnpinQueryGrid(GridIdx);
+    return true;
+}
+
+int FindBreaking(real32 Threshold, vec2f Center, int FirstRow, int Capacity, breaking_point *Points)
+{
+    if(!WaterSystem)
+        return 0;
+    int GridIdx = PinQueryGrid();
+    if(GridIdx < 0)
+        return 0;
+
+    breaking_scan Scan = {};
+    Scan.Grid = &WaterSystem->QueryGrids[GridIdx];
+    Scan.N = WaterSystem->WaterN;
+    Scan.CellSize = Scan.Grid->Width / Scan.N;
+    Scan.InvTwoCells = 0.5f / Scan.CellSize;
+    Scan.Threshold = Threshold;
+    Scan.Center = Center;
+    Scan.Capacity = Capacity;
+    Scan.Points = Points;
+    for(int j = 0; j < Scan.N; ++j)
+    {
+        BreakingRow(&Scan, (FirstRow + j) & (Scan.N - 1));
+    }
+
+    UnpinQueryGrid(GridIdx);
+    return Scan.Found;
+}
+
+// NOTE - Decoding parameters of the vertex stream, see water::compact_vertex. The wave layer is added on top, once :
+// WakeMap on unit 6 holds its lattice points (i, j) < WakeExtent, at WakeMin + (i, j) * WakeCellSize world, in texels
+// ((i, j) + 0.5) / WakeMapSize. Outside the lattice the layer is flat.
+void SendStreamUniforms(uint32 Program)
+{
+    rf::SendInt(glGetUniformLocation(Program, "WaterCompactVertices"), WaterSystem->CompactVertices ? 1 : 0);
+    rf::SendInt(glGetUniformLocation(Program, "WaterGridN"), WaterSystem->WaterN);
+    rf::SendFloat(glGetUniformLocation(Program, "WaterWidth"), WaterSystem->Stream.Width);
+    rf::SendVec3(glGetUniformLocation(Program, "WaterDisplacementScale"), WaterSystem->Stream.DisplacementScale);
+
+    water::wake_grid const *Wake = &WaterSystem->WakeDrawn;
+    rf::SendInt(glGetUniformLocation(Program, "WakeExtent"), Wake->Size);
+    if(Wake->Size == 0)
+        return;
+    rf::SendInt(glGetUniformLocation(Program, "WakeMap"), 6);
+    rf::SendInt(glGetUniformLocation(Program, "WakeMapSize"), Wake->Capacity);
+    rf::SendVec2(glGetUniformLocation(Program, "WakeMin"), Wake->Min);
+    rf::SendFloat(glGetUniformLocation(Program, "WakeCellSize"), Wake->CellSize);
+    glActiveTexture(GL_TEXTURE6);
+    glBindTexture(GL_TEXTURE_2D, WaterSystem->WakeMap);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// NOTE - How far the drawn surface leaves the base plane and its grid point, wave layer included
+vec3f SurfaceExtent(water::system const *S)
+{
+    return S->Stream.DisplacementScale + vec3f(0.f, S->WakeDrawn.MaxHeight, 0.f);
+}
+
+// NOTE - Texture output on units 2 and 3, see water::texture_mips. WaterWidth is their world size. The detail
+// cascades are the layers of the arrays on units 4 and 5, layer l tiling the patch WaterCascadeRatio^(l+1) times.
+void SendTextureUniforms(uint32 Program)
+{
+    rf::SendInt(glGetUniformLocation(Program, "WaterTextures"), WaterSystem->Textures ? 1 : 0);
+    if(!WaterSystem->Textures)
+        return;
+    rf::SendInt(glGetUniformLocation(Program, "WaterDisplacementMap"), 2);
+    rf::SendInt(glGetUniformLocation(Program, "WaterSlopeMap"), 3);
+    rf::SendInt(glGetUniformLocation(Program, "WaterDetailLayers"), WaterSystem->CascadeCount - 1);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, WaterSystem->DisplacementMap);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, WaterSystem->SlopeMap);
+    if(WaterSystem->CascadeCount > 1)
+    {
+        rf::SendInt(glGetUniformLocation(Program, "WaterDetailDisplacementMap"), 4);
+        rf::SendInt(glGetUniformLocation(Program, "WaterDetailSlopeMap"), 5);
+        rf::SendFloat(glGetUniformLocation(Program, "WaterCascadeRatio"), (real32)CascadeRatio);
+        glActiveTexture(GL_TEXTURE4);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, WaterSystem->DetailDisplacementMap);
+        glActiveTexture(GL_TEXTURE5);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, WaterSystem->DetailSlopeMap);
+    }
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// NOTE - The stream on the tiles the view keeps, culled on the CPU and written straight into the instance slot
+void RenderTiles(game::state *State)
+{
+    water::system *S = WaterSystem;
+    water::tile_frustum Frustum = water::MakeTileFrustum(State->Camera, S->ViewTanY, S->ViewAspect, S->ViewNear, S->ViewFar);
+    vec3f Eye = State->Camera.Position + State->Camera.PositionDecimal;
+
+    // NOTE - The displacement range of the stream bounds how far the surface leaves its tile
+    vec2f *Dst = (vec2f*)stream::Map(&S->TileBuffer);
+    S->TileCount = water::CullTiles(&Frustum, Eye, S->Stream.Width, SurfaceExtent(S), S->TileRadius,
+                                    S->TileCapacity, Dst ? Dst : S->TileOffsets);
+    if(Dst)
+        stream::Unmap(&S->TileBuffer);
+    else
+        stream::Write(&S->TileBuffer, S->TileOffsets, S->TileCount * sizeof(vec2f));
+    BindTileInstances(S);
+
+    if(S->TileCount > 0)
+    {
+        glDisable(GL_CULL_FACE);
+        glUseProgram(S->ProgramTiles);
+        rf::SendMat4(glGetUniformLocation(S->ProgramTiles, "ViewMatrix"), State->Camera.ViewMatrix);
+        rf::SendFloat(glGetUniformLocation(S->ProgramTiles, "Time"), (real32)State->EngineTime);
+        SendStreamUniforms(S->ProgramTiles);
+        SendTextureUniforms(S->ProgramTiles);
+        glBindVertexArray(S->VAO);
+        if(S->Indices.Mode == GL_TRIANGLE_STRIP)
+        {
+            glEnable(GL_PRIMITIVE_RESTART);
+            glPrimitiveRestartIndex(S->Indices.Restart);
+        }
+        glDrawElementsInstanced(S->Indices.Mode, S->Indices.Count, S->Indices.Type, 0, S->TileCount);
+        glDisable(GL_PRIMITIVE_RESTART);
+        glBindVertexArray(0);
+        glEnable(GL_CULL_FACE);
+    }
+    stream::Fence(&S->TileBuffer);
+}
+
+// NOTE - Uniforms of the projected grid programs. ProjectorRange* is the clipped range of ComputeProjectorRange : grid
+// point (u, v) of [0, 1]^2 is the ray ProjectorRay + u * ProjectorRayU + v * ProjectorRayV from
+// ProjectorRangePosition, met with the base plane, so that no vertex lands outside the water the frustum sees.
+void SendProjectedUniforms(uint32 Program, game::state *State, projector_range const &Range, vec3f ProjPos,
+                           mat4f const &ProjectorMatrix)
+{
+    rf::SendMat4(glGetUniformLocation(Program, "ViewMatrix"), State->Camera.ViewMatrix);
+    rf::CheckGLError("ViewMatrix");
+    rf::SendFloat(glGetUniformLocation(Program, "Time"), (real32)State->EngineTime);
+    SendStreamUniforms(Program);
+    SendTextureUniforms(Program);
+    rf::SendVec3(glGetUniformLocation(Program, "ProjectorPosition"), ProjPos);
+    rf::SendMat4(glGetUniformLocation(Program, "WaterProjMatrix"), ProjectorMatrix);
+    rf::SendVec3(glGetUniformLocation(Program, "ProjectorRangePosition"), Range.Position);
+    rf::SendVec3(glGetUniformLocation(Program, "ProjectorRay"), Range.Ray);
+    rf::SendVec3(glGetUniformLocation(Program, "ProjectorRayU"), Range.RayU);
+    rf::SendVec3(glGetUniformLocation(Program, "ProjectorRayV"), Range.RayV);
+}
+
+// NOTE - The projected grid slab by slab, nothing above the horizon. SlabRange (bottom, top) places the unit grid
+// on the screen rows of the slab, SlabDistances (near, far) is how far the water seen there is.
+void RenderSlabs(game::state *State, projector_range const &Range, vec3f ProjPos, mat4f const &ProjectorMatrix)
+{
+    water::system *S = WaterSystem;
+    water::screen_slab Slabs[water::MaxScreenSlabs];
+    real32 Horizon;
+    int SlabCount = water::ComputeScreenSlabs(State->Camera, S->ViewTanY, S->ViewAspect, S->ViewFar,
+                                              SurfaceExtent(S).y, water::system::SlabLodCount - 1,
+                                              &S->SlabDistance, Slabs, &Horizon);
+
+    glEnable(GL_PRIMITIVE_RESTART);
+    for(int i = 0; i < SlabCount; ++i)
+    {
+        water::screen_slab const &Slab = Slabs[i];
+        uint32 Program = S->ProgramSlabs[Slab.Lod];
+        mesh::indices const &Indices = S->SlabIndices[Slab.Lod];
+        glUseProgram(Program);
+        SendProjectedUniforms(Program, State, Range, ProjPos, ProjectorMatrix);
+        rf::SendVec2(glGetUniformLocation(Program, "SlabRange"), vec2f(Slab.Bottom, Slab.Top));
+        rf::SendVec2(glGetUniformLocation(Program, "SlabDistances"), vec2f(Slab.NearDistance, Slab.FarDistance));
+        glBindVertexArray(S->SlabVAO[Slab.Lod]);
+        glPrimitiveRestartIndex(Indices.Restart);
+        glDrawElements(Indices.Mode, Indices.Count, Indices.Type, 0);
+    }
+    glBindVertexArray(0);
+    glDisable(GL_PRIMITIVE_RESTART);
+}
+
+void Render(game::state *State, uint32 /*Envmap*/, uint32 /*GGXLUT*/)
+{
+    if(WaterSystem->TileRadius > 0)
+    {
+        RenderTiles(State);
+        stream::Fence(&WaterSystem->StreamBuffer);
+        return;
+    }
+
+    // NOTE - Nothing to draw when the view misses the slab the waves move the surface in, otherwise the range bounds
+    // the projected grid of the GPU (see SendProjectedUniforms)
+    projector_range Range;
+    if(!ComputeProjectorRange(&Range, State->Camera, WaterSystem->ViewTanY, WaterSystem->ViewAspect,
+                              WaterSystem->ViewNear, WaterSystem->ViewFar, SurfaceExtent(WaterSystem).y))
+    {
+        stream::Fence(&WaterSystem->StreamBuffer);
+        return;
+    }
+
+    glDisable(GL_CULL_FACE);
 
 #if 0
     camera WPC = State->Camera;
@@ -526,69 +2644,31 @@ void Render(game::state *State, uint32 /*Envmap*/, uint32 /*GGXLUT*/)
     vec3f ProjUp = Normalize(Cross(ProjRight, ProjFwd));
     mat4f ProjectorMatrix = mat4f::LookAt(ProjPos, ProjTarget, ProjUp);
 
-    rf::SendFloat(glGetUniformLocation(WaterSystem->ProgramWater, "Time"), (real32)State->EngineTime);
-    rf::SendVec3(glGetUniformLocation(WaterSystem->ProgramWater, "ProjectorPosition"), ProjPos);
-    rf::SendMat4(glGetUniformLocation(WaterSystem->ProgramWater, "WaterProjMatrix"), ProjectorMatrix);
-    glBindVertexArray(ScreenQuad.VAO);
-    RenderMesh(&ScreenQuad);
-    glEnable(GL_CULL_FACE);
-#if 0
-    glUseProgram(WaterSystem->ProgramWater);
-    glDisable(GL_CULL_FACE);
+    if(WaterSystem->SlabDistance > 0.f)
     {
-        uint32 Loc = glGetUniformLocation(WaterSystem->ProgramWater, "ViewMatrix");
-        rf::SendMat4(Loc, State->Camera.ViewMatrix);
-        rf::CheckGLError("ViewMatrix");
+        RenderSlabs(State, Range, ProjPos, ProjectorMatrix);
     }
-    uint32 Loc = glGetUniformLocation(WaterSystem->ProgramWater, "LightColor");
-    rf::SendVec4(Loc, State->LightColor);
-    Loc = glGetUniformLocation(WaterSystem->ProgramWater, "CameraPos");
-    rf::SendVec3(Loc, State->Camera.Position);
-    Loc = glGetUniformLocation(WaterSystem->ProgramWater, "SunDirection");
-    rf::SendVec3(Loc, State->SunDirection);
-    Loc = glGetUniformLocation(WaterSystem->ProgramWater, "Time");
-    rf::SendFloat(Loc, State->EngineTime);
-
-
-    Loc = glGetUniformLocation(WaterSystem->ProgramWater, "ModelMatrix");
-    mat4f ModelMatrix;
-    glBindVertexArray(WaterSystem->VAO);
-
-    beaufort_state *WaterStateA = &WaterSystem->States[State->WaterState];
-    beaufort_state *WaterStateB = &WaterSystem->States[State->WaterState + 1];
-    real32 dWidth = Mix((real32)WaterStateA->Width, (real32)WaterStateB->Width, State->WaterStateInterp);
-    //dWidth *= (State->WaterState+1) * 1.5;
-
-    real32 Interp = (State->WaterState+1) + State->WaterStateInterp;
-
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, GGXLUT);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_CUBE_MAP, Envmap);
-
-
-    int Repeat = 1;
-    int Middle = (Repeat-1)/2;
-    for(int j = 0; j < Repeat; ++j)
+    else
     {
-        for(int i = 0; i < Repeat; ++i)
-        {
-            // MIDDLE
-            real32 PositionScale = dWidth * (Interp);
-            vec3f Position(PositionScale * (Middle-i), 0.f, PositionScale * (Middle-j));
-            vec3f Scale(Interp, Interp, Interp);
-            vec3f Rotation(0, State->WaterDirection, 0);
-            mat4f RotationMatrix;
-            RotationMatrix.FromAxisAngle(Rotation);
-            ModelMatrix.FromTRS(Position, vec3f(0), Scale);
-            ModelMatrix = RotationMatrix * ModelMatrix;
-
-            rf::SendMat4(Loc, ModelMatrix);
-            glDrawElements(GL_TRIANGLES, WaterSystem->IndexCount, GL_UNSIGNED_INT, 0);
-        }
+        glUseProgram(WaterSystem->ProgramWater);
+        SendProjectedUniforms(WaterSystem->ProgramWater, State, Range, ProjPos, ProjectorMatrix);
+        glBindVertexArray(ScreenQuad.VAO);
+        RenderMesh(&ScreenQuad);
     }
     glEnable(GL_CULL_FACE);
-#endif
+
+    // NOTE - Every draw reading this frame's stream slot is issued
+    stream::Fence(&WaterSystem->StreamBuffer);
+}
+
+bool GetProjectedGrid(camera const &Camera, int Columns, int Rows, vec3f *Vertices)
+{
+    projector_range Range;
+    if(!ComputeProjectorRange(&Range, Camera, WaterSystem->ViewTanY, WaterSystem->ViewAspect, WaterSystem->ViewNear,
+                              WaterSystem->ViewFar, SurfaceExtent(WaterSystem).y))
+        return false;
+    ProjectGrid(&Range, Columns, Rows, Vertices);
+    return true;
 }
 
 void ReloadShaders(rf::context *Context)
@@ -605,6 +2685,32 @@ void ReloadShaders(rf::context *Context)
 
     rf::ctx::RegisterShader3D(Context, WaterSystem->ProgramWater);
 
+    // NOTE - The tiles draw the stream as a mesh, attribute 3 being the offset of the tile
+    if(WaterSystem->TileRadius > 0)
+    {
+        rf::ConcatStrings(VSPath, rf::ctx::GetExePath(Context), "data/shaders/water_tiles_vert.glsl");
+        WaterSystem->ProgramTiles = rf::BuildShader(Context, VSPath, FSPath);
+        glUseProgram(WaterSystem->ProgramTiles);
+        rf::CheckGLError("Water Tiles Shader");
+
+        rf::ctx::RegisterShader3D(Context, WaterSystem->ProgramTiles);
+    }
+
+    // NOTE - One program per slab LOD, the vertex shader stretching the unit grid over the rows of the slab
+    if(WaterSystem->SlabDistance > 0.f)
+    {
+        rf::ConcatStrings(VSPath, rf::ctx::GetExePath(Context), "data/shaders/water_slab_vert.glsl");
+        for(int l = 0; l < water::system::SlabLodCount; ++l)
+        {
+            rf::ConcatStrings(FSPath, rf::ctx::GetExePath(Context), SlabFragmentShaders[l]);
+            WaterSystem->ProgramSlabs[l] = rf::BuildShader(Context, VSPath, FSPath);
+            glUseProgram(WaterSystem->ProgramSlabs[l]);
+            rf::CheckGLError("Water Slab Shader");
+
+            rf::ctx::RegisterShader3D(Context, WaterSystem->ProgramSlabs[l]);
+        }
+    }
+
     /*
     MakeRelativePath(RH, VSPath, "data/shaders/waterproj_vert.glsl");
     MakeRelativePath(RH, VSPath, "data/shaders/waterproj_frag.glsl");
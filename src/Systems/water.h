@@ -2,12 +2,21 @@
 #define WATER_H
 
 #include "definitions.h"
+#include "water_fft.h"
+#include "water_wake.h"
+#include "water_tiles.h"
+#include "water_projector.h"
+#include "stream_buffer.h"
+#include "mesh_index.h"
 
 namespace game {
     struct state;
 }
 
 namespace water {
+    int static const MaxCascades = 4;
+    int static const MaxTextureLevels = 10; // Of FFTMaxSize texels, down to 1
+
     struct beaufort_state
     {
         int Width;
@@ -15,49 +24,254 @@ namespace water {
         real32 Amplitude;
 
         void *OrigPositions;
-        void *HTilde0;
-        void *HTilde0mk;
+        void *HTilde0[MaxCascades];   // (N+1)^2 per cascade, the first one in VertexData
+        void *HTilde0mk[MaxCascades];
+    };
+
+    // NOTE - One band of the ocean spectrum, simulated on its own patch of width state Width / Ratio with
+    // the same N. Each cascade only keeps the wave vectors of radius [ModeMin, ModeMax) in its own mode
+    // units, so the cascades sum to one spectrum without overlap. See MakeCascade.
+    // The first cascade is everything the vertex grid resolves : the stream, the query grid and Sample. The
+    // others are finer than that grid and only go to their own layer of the texture output.
+    struct cascade
+    {
+        int Ratio;          // 1, CascadeRatio, CascadeRatio^2...
+        real32 ModeMin;
+        real32 ModeMax;
+
+        complex *hTilde;
+        complex *hTildeSlopeX;
+        complex *hTildeSlopeZ;
+        complex *hTildeDX;
+        complex *hTildeDZ;
+
+        // NOTE - h~0 and h~0* blended between the current Beaufort states, see UpdateBlendedSpectrum
+        complex *HTilde0Blend;   // N * N
+        complex *HTilde0mkBlend; // N * N
+
+        // NOTE - Dispersion of each wave vector as a multiple of W0, see UpdateDispersionTable
+        uint16 *OmegaIndex;      // N * N
+        real32 OmegaWidth;       // Blended patch width OmegaIndex was built for
+    };
+
+    // NOTE - Per-frame vertex stream, head of VertexData and of the VBO
+    struct vertex
+    {
+        vec3f Position;
+        vec3f Normal;
+    };
+
+    // NOTE - Compact vertex stream, 8 bytes instead of 24 (Config->WaterCompactVertices). Decoding, in the
+    // water vertex shader, for vertex i of the (N+1)^2 grid with n' = i % (N+1) and m' = i / (N+1) :
+    //   Position = ((n' - N/2) * Width/N, 0, (m' - N/2) * Width/N) + Displacement * DisplacementScale
+    //   Normal = normalize(Nx, 1 - |Nx| - |Nz|, Nz), Normal being (Nx, Nz), octahedral around +Y
+    // Attribute 0 is Displacement, 3 normalized GL_SHORT, attribute 1 is Normal, 2 normalized GL_BYTE.
+    // WaterGridN, WaterWidth and WaterDisplacementScale are sent as uniforms, see stream_info.
+    struct compact_vertex
+    {
+        int16 Displacement[3];
+        int8 Normal[2];
+    };
+
+    // NOTE - What the shader needs to decode a compact stream, it changes every step and travels with it
+    struct stream_info
+    {
+        real32 Width;
+        vec3f DisplacementScale;
+    };
+
+    // NOTE - Ocean surface of one completed step at the N * N grid points, SoA, what Sample reads. The fields
+    // are periodic over the patch : grid point (n', m') lies at ((n' - N/2) * Width/N, (m' - N/2) * Width/N)
+    // and moves to there + (DispX, Height, DispZ), with surface slopes (SlopeX, SlopeZ).
+    struct query_grid
+    {
+        real32 Width;
+        real32 *DispX;  // N * N each
+        real32 *Height;
+        real32 *DispZ;
+        real32 *SlopeX;
+        real32 *SlopeZ;
+        wake_grid Wake; // Wave layer of the step, at this grid's cell size. Not periodic : it is only where it is.
+    };
+
+    // NOTE - Ocean surface of one step as two tileable textures of N * N RGBA float texels and their full mip chains,
+    // level l being (N >> l)^2 texels, row-major :
+    //   Displacement : (DispX, Height, DispZ, SlopeX * SlopeZ)
+    //   Slope : (SlopeX, SlopeZ, SlopeX^2, SlopeZ^2)
+    // Texel (n', m') of level 0 is grid point (n', m') of the query_grid, the surface point ending above (x, z) being
+    // around UV = (x, z) / Width + 0.5 + 0.5 / N. A coarser texel is the mean of the 4 under it, so the slope moments
+    // stay exact : E[S^2] - E[S]^2 and E[SxSz] - E[Sx].E[Sz] are the slope variances and covariance of the waves the
+    // texel averages out, for LEAN-style shading of the distant ocean.
+    // Layer 0 is the vertex grid. Layer c > 0 is cascade c alone, same layout over its own patch Ratio times
+    // narrower : its texel (n', m') is around UV * Ratio, with the displacement and slopes of that cascade only.
+    struct texture_mips
+    {
+        int Layers;         // CascadeCount
+        real32 *Displacement[MaxCascades][MaxTextureLevels];
+        real32 *Slope[MaxCascades][MaxTextureLevels];
     };
 
     struct system
     {
         int static const BeaufortStateCount = 4;
-        int static const WaterN = 64;
+        int static const WakeMaxObstacles = 1024;
+
+        int WaterN; // Grid resolution, one of the FFT supported sizes
 
         size_t VertexDataSize;
         size_t VertexCount;
         real32 *VertexData;
-        size_t IndexDataSize;
-        uint32 IndexCount;
-        uint32 *IndexData;
+        mesh::indices Indices;  // Grid of the stream, cache-ordered strips
 
         beaufort_state States[BeaufortStateCount];
 
-        // NOTE - Accessor Pointers, index VertexData
-        void *Positions;
-        void *Normals;
+        // NOTE - Accessor Pointer, head of VertexData
+        vertex *Vertices; // (N+1)^2
 
-        complex *hTilde;
-        complex *hTildeSlopeX;
-        complex *hTildeSlopeZ;
-        complex *hTildeDX;
-        complex *hTildeDZ;
+        // NOTE - The cascades all run through one batched update, the vertex stream being the first one
+        int CascadeCount;
+        cascade Cascades[MaxCascades];
+        real32 *CascadeData;     // Beaufort state spectra of the cascades past the first, see WaterBeaufortStateSetup
+
+        int BlendState;          // WaterState and WaterStateInterp the blended spectra were built for
+        real32 BlendInterp;
+        bool BlendDirty;         // Set when the Beaufort states themselves change
+        vec3f DisplacementSigma; // Bound on the standard deviation of the summed displacements
+
+        // NOTE - Phases shared by all the cascades, see UpdatePhases
+        int PhaseCount;
+        complex *Phases;    // PhaseCount, exp(i.j.W0.T) for the current step
+
+        // NOTE - Vertex stream format, vertex or compact_vertex. Vertices is also where the stream is built
+        // when the VBO can't be mapped, it is large enough for both.
+        bool CompactVertices;
+        stream_info Stream;      // Of the stream in the current StreamBuffer slot
+
+        // NOTE - Asynchronous mode, the ocean runs on its own thread and triple-buffers its
+        // vertex stream (same format as the VBO), see SimThreadMain
+        bool Async;
+        void *SimBuffers[3];
+        stream_info SimStreams[3];
+
+        // NOTE - CPU copies of the surface for Sample, rotated by every step, see BeginQueryGrid
+        query_grid QueryGrids[3];
+
+        // NOTE - Interactive wave layer, stepped with the ocean. It stays out of the periodic stream : each step
+        // filters it to the ocean cell size into its query grid (see StepWake), Sample adds it where it is and the
+        // shaders read it from WakeMap, uploaded from the latest query grid (see UploadWake).
+        wake Wake;
+        int WakeObstacleCount;
+        wake_obstacle *WakeObstacles;   // WakeMaxObstacles, copy of the latest SetWakeObstacles for the step
+        real32 *WakeTexels;             // Capacity^2 RGBA, staging of the upload
+        uint32 WakeMap;                 // Capacity^2 RGBA16F : height, slope x, slope z
+        wake_grid WakeDrawn;            // What WakeMap holds, its fields left NULL
+
+        // NOTE - Baked playback of one ocean period, see Bake
+        int BakeFrameCount;         // 0 : live simulation
+        real32 BakeFPS;
+        int BakeState;              // Sea state the bake was made for
+        real32 BakeInterp;
+        int16 *BakeDisplacements;   // BakeFrameCount * N * N * 3, scaled by BakeScales
+        int8 *BakeNormals;          // BakeFrameCount * N * N * 2, octahedral
+        vec3f *BakeScales;          // BakeFrameCount, displacement range of each frame
+
+        // NOTE - Update rate chosen from the camera, see ChooseUpdateRate. Under the full rate, keyframes are
+        // simulated one period ahead and the stream and query grid are blended between the two latest, see
+        // UpdateKeyframes.
+        bool Throttle;
+        real32 ViewTanY;            // tan(FOV / 2)
+        real32 ViewAspect;
+        real32 ViewNear;
+        real32 ViewFar;
+        int RateLevel;              // In UpdateRates
+        int AltitudeLevel;          // Hysteresis state of the rules
+        bool Sparse;
+        bool Hidden;
+        bool KeyValid;
+        vertex *Keyframes[2];       // (N+1)^2 each, full vertices whatever the stream format
+        stream_info KeyStreams[2];
+        real64 KeyTimes[2];
+        query_grid KeyQueries[2];   // Never published, Sample reads their blend
+
+        // NOTE - Texture output of the steps, built along with the stream, see texture_mips. Each step writes its
+        // own copy, uploaded with the stream : layer 0 to DisplacementMap and SlopeMap, the cascades past the first
+        // to the layers of the DetailDisplacementMap and DetailSlopeMap arrays.
+        bool Textures;
+        int TextureLevels;              // Log2(N) + 1
+        texture_mips TextureData;       // Synchronous steps and playback
+        texture_mips SimTextures[3];    // Asynchronous mode, with SimBuffers
+        texture_mips KeyTextures[2];    // Throttled mode, with Keyframes
+        uint32 DisplacementMap;
+        uint32 SlopeMap;
+        uint32 DetailDisplacementMap;   // 0 with a single cascade
+        uint32 DetailSlopeMap;
+
+        // NOTE - Tiled rendering, 0 : the projected grid. The stream is drawn on every tile around the camera the view
+        // frustum keeps, in one instanced draw, see CullTiles.
+        int TileRadius;
+        int TileCapacity;           // (2 TileRadius + 1)^2
+        int TileCount;              // Instances of the current frame
+        vec2f *TileOffsets;         // TileCapacity, where the instances are built when the slot can't be mapped
+        stream::buffer TileBuffer;  // Per-frame instance offsets, attribute 3
+        uint32 ProgramTiles;
+
+        // NOTE - Projected grid in screen slabs, near to far, 0 SlabDistance : one screen quad. Each slab draws the
+        // unit grid of its LOD stretched over its rows with its own shader, see ComputeScreenSlabs.
+        int static const SlabLodCount = 2;
+        real32 SlabDistance;        // Of the water where the far slab starts
+        uint32 SlabVAO[SlabLodCount];
+        uint32 SlabVBO[SlabLodCount][2]; // 0 : idata, 1 : unit grid (u, v)
+        mesh::indices SlabIndices[SlabLodCount];
+        uint32 ProgramSlabs[SlabLodCount];
 
         // NOTE - FFT system
-        int Switch;
-        int Log2N;
-        complex *FFTC[2];
-        complex **FFTW;
-        uint32 *Reversed;
+        fft_plan FFTPlan;
+        bool FFTPacked; // 3 transforms instead of 5, see FFTPackSpectra
 
         uint32 VAO;
-        uint32 VBO[2]; // 0 : idata, 1 : vdata
+        uint32 VBO[2]; // 0 : idata, 1 : static vdata
+        stream::buffer StreamBuffer; // Per-frame vertex stream, attributes 0 and 1
         uint32 ProgramWater;
     };
 
-    void Init(game::state *State, rf::context *Context, uint32 BeaufortState);
+    void Init(game::state *State, rf::context *Context, config const *Config, uint32 BeaufortState);
     void Update(game::state *State, rf::input *Input);
+    void Destroy();
     void ReloadShaders(rf::context *Context);
     void Render(game::state *State, uint32 Envmap, uint32 GGXLUT);
+
+    // NOTE - Ocean surface above Count points (x, z) of the water plane, from the latest completed step. Safe from
+    // any thread, also while the next step is simulated. Any output can be NULL. Returns false before the first
+    // step, the outputs left untouched.
+    //   Heights : surface height above each point
+    //   Normals : surface normal there
+    //   Displacements : horizontal choppy displacement of the surface point ending above each point
+    bool Sample(int Count, vec2f const *Points, real32 *Heights, vec3f *Normals, vec2f *Displacements);
+
+    // NOTE - Base plane points of the projected grid of Camera with the view of the ocean, (Columns + 1) * (Rows + 1)
+    // laid out like ProjectGrid, the range covering the displacements of the latest stream. Main thread, no GL
+    // needed. Returns false, Vertices left untouched, when no water is in view.
+    bool GetProjectedGrid(camera const &Camera, int Columns, int Rows, vec3f *Vertices);
+
+    // NOTE - Grid point of a completed step where the waves break, see FindBreaking
+    struct breaking_point
+    {
+        vec3f Position;     // On the surface
+        vec3f Normal;
+        real32 Jacobian;    // Of the horizontal displacement : 1 undisturbed, < 1 compressed, < 0 folded over
+        real32 Area;        // Of the water plane each grid point stands for, m^2
+    };
+
+    // NOTE - Grid points of the latest completed step whose displacement Jacobian is under Threshold, on the tile
+    // of the periodic patch nearest to Center. Thread-safe like Sample. The scan starts at row FirstRow (mod N)
+    // and wraps around, only the first Capacity points found are written.
+    // Returns how many points break in all, 0 before the first step.
+    int FindBreaking(real32 Threshold, vec2f Center, int FirstRow, int Capacity, breaking_point *Points);
+
+    // NOTE - The wave layer follows the camera until SetWakeCenter is called, then stays where it was last put
+    void SetWakeCenter(vec2f Center);
+
+    // Obstacles of the next ocean steps, replacing the previous ones. At most WakeMaxObstacles are kept.
+    void SetWakeObstacles(int Count, wake_obstacle const *Obstacles);
 }
 #endif
@@ -0,0 +1,430 @@
+#include "water_fft.h"
+#include "rf/utils.h"
+#include "jobs.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+// NOTE - SIMD lane abstraction for the batched FFT. Each lane holds one independent line (row or
+// column) of the transform, so a butterfly is the exact same scalar math done on FFTLaneCount lines.
+#if defined(__AVX__)
+typedef __m256 fft_lane;
+int static const FFTLaneCount = 8;
+inline fft_lane LaneLoad(real32 const *P) { return _mm256_loadu_ps(P); }
+inline void LaneStore(real32 *P, fft_lane V) { _mm256_storeu_ps(P, V); }
+inline fft_lane LaneSet1(real32 V) { return _mm256_set1_ps(V); }
+inline fft_lane LaneAdd(fft_lane A, fft_lane B) { return _mm256_add_ps(A, B); }
+inline fft_lane LaneSub(fft_lane A, fft_lane B) { return _mm256_sub_ps(A, B); }
+inline fft_lane LaneMul(fft_lane A, fft_lane B) { return _mm256_mul_ps(A, B); }
+#elif HAVE_SSE2
+typedef __m128 fft_lane;
+int static const FFTLaneCount = 4;
+inline fft_lane LaneLoad(real32 const *P) { return _mm_loadu_ps(P); }
+inline void LaneStore(real32 *P, fft_lane V) { _mm_storeu_ps(P, V); }
+inline fft_lane LaneSet1(real32 V) { return _mm_set1_ps(V); }
+inline fft_lane LaneAdd(fft_lane A, fft_lane B) { return _mm_add_ps(A, B); }
+inline fft_lane LaneSub(fft_lane A, fft_lane B) { return _mm_sub_ps(A, B); }
+inline fft_lane LaneMul(fft_lane A, fft_lane B) { return _mm_mul_ps(A, B); }
+#else
+typedef real32 fft_lane;
+int static const FFTLaneCount = 1;
+inline fft_lane LaneLoad(real32 const *P) { return *P; }
+inline void LaneStore(real32 *P, fft_lane V) { *P = V; }
+inline fft_lane LaneSet1(real32 V) { return V; }
+inline fft_lane LaneAdd(fft_lane A, fft_lane B) { return A + B; }
+inline fft_lane LaneSub(fft_lane A, fft_lane B) { return A - B; }
+inline fft_lane LaneMul(fft_lane A, fft_lane B) { return A * B; }
+#endif
+
+constexpr int FFTLog2(int N) { return N > 1 ? 1 + FFTLog2(N >> 1) : 0; }
+
+uint32 FFTReverse(uint32 i, int Log2N)
+{
+    uint32 Res = 0;
+    for(int j = 0; j < Log2N; ++j)
+    {
+        Res = (Res << 1) + (i & 1);
+        i >>= 1;
+    }
+    return Res;
+}
+
+complex FFTW(uint32 X, uint32 N)
+{
+    float V = M_TWO_PI * X / N;
+    return complex(cosf(V), sinf(V));
+}
+
+// NOTE - All kernels below are instanced for each supported N, so that the stage loops have
+// compile-time trip counts and strides.
+
+template<int N>
+void FFTEvaluate(water::fft_plan const *Plan, water::fft_scratch *S, complex *Input, complex *Output, int Stride, int Offset)
+{
+    for(int i = 0; i < N; ++i)
+        S->FFTC[S->Switch][i] = Input[Plan->Reversed[i] * Stride + Offset];
+
+    int Loops = N >> 1;
+    int Size = 2;
+    int SizeOver2 = 1;
+    int W_ = 0;
+    for(int j = 1; j <= FFTLog2(N); ++j)
+    {
+        S->Switch ^= 1;
+        for(int i = 0; i < Loops; ++i)
+        {
+            complex *FFTCDst = S->FFTC[S->Switch];
+            complex *FFTCSrc = S->FFTC[S->Switch^1];
+            for(int k = 0; k < SizeOver2; ++k)
+            {
+                FFTCDst[Size * i + k] = FFTCSrc[Size * i + k] +
+                                        FFTCSrc[Size * i + SizeOver2 + k] * Plan->FFTW[W_][k];
+            }
+            for(int k = SizeOver2; k < Size; ++k)
+            {
+                FFTCDst[Size * i + k] = FFTCSrc[Size * i - SizeOver2 + k] -
+                                        FFTCSrc[Size * i + k] * Plan->FFTW[W_][k - SizeOver2];
+            }
+        }
+        Loops >>= 1;
+        Size <<= 1;
+        SizeOver2 <<= 1;
+        W_++;
+    }
+
+    for(int i = 0; i < N; ++i)
+        Output[i * Stride + Offset] = S->FFTC[S->Switch][i];
+}
+
+// NOTE - Batched version of FFTEvaluate, transforming FFTLaneCount lines in place.
+// Line l of the batch starts at Offset + l * LineStride, and its elements are Stride apart.
+// The lines are gathered (bit-reversed) in the split Re/Im lane scratch, where the in-place radix-2
+// butterflies run with a broadcasted twiddle, then scattered back.
+template<int N>
+void FFTEvaluateLanes(water::fft_plan const *Plan, water::fft_scratch *S, complex *Data, int Stride, int LineStride, int Offset)
+{
+    real32 *Re = S->LaneRe[0];
+    real32 *Im = S->LaneIm[0];
+
+    for(int i = 0; i < N; ++i)
+    {
+        complex const *Src = Data + Plan->Reversed[i] * Stride + Offset;
+        for(int l = 0; l < FFTLaneCount; ++l)
+        {
+            Re[i * FFTLaneCount + l] = Src[l * LineStride].r;
+            Im[i * FFTLaneCount + l] = Src[l * LineStride].i;
+        }
+    }
+
+    int Size = 2;
+    int SizeOver2 = 1;
+    for(int j = 0; j < FFTLog2(N); ++j)
+    {
+        for(int k = 0; k < SizeOver2; ++k)
+        {
+            fft_lane Wr = LaneSet1(Plan->FFTW[j][k].r);
+            fft_lane Wi = LaneSet1(Plan->FFTW[j][k].i);
+            for(int i = k; i < N; i += Size)
+            {
+                real32 *ARe = Re + i * FFTLaneCount;
+                real32 *AIm = Im + i * FFTLaneCount;
+                real32 *BRe = ARe + SizeOver2 * FFTLaneCount;
+                real32 *BIm = AIm + SizeOver2 * FFTLaneCount;
+
+                fft_lane Ar = LaneLoad(ARe), Ai = LaneLoad(AIm);
+                fft_lane Br = LaneLoad(BRe), Bi = LaneLoad(BIm);
+                fft_lane Tr = LaneSub(LaneMul(Br, Wr), LaneMul(Bi, Wi));
+                fft_lane Ti = LaneAdd(LaneMul(Br, Wi), LaneMul(Bi, Wr));
+
+                LaneStore(ARe, LaneAdd(Ar, Tr));
+                LaneStore(AIm, LaneAdd(Ai, Ti));
+                LaneStore(BRe, LaneSub(Ar, Tr));
+                LaneStore(BIm, LaneSub(Ai, Ti));
+            }
+        }
+        Size <<= 1;
+        SizeOver2 <<= 1;
+    }
+
+    for(int i = 0; i < N; ++i)
+    {
+        complex *Dst = Data + i * Stride + Offset;
+        for(int l = 0; l < FFTLaneCount; ++l)
+        {
+            Dst[l * LineStride].r = Re[i * FFTLaneCount + l];
+            Dst[l * LineStride].i = Im[i * FFTLaneCount + l];
+        }
+    }
+}
+
+// NOTE - Stockham autosort version of FFTEvaluateLanes, for FFTLaneCount consecutive rows starting at Row.
+// Each stage ping-pongs between the two lane scratches and leaves the result in natural order, so there
+// is no bit-reversal gather, and every access to the rows is unit-stride.
+template<int N>
+void FFTStockhamLanes(water::fft_plan const *Plan, water::fft_scratch *S, complex *Data, int Row)
+{
+    real32 *XRe = S->LaneRe[0], *XIm = S->LaneIm[0];
+    real32 *YRe = S->LaneRe[1], *YIm = S->LaneIm[1];
+
+    for(int l = 0; l < FFTLaneCount; ++l)
+    {
+        complex const *Src = Data + (Row + l) * N;
+        for(int i = 0; i < N; ++i)
+        {
+            XRe[i * FFTLaneCount + l] = Src[i].r;
+            XIm[i * FFTLaneCount + l] = Src[i].i;
+        }
+    }
+
+    // n : length of the sub-transforms at this stage, s : their stride
+    int W_ = FFTLog2(N) - 1;
+    for(int n = N, s = 1; n > 1; n >>= 1, s <<= 1, --W_)
+    {
+        int m = n >> 1;
+        for(int p = 0; p < m; ++p)
+        {
+            fft_lane Wr = LaneSet1(Plan->FFTW[W_][p].r);
+            fft_lane Wi = LaneSet1(Plan->FFTW[W_][p].i);
+            for(int q = 0; q < s; ++q)
+            {
+                int A = (q + s * p) * FFTLaneCount;
+                int B = (q + s * (p + m)) * FFTLaneCount;
+                int C = (q + s * 2 * p) * FFTLaneCount;
+                int D = C + s * FFTLaneCount;
+
+                fft_lane Ar = LaneLoad(XRe + A), Ai = LaneLoad(XIm + A);
+                fft_lane Br = LaneLoad(XRe + B), Bi = LaneLoad(XIm + B);
+                fft_lane Dr = LaneSub(Ar, Br), Di = LaneSub(Ai, Bi);
+
+                LaneStore(YRe + C, LaneAdd(Ar, Br));
+                LaneStore(YIm + C, LaneAdd(Ai, Bi));
+                LaneStore(YRe + D, LaneSub(LaneMul(Dr, Wr), LaneMul(Di, Wi)));
+                LaneStore(YIm + D, LaneAdd(LaneMul(Dr, Wi), LaneMul(Di, Wr)));
+            }
+        }
+        real32 *T;
+        T = XRe; XRe = YRe; YRe = T;
+        T = XIm; XIm = YIm; YIm = T;
+    }
+
+    for(int l = 0; l < FFTLaneCount; ++l)
+    {
+        complex *Dst = Data + (Row + l) * N;
+        for(int i = 0; i < N; ++i)
+        {
+            Dst[i].r = XRe[i * FFTLaneCount + l];
+            Dst[i].i = XIm[i * FFTLaneCount + l];
+        }
+    }
+}
+
+int static const FFTTransposeTile = 16;
+
+// NOTE - Cache-blocked transpose of the tile rows [TileRowBegin, TileRowEnd) of Src,
+// a Tile x Tile block of source and destination both stay in L1
+template<int N>
+void FFTTranspose(complex const *Src, complex *Dst, int TileRowBegin, int TileRowEnd)
+{
+    int const Tile = FFTTransposeTile;
+    static_assert(N % Tile == 0, "FFT size must be a multiple of the transpose tile");
+    for(int tj = TileRowBegin * Tile; tj < TileRowEnd * Tile; tj += Tile)
+    {
+        for(int ti = 0; ti < N; ti += Tile)
+        {
+            for(int j = tj; j < tj + Tile; ++j)
+            {
+                for(int i = ti; i < ti + Tile; ++i)
+                {
+                    Dst[i * N + j] = Src[j * N + i];
+                }
+            }
+        }
+    }
+}
+
+struct fft_pass
+{
+    water::fft_plan *Plan;
+    complex **Src;
+    complex **Dst;   // Transposes only
+    bool Columns;    // Line passes only, FFT_BLOCKED always works on rows
+};
+
+// NOTE - Item i of a line pass is a batch of lines of spectrum i / ItemsPerSpectrum :
+// a single line for FFT_SCALAR, FFTLaneCount lines for the lane kernels
+inline int FFTLinesPerItem(water::fft_plan const *Plan)
+{
+    return Plan->Mode == water::FFT_SCALAR ? 1 : FFTLaneCount;
+}
+
+template<int N>
+void FFTLinePass(void *UserData, int Begin, int End, int ThreadIdx)
+{
+    fft_pass *Pass = (fft_pass*)UserData;
+    water::fft_plan const *Plan = Pass->Plan;
+    water::fft_scratch *S = &Plan->Scratch[ThreadIdx];
+    int LinesPerItem = FFTLinesPerItem(Plan);
+    int ItemsPerSpectrum = N / LinesPerItem;
+
+    for(int Item = Begin; Item < End; ++Item)
+    {
+        complex *Data = Pass->Src[Item / ItemsPerSpectrum];
+        int Line = (Item % ItemsPerSpectrum) * LinesPerItem;
+        switch(Plan->Mode)
+        {
+        case water::FFT_BLOCKED:
+            FFTStockhamLanes<N>(Plan, S, Data, Line);
+            break;
+        case water::FFT_SIMD:
+            if(Pass->Columns)
+                FFTEvaluateLanes<N>(Plan, S, Data, N, 1, Line);
+            else
+                FFTEvaluateLanes<N>(Plan, S, Data, 1, N, Line * N);
+            break;
+        default:
+            if(Pass->Columns)
+                FFTEvaluate<N>(Plan, S, Data, Data, N, Line);
+            else
+                FFTEvaluate<N>(Plan, S, Data, Data, 1, Line * N);
+            break;
+        }
+    }
+}
+
+template<int N>
+void FFTTransposePass(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    fft_pass *Pass = (fft_pass*)UserData;
+    int const TileRows = N / FFTTransposeTile;
+
+    for(int Item = Begin; Item < End; ++Item)
+    {
+        int Spectrum = Item / TileRows;
+        int TileRow = Item % TileRows;
+        FFTTranspose<N>(Pass->Src[Spectrum], Pass->Dst[Spectrum], TileRow, TileRow + 1);
+    }
+}
+
+template<int N>
+void FFTEvaluate2D(water::fft_plan *Plan, complex **Spectra, int Count)
+{
+    int LineItems = Count * (N / FFTLinesPerItem(Plan));
+    int LineGrain = Max(1, LineItems / (4 * jobs::ThreadCount()));
+    int TransposeItems = Count * (N / FFTTransposeTile);
+
+    fft_pass Pass = {};
+    Pass.Plan = Plan;
+    if(Plan->Mode == water::FFT_BLOCKED)
+    {
+        // NOTE - Row pass, transpose, row pass on the transposed columns, transpose back
+        Pass.Src = Spectra;
+        jobs::ParallelFor(LineItems, LineGrain, FFTLinePass<N>, &Pass);
+        Pass.Dst = Plan->Transposed;
+        jobs::ParallelFor(TransposeItems, 1, FFTTransposePass<N>, &Pass);
+        Pass.Src = Plan->Transposed;
+        jobs::ParallelFor(LineItems, LineGrain, FFTLinePass<N>, &Pass);
+        Pass.Dst = Spectra;
+        jobs::ParallelFor(TransposeItems, 1, FFTTransposePass<N>, &Pass);
+    }
+    else
+    {
+        Pass.Src = Spectra;
+        Pass.Columns = false;
+        jobs::ParallelFor(LineItems, LineGrain, FFTLinePass<N>, &Pass);
+        Pass.Columns = true;
+        jobs::ParallelFor(LineItems, LineGrain, FFTLinePass<N>, &Pass);
+    }
+}
+
+namespace water {
+bool FFTSupportedSize(int N)
+{
+    return N == 64 || N == 128 || N == 256 || N == 512;
+}
+
+void FFTPlanInit(fft_plan *Plan, rf::mem_pool *Pool, int N, int Mode, int SpectraCount, int ThreadCount)
+{
+    Assert(FFTSupportedSize(N));
+    Assert(SpectraCount <= FFTMaxSpectra);
+
+    Plan->N = N;
+    Plan->Log2N = FFTLog2(N);
+    Plan->Mode = Clamp(Mode, (int)FFT_SCALAR, (int)FFT_BLOCKED);
+
+    Plan->Reversed = rf::PoolAlloc<uint32>(Pool, N);
+    for(int i = 0; i < N; ++i)
+    {
+        Plan->Reversed[i] = FFTReverse(i, Plan->Log2N);
+    }
+    Plan->FFTW = rf::PoolAlloc<complex*>(Pool, Plan->Log2N);
+    int Pow2 = 1;
+    for(int j = 0; j < Plan->Log2N; ++j)
+    {
+        Plan->FFTW[j] = rf::PoolAlloc<complex>(Pool, Pow2);
+        for(int i = 0; i < Pow2; ++i)
+            Plan->FFTW[j][i] = FFTW(i, 2 * Pow2);
+        Pow2 *= 2;
+    }
+    Plan->SpectraCount = SpectraCount;
+    for(int i = 0; i < FFTMaxSpectra; ++i)
+    {
+        Plan->Transposed[i] = (Plan->Mode == FFT_BLOCKED && i < SpectraCount) ? rf::PoolAlloc<complex>(Pool, N * N) : NULL;
+    }
+
+    Plan->ScratchCount = ThreadCount;
+    Plan->Scratch = rf::PoolAlloc<fft_scratch>(Pool, ThreadCount);
+    for(int t = 0; t < ThreadCount; ++t)
+    {
+        fft_scratch *S = &Plan->Scratch[t];
+        S->Switch = 0;
+        for(int i = 0; i < 2; ++i)
+        {
+            S->FFTC[i] = rf::PoolAlloc<complex>(Pool, N);
+            S->LaneRe[i] = rf::PoolAlloc<real32>(Pool, N * FFTLaneCount);
+            S->LaneIm[i] = rf::PoolAlloc<real32>(Pool, N * FFTLaneCount);
+        }
+    }
+
+    LogInfo("Water FFT : %dx%d, %d lines per SIMD batch", N, N, FFTLaneCount);
+}
+
+void FFTEvaluateSpectra(fft_plan *Plan, complex **Spectra, int Count)
+{
+    Assert(Count <= Plan->SpectraCount);
+    switch(Plan->N)
+    {
+    case 64:  FFTEvaluate2D<64>(Plan, Spectra, Count); break;
+    case 128: FFTEvaluate2D<128>(Plan, Spectra, Count); break;
+    case 256: FFTEvaluate2D<256>(Plan, Spectra, Count); break;
+    case 512: FFTEvaluate2D<512>(Plan, Spectra, Count); break;
+    default: Assert(false);
+    }
+}
+
+// NOTE - Packs two spectra in A as H(A) + i.H(B), where H(X)[k] = (X[k] + conj(X[-k])) / 2 is the Hermitian
+// part of X, -k being the mirrored index mod N. The transform of H(X) is the real part of the transform of
+// X, so a single complex transform of the packed spectrum yields FFT(A).r in .r and FFT(B).r in .i.
+void FFTPackSpectra(complex *A, complex const *B, int N, int RowBegin, int RowEnd)
+{
+    for(int m_prime = RowBegin; m_prime < RowEnd; ++m_prime)
+    {
+        int m_mirror = (N - m_prime) & (N - 1);
+        for(int n_prime = 0; n_prime < N; ++n_prime)
+        {
+            int n_mirror = (N - n_prime) & (N - 1);
+            int Idx = m_prime * N + n_prime;
+            int MirrorIdx = m_mirror * N + n_mirror;
+            if(MirrorIdx < Idx)
+                continue; // pair owned by the mirror row
+
+            complex Ak = A[Idx], Amk = A[MirrorIdx];
+            complex Bk = B[Idx], Bmk = B[MirrorIdx];
+            A[Idx] = complex(0.5f * (Ak.r + Amk.r - Bk.i + Bmk.i), 0.5f * (Ak.i - Amk.i + Bk.r + Bmk.r));
+            A[MirrorIdx] = complex(0.5f * (Amk.r + Ak.r - Bmk.i + Bk.i), 0.5f * (Amk.i - Ak.i + Bmk.r + Bk.r));
+        }
+    }
+}
+}
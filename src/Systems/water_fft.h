@@ -0,0 +1,52 @@
+#ifndef WATER_FFT_H
+#define WATER_FFT_H
+
+#include "definitions.h"
+
+namespace water {
+    enum fft_mode
+    {
+        FFT_SCALAR, // One line at a time, interleaved complex
+        FFT_SIMD,   // FFTLaneCount lines at a time, split real/imag layout
+        FFT_BLOCKED // Stockham SIMD row passes with a cache-blocked transpose in between
+    };
+
+    // NOTE - Scratch memory used by the FFT kernels during a transform
+    struct fft_scratch
+    {
+        int Switch;
+        complex *FFTC[2];     // N, ping-pong lines for FFT_SCALAR
+        real32 *LaneRe[2];    // N * FFTLaneCount, lane-interleaved split layout for FFT_SIMD/FFT_BLOCKED
+        real32 *LaneIm[2];
+    };
+
+    int static const FFTMaxSpectra = 20; // 5 fields for each of 4 cascades
+    int static const FFTMaxSize = 512;
+
+    // NOTE - Everything the ocean FFT needs for one grid size, built once at init.
+    // The kernels are compiled for each of the supported sizes (see FFTSupportedSize).
+    struct fft_plan
+    {
+        int N;
+        int Log2N;
+        int Mode;             // fft_mode
+        uint32 *Reversed;     // N, bit-reversal table
+        complex **FFTW;       // Log2N levels, level j holding the 2^j twiddles of the 2^(j+1) butterflies
+        int SpectraCount;     // Most spectra transformed by one FFTEvaluateSpectra
+        complex *Transposed[FFTMaxSpectra]; // N * N, transposed spectra for FFT_BLOCKED
+        int ScratchCount;
+        fft_scratch *Scratch; // One per job thread
+    };
+
+    bool FFTSupportedSize(int N);
+    void FFTPlanInit(fft_plan *Plan, rf::mem_pool *Pool, int N, int Mode, int SpectraCount, int ThreadCount);
+
+    // Full 2D inverse transforms of Count N x N spectra, in place.
+    // The lines of all the spectra are spread over the job threads, each pass ending with a barrier.
+    void FFTEvaluateSpectra(fft_plan *Plan, complex **Spectra, int Count);
+
+    // Packs two spectra in A as H(A) + i.H(B), see definition. Rows of different
+    // [RowBegin, RowEnd) ranges can be packed concurrently.
+    void FFTPackSpectra(complex *A, complex const *B, int N, int RowBegin, int RowEnd);
+}
+#endif
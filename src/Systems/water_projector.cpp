@@ -0,0 +1,301 @@
+#include "water_projector.h"
+#include "rf/utils.h"
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+static const float M2_FixedLength = 10.f; // Fixed length along the Fwd vector for method 2 projector direction
+real32 static const ProjectorClearance = 1.f;   // Metres the projector keeps above the slab
+real32 static const MinProjectorDepth = 1e-3f;  // Of the range points, along the projector direction
+real32 static const MinRaySlope = 1e-6f;        // Downward, of the grid rays
+real32 static const HorizonMargin = 1e-3f;      // NDC, kept above the horizon
+int static const SlabSearchSteps = 24;
+
+real32 IntersectPlane(vec3f const &N, vec3f const &P0, vec3f const &RayOrg, vec3f const &RayDir)
+{
+    real32 Denom = Dot(N, RayDir);
+    if(std::fabs(Denom) > 1e-5)
+    {
+        vec3f P0Org = P0 - RayOrg;
+        real32 T = Dot(P0Org, N) / Denom;
+        if(T >= 0.f)
+            return T;
+        return -1.f;
+    }
+    return -1.f;
+}
+
+// NOTE - Points of the segment [A, B] on the plane y = H, if it crosses it
+inline int CrossPlaneY(vec3f const &A, vec3f const &B, real32 H, vec3f *Points)
+{
+    if((A.y - H) * (B.y - H) >= 0.f)
+        return 0;
+    real32 T = (H - A.y) / (B.y - A.y);
+    *Points = A + (B - A) * T;
+    return 1;
+}
+
+// NOTE - Distance from the eye, Height above the base plane, to where the ray through the NDC point (X, Y) meets it
+inline real32 ScreenDistance(camera const &Camera, real32 TanX, real32 TanY, real32 Height, real32 Far, real32 X, real32 Y)
+{
+    if(Height <= 0.f)
+        return 0.f;
+    vec3f Ray = Camera.Forward + Camera.Right * (X * TanX) + Camera.Up * (Y * TanY);
+    if(Ray.y >= 0.f)
+        return Far;
+    return Min(Height * Length(Ray) / -Ray.y, Far);
+}
+
+// NOTE - Along the screen line of the rays Base + Axis * T, Base orthogonal to the unit Axis direction, the ray
+// nearest to the nadir is where Dot(Base + Axis * T, Axis) * (Base + Axis * T).y = |Base + Axis * T|^2 * Axis.y :
+// T = |Base|^2 * Axis.y / (|Axis|^2 * Base.y). The distance to the plane is smallest there.
+inline real32 NearestToNadir(vec3f const &Base, vec3f const &Axis, real32 Low, real32 High)
+{
+    real32 Denom = Dot(Axis, Axis) * Base.y;
+    if(fabsf(Denom) < 1e-9f)
+        return Low;
+    return Clamp(Dot(Base, Base) * Axis.y / Denom, Low, High);
+}
+
+namespace water {
+void GetProjectorPositionAndDirection(const camera &Camera,
+                                      vec3f &ProjectorPosition, vec3f &ProjectorTarget)
+{
+    ProjectorPosition = Camera.Position + Camera.PositionDecimal;
+
+    // Get projector orientation
+    vec3f D = Camera.Forward;
+    vec3f N = vec3f(0,1,0); // plane normal
+    real32 NdotD = Dot(D, N);
+    if(NdotD > 0.f)
+    { // Mirror direction if not towards plane
+        D.y = -D.y;
+        NdotD = -NdotD;
+    }
+
+    // method 1 : to the intersection of the camera direction and the sea plane
+    real32 T = IntersectPlane(N, vec3f(0,0,0), ProjectorPosition, D);
+    Assert(T >= 0.f);
+    vec3f M1 = ProjectorPosition + D * T;
+
+    // method 2 : to the 2d plane projection of a fixed length direction along the fwd vector
+    vec3f M2 = ProjectorPosition + Camera.Forward * M2_FixedLength;
+    M2.y = 0.f;
+
+    // The result is a linear mix between the two methods depending on the angle of the cam
+    // view direction and the sea normal, NdotD being negative here
+    ProjectorTarget = Lerp(M2, M1, -NdotD);
+}
+
+bool ComputeProjectorRange(projector_range *Range, camera const &Camera, real32 TanY, real32 Aspect, real32 Near,
+                           real32 Far, real32 Upper)
+{
+    Upper = Max(Upper, 0.f);
+    vec3f Eye = Camera.Position + Camera.PositionDecimal;
+    real32 TanX = TanY * Aspect;
+
+    // NOTE - Near corners then far ones, each ring going around the view
+    vec3f Corners[8];
+    real32 const SignX[4] = { -1.f, 1.f, 1.f, -1.f };
+    real32 const SignY[4] = { -1.f, -1.f, 1.f, 1.f };
+    for(int c = 0; c < 8; ++c)
+    {
+        real32 Depth = c < 4 ? Near : Far;
+        vec3f Ray = Camera.Forward + Camera.Right * (SignX[c & 3] * TanX) + Camera.Up * (SignY[c & 3] * TanY);
+        Corners[c] = Eye + Ray * Depth;
+    }
+    int const Edges[12][2] = { {0, 1}, {1, 2}, {2, 3}, {3, 0}, {4, 5}, {5, 6}, {6, 7}, {7, 4},
+                               {0, 4}, {1, 5}, {2, 6}, {3, 7} };
+
+    // NOTE - Vertices of the frustum clipped by the slab
+    vec3f Points[8 + 2 * 12];
+    int PointCount = 0;
+    for(int c = 0; c < 8; ++c)
+    {
+        if(fabsf(Corners[c].y) <= Upper)
+            Points[PointCount++] = Corners[c];
+    }
+    for(int e = 0; e < 12; ++e)
+    {
+        vec3f const &A = Corners[Edges[e][0]];
+        vec3f const &B = Corners[Edges[e][1]];
+        PointCount += CrossPlaneY(A, B, Upper, Points + PointCount);
+        PointCount += CrossPlaneY(A, B, -Upper, Points + PointCount);
+    }
+    if(PointCount == 0)
+        return false;
+
+    // NOTE - Only the projector is raised, the range still covers what the camera sees
+    camera Projector = Camera;
+    Projector.Position.y += Max(0.f, Upper + ProjectorClearance - Eye.y);
+    vec3f Position, Target;
+    GetProjectorPositionAndDirection(Projector, Position, Target);
+    vec3f Fwd = Normalize(Target - Position);
+
+    // NOTE - A point behind the projector has no place in its view, as when a camera deep below looks up at a wide
+    // disc of the surface. Looking straight down, the projector has the whole plane in front of it.
+    for(int i = 0; i < PointCount; ++i)
+    {
+        if(Dot(vec3f(Points[i].x, 0.f, Points[i].z) - Position, Fwd) < MinProjectorDepth)
+            Fwd = vec3f(0, -1, 0);
+    }
+    vec3f Right = Cross(Fwd, vec3f(0, 1, 0));
+    if(Length(Right) < 1e-4f) // Straight down
+        Right = vec3f(Camera.Right.x, 0.f, Camera.Right.z);
+    if(Length(Right) < 1e-4f)
+        Right = vec3f(1, 0, 0);
+    Right = Normalize(Right);
+    vec3f Up = Normalize(Cross(Right, Fwd));
+
+    // NOTE - Bounding box of the points dropped on the base plane, in the projector view as tangents
+    vec2f Low, High;
+    for(int i = 0; i < PointCount; ++i)
+    {
+        vec3f Q = vec3f(Points[i].x, 0.f, Points[i].z) - Position;
+        real32 Depth = Max(Dot(Q, Fwd), MinProjectorDepth);
+        vec2f S(Dot(Q, Right) / Depth, Dot(Q, Up) / Depth);
+        Low = i > 0 ? vec2f(Min(Low.x, S.x), Min(Low.y, S.y)) : S;
+        High = i > 0 ? vec2f(Max(High.x, S.x), Max(High.y, S.y)) : S;
+    }
+
+    Range->Position = Position;
+    Range->Ray = Fwd + Right * Low.x + Up * Low.y;
+    Range->RayU = Right * (High.x - Low.x);
+    Range->RayV = Up * (High.y - Low.y);
+    return true;
+}
+
+// NOTE - Every vertex is its ray scaled to reach y = 0, 4 vertices of a row at once, the ray of a vertex being the
+// one of its row plus u * RayU
+void ProjectGrid(projector_range const *Range, int Columns, int Rows, vec3f *Vertices)
+{
+    vec3f const &P = Range->Position;
+    real32 InvColumns = Columns > 0 ? 1.f / Columns : 0.f;
+    real32 InvRows = Rows > 0 ? 1.f / Rows : 0.f;
+    int Stride = Columns + 1;
+
+    for(int y = 0; y <= Rows; ++y)
+    {
+        vec3f RowRay = Range->Ray + Range->RayV * ((real32)y * InvRows);
+        vec3f *Row = Vertices + y * Stride;
+
+        int x = 0;
+#if HAVE_SSE2
+        __m128 PX = _mm_set1_ps(P.x), PZ = _mm_set1_ps(P.z), NegPY = _mm_set1_ps(-P.y);
+        __m128 RowX = _mm_set1_ps(RowRay.x), RowY = _mm_set1_ps(RowRay.y), RowZ = _mm_set1_ps(RowRay.z);
+        __m128 UX = _mm_set1_ps(Range->RayU.x), UY = _mm_set1_ps(Range->RayU.y), UZ = _mm_set1_ps(Range->RayU.z);
+        __m128 MaxY = _mm_set1_ps(-MinRaySlope);
+        for(; x + 3 <= Columns; x += 4)
+        {
+            __m128i Column = _mm_add_epi32(_mm_set1_epi32(x), _mm_setr_epi32(0, 1, 2, 3));
+            __m128 U = _mm_mul_ps(_mm_cvtepi32_ps(Column), _mm_set1_ps(InvColumns));
+            __m128 DX = _mm_add_ps(RowX, _mm_mul_ps(U, UX));
+            __m128 DY = _mm_min_ps(_mm_add_ps(RowY, _mm_mul_ps(U, UY)), MaxY);
+            __m128 DZ = _mm_add_ps(RowZ, _mm_mul_ps(U, UZ));
+            __m128 T = _mm_div_ps(NegPY, DY);
+
+            real32 X[4], Z[4];
+            _mm_storeu_ps(X, _mm_add_ps(PX, _mm_mul_ps(DX, T)));
+            _mm_storeu_ps(Z, _mm_add_ps(PZ, _mm_mul_ps(DZ, T)));
+            for(int l = 0; l < 4; ++l)
+                Row[x + l] = vec3f(X[l], 0.f, Z[l]);
+        }
+#endif
+        for(; x <= Columns; ++x)
+        {
+            real32 U = (real32)x * InvColumns;
+            real32 DX = RowRay.x + U * Range->RayU.x;
+            real32 DY = Min(RowRay.y + U * Range->RayU.y, -MinRaySlope);
+            real32 DZ = RowRay.z + U * Range->RayU.z;
+            real32 T = -P.y / DY;
+            Row[x] = vec3f(P.x + DX * T, 0.f, P.z + DZ * T);
+        }
+    }
+}
+
+int ComputeScreenSlabs(camera const &Camera, real32 TanY, real32 Aspect, real32 Far, real32 Upper,
+                       int DistanceCount, real32 const *Distances, screen_slab *Slabs, real32 *Horizon)
+{
+    real32 TanX = TanY * Aspect;
+    real32 Height = Camera.Position.y + Camera.PositionDecimal.y;
+    DistanceCount = Clamp(DistanceCount, 0, MaxScreenSlabs - 1);
+
+    // NOTE - The rays of the horizon are level : Forward.y + Right.y * X * TanX + Up.y * Y * TanY = 0. Looking
+    // straight up or down, the horizon leaves the screen.
+    real32 UpSlope = Camera.Up.y * TanY;
+    if(UpSlope > 1e-6f)
+    {
+        real32 Left = -(Camera.Forward.y - Camera.Right.y * TanX) / UpSlope;
+        real32 Right = -(Camera.Forward.y + Camera.Right.y * TanX) / UpSlope;
+        *Horizon = Max(Left, Right);
+    }
+    else
+        *Horizon = Camera.Forward.y < 0.f ? 2.f : -2.f;
+
+    real32 Top = Height > Max(Upper, 0.f) ? Min(*Horizon + HorizonMargin, 1.f) : 1.f;
+    if(Top <= -1.f)
+        return 0;
+
+    // NOTE - NDC point straight below the eye, off screen unless the view looks down
+    vec2f Nadir(-2.f, -2.f);
+    if(Camera.Forward.y < -1e-6f)
+        Nadir = vec2f(Camera.Right.y / (Camera.Forward.y * TanX), Camera.Up.y / (Camera.Forward.y * TanY));
+
+    // NOTE - The distance at the center of a row grows with the row up to the horizon, from the row nearest to the
+    // nadir when the view looks down, the rows below it counting as that one. Each boundary is searched by bisection
+    // between the previous one and the top.
+    real32 Floor = Camera.Forward.y < 0.f ? NearestToNadir(Camera.Forward, Camera.Up * TanY, -1.f, 1.f) : -1.f;
+    int Count = 0;
+    real32 Bottom = -1.f;
+    for(int Lod = 0; Lod <= DistanceCount && Bottom < Top; ++Lod)
+    {
+        real32 SlabTop = Top;
+        if(Lod < DistanceCount && ScreenDistance(Camera, TanX, TanY, Height, Far, 0.f, Max(Bottom, Floor)) > Distances[Lod])
+        {
+            SlabTop = Bottom;
+        }
+        else if(Lod < DistanceCount && ScreenDistance(Camera, TanX, TanY, Height, Far, 0.f, Max(Top, Floor)) > Distances[Lod])
+        {
+            real32 Low = Bottom, High = Top;
+            for(int i = 0; i < SlabSearchSteps; ++i)
+            {
+                real32 Mid = 0.5f * (Low + High);
+                if(ScreenDistance(Camera, TanX, TanY, Height, Far, 0.f, Max(Mid, Floor)) > Distances[Lod])
+                    High = Mid;
+                else
+                    Low = Mid;
+            }
+            SlabTop = High;
+        }
+
+        if(SlabTop > Bottom)
+        {
+            screen_slab *Slab = Slabs + Count++;
+            Slab->Bottom = Bottom;
+            Slab->Top = SlabTop;
+
+            // NOTE - The distance is largest at a corner, and smallest under the eye or where an edge passes
+            // nearest to it
+            vec3f AxisX = Camera.Right * TanX, AxisY = Camera.Up * TanY;
+            vec2f Candidates[9] = { vec2f(-1.f, Bottom), vec2f(1.f, Bottom), vec2f(-1.f, SlabTop), vec2f(1.f, SlabTop),
+                                    vec2f(Clamp(Nadir.x, -1.f, 1.f), Clamp(Nadir.y, Bottom, SlabTop)),
+                                    vec2f(NearestToNadir(Camera.Forward + AxisY * Bottom, AxisX, -1.f, 1.f), Bottom),
+                                    vec2f(NearestToNadir(Camera.Forward + AxisY * SlabTop, AxisX, -1.f, 1.f), SlabTop),
+                                    vec2f(-1.f, NearestToNadir(Camera.Forward - AxisX, AxisY, Bottom, SlabTop)),
+                                    vec2f(1.f, NearestToNadir(Camera.Forward + AxisX, AxisY, Bottom, SlabTop)) };
+            Slab->NearDistance = Far;
+            Slab->FarDistance = 0.f;
+            for(int c = 0; c < 9; ++c)
+            {
+                real32 Distance = ScreenDistance(Camera, TanX, TanY, Height, Far, Candidates[c].x, Candidates[c].y);
+                Slab->NearDistance = Min(Slab->NearDistance, Distance);
+                Slab->FarDistance = Max(Slab->FarDistance, Distance);
+            }
+            Slab->Lod = Lod;
+        }
+        Bottom = SlabTop;
+    }
+    return Count;
+}
+}
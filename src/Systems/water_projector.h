@@ -0,0 +1,55 @@
+#ifndef WATER_PROJECTOR_H
+#define WATER_PROJECTOR_H
+
+#include "definitions.h"
+
+namespace water {
+    // NOTE - Projected grid (Johanson, Real-time water rendering, 2004) : a regular grid in the view space of a
+    // projector, its rays intersected with the base plane y = 0, so that the vertices are spread evenly over the
+    // screen instead of the world.
+    // The range is M_projector * M_range of the article applied to directions : the grid point (u, v) of [0, 1]^2
+    // is the projector ray Ray + u * RayU + v * RayV from Position.
+    struct projector_range
+    {
+        vec3f Position;     // Projector, above the displacement slab
+        vec3f Ray;          // Through (0, 0)
+        vec3f RayU;
+        vec3f RayV;
+    };
+
+    // Projector of the GPU projected grid, at the camera and looking at the sea plane
+    void GetProjectorPositionAndDirection(camera const &Camera, vec3f &ProjectorPosition, vec3f &ProjectorTarget);
+
+    // NOTE - Range of the projector covering the part of the displacement slab -Upper <= y <= Upper the camera
+    // frustum sees (TanY is tan(FOV / 2), Aspect width over height) : the frustum corners inside the slab and its
+    // edges crossing the slab bounds are projected onto the base plane, their bounding box in the projector view
+    // being the range. The projector is raised above Upper when the camera is lower.
+    // Returns false, Range left untouched, when the frustum misses the slab : no water in view.
+    bool ComputeProjectorRange(projector_range *Range, camera const &Camera, real32 TanY, real32 Aspect, real32 Near,
+                               real32 Far, real32 Upper);
+
+    int static const MaxScreenSlabs = 4;
+
+    // NOTE - Horizontal band of the screen, NDC y from Bottom to Top, where the rays of the eye meet the base plane
+    // between NearDistance and FarDistance away
+    struct screen_slab
+    {
+        real32 Bottom, Top;
+        real32 NearDistance, FarDistance;
+        int Lod;            // Band of Distances the slab is in
+    };
+
+    // NOTE - Screen split in slabs by the distance of the water seen, Lod k going up to the row whose center sees
+    // the base plane Distances[k] away, increasing, and the last one up to the horizon. Nothing above the horizon
+    // is kept unless the eye is within the slab of displacements -Upper <= y <= Upper, where waves rise above it.
+    // Distances are capped to Far. Empty slabs are skipped, at most DistanceCount + 1 <= MaxScreenSlabs are written.
+    // *Horizon is the NDC y of the horizon, the highest across the screen when the view rolls.
+    // Returns how many slabs were written, 0 when the screen only shows sky.
+    int ComputeScreenSlabs(camera const &Camera, real32 TanY, real32 Aspect, real32 Far, real32 Upper,
+                           int DistanceCount, real32 const *Distances, screen_slab *Slabs, real32 *Horizon);
+
+    // Base plane points of the (Columns + 1) * (Rows + 1) grid of Range, vertex (x, y) being y * (Columns + 1) + x
+    // at (u, v) = (x / Columns, y / Rows), laid out like mesh::BuildGridIndices expects
+    void ProjectGrid(projector_range const *Range, int Columns, int Rows, vec3f *Vertices);
+}
+#endif
@@ -0,0 +1,114 @@
+#include "water_spectrum.h"
+#include "water.h"
+#include "rf/utils.h"
+
+// NOTE - Bit-exact spectra need every float multiply and add to be rounded on its own, never fused
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+// NOTE - exp(X), Cephes expf : X = n.ln2 + r with |r| <= ln2 / 2, a degree 6 polynomial for exp(r) and 2^n put
+// in the exponent bits. Within 1 ulp of the exact exp, without depending on the platform's libm.
+static real32 const ExpMaxArg = 88.f;             // Keeps 2^n a normal float
+static real32 const ExpMinArg = -87.33654475f;    // ln of the smallest normal float, below it returns 0
+static real32 const Log2E = 1.44269504088896341f;
+static real32 const ExpC1 = 0.693359375f;
+static real32 const ExpC2 = -2.12194440e-4f;
+static real32 const ExpP[6] = { 1.9875691500E-4f, 1.3981999507E-3f, 8.3334519073E-3f, 4.1665795894E-2f,
+                                1.6666665459E-1f, 5.0000001201E-1f };
+
+static real32 Exp(real32 X)
+{
+    if(X < ExpMinArg)
+        return 0.f;
+    X = Min(X, ExpMaxArg);
+
+    real32 Z = floorf(X * Log2E + 0.5f);
+    X = X - Z * ExpC1;
+    X = X - Z * ExpC2;
+    int32 n = (int32)Z;
+
+    Z = X * X;
+    real32 Y = ExpP[0];
+    for(int i = 1; i < 6; ++i)
+        Y = Y * X + ExpP[i];
+    Y = Y * Z;
+    Y = Y + X;
+    Y = Y + 1.f;
+
+    uint32 Bits = (uint32)(n + 127) << 23;
+    real32 Pow2;
+    memcpy(&Pow2, &Bits, sizeof(Pow2));
+    return Y * Pow2;
+}
+
+// NOTE - murmur3 finalizer, every input bit affects every output bit
+static uint32 HashMix(uint32 H)
+{
+    H ^= H >> 16;
+    H *= 0x85ebca6bU;
+    H ^= H >> 13;
+    H *= 0xc2b2ae35U;
+    H ^= H >> 16;
+    return H;
+}
+
+namespace water {
+phillips_params MakePhillipsParams(beaufort_state const *State, cascade const *Cascade)
+{
+    phillips_params P;
+    P.Width = (real32)State->Width / Cascade->Ratio;
+    P.UnitW = Normalize(State->Direction);
+
+    // NOTE - The amplitude of a mode goes with the spectrum density times the area dk^2 of a mode, which
+    // grows with Ratio^2, so that the cascades add up to the same sea
+    P.Amplitude = State->Amplitude * Square((real32)Cascade->Ratio);
+
+    real32 WLen = Length(State->Direction);
+    real32 L = Square(WLen) / g_G;
+    P.L2 = Square(L);
+
+    P.DampL2 = P.L2 * Square(PhillipsDamping);
+
+    real32 ModeK = 2.f * M_PI / P.Width;
+    P.KMin2 = Square(Cascade->ModeMin * ModeK);
+    P.KMax2 = Square(Cascade->ModeMax * ModeK);
+    return P;
+}
+
+void PhillipsRow(phillips_params const *P, int N, int m_prime, int Sign, real32 *Out)
+{
+    real32 Kz = M_PI * (2.f * Sign * m_prime - N) / P->Width;
+    for(int n_prime = 0; n_prime <= N; ++n_prime)
+    {
+        vec2f K(M_PI * (2.f * Sign * n_prime - N) / P->Width, Kz);
+        real32 KLen = Length(K);
+        if(KLen < 1e-6f || Square(KLen) < P->KMin2 || Square(KLen) >= P->KMax2)
+        {
+            Out[n_prime] = 0.f;
+            continue;
+        }
+
+        real32 KLen2 = Square(KLen);
+        real32 KLen4 = Square(KLen2);
+
+        vec2f UnitK = Normalize(K);
+        real32 KDotW = Dot(UnitK, P->UnitW);
+        real32 KDotW2 = Square(Square(KDotW));
+
+        Out[n_prime] = P->Amplitude * (Exp(-1.f / (KLen2 * P->L2)) / KLen4) * KDotW2 * Exp(-KLen2 * P->DampL2);
+    }
+}
+
+uint32 SpectrumSeed(uint32 Seed, uint32 State, uint32 Cascade)
+{
+    uint32 H = HashMix(Seed);
+    H = HashMix(H ^ (State * 0x9e3779b9U));
+    H = HashMix(H ^ (Cascade * 0x7f4a7c15U));
+    return H;
+}
+}
@@ -0,0 +1,37 @@
+#ifndef WATER_SPECTRUM_H
+#define WATER_SPECTRUM_H
+
+#include "definitions.h"
+
+// NOTE - Initial ocean spectrum h~0. Everything it is made of is computed with the same float operations on every
+// platform (polynomial exp, no fused multiply-add), so that a seed gives the same spectra bit for bit, across
+// runs, machines and compilers, and the spectra cache stays valid between them.
+namespace water {
+    struct beaufort_state;
+    struct cascade;
+
+    real32 static const PhillipsDamping = 1e-3f;
+
+    // NOTE - Phillips spectrum terms that only depend on the Beaufort state and cascade, hoisted out of the
+    // per-texel loops
+    struct phillips_params
+    {
+        real32 Width;
+        real32 Amplitude;
+        vec2f UnitW;
+        real32 L2;
+        real32 DampL2;
+        real32 KMin2;   // Band of the cascade
+        real32 KMax2;
+    };
+
+    phillips_params MakePhillipsParams(beaufort_state const *State, cascade const *Cascade);
+
+    // Phillips spectrum for the N+1 wave vectors (Sign * n', Sign * m') of row m', in Out[n']
+    void PhillipsRow(phillips_params const *P, int N, int m_prime, int Sign, real32 *Out);
+
+    // Seed of the SFMT stream drawing the Gaussians of a state and cascade, a hash of the three so that
+    // neighbouring seeds don't share streams
+    uint32 SpectrumSeed(uint32 Seed, uint32 State, uint32 Cascade);
+}
+#endif
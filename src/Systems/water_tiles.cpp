@@ -0,0 +1,97 @@
+#include "water_tiles.h"
+#include "rf/utils.h"
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+int static const TilePlaneCount = 6;
+
+namespace water {
+tile_frustum MakeTileFrustum(camera const &Camera, real32 TanY, real32 Aspect, real32 Near, real32 Far)
+{
+    // NOTE - P is right of the left plane when Dot(P, Right) >= -TanX * Dot(P, Forward), and so on
+    real32 TanX = TanY * Aspect;
+    tile_frustum Frustum;
+    Frustum.Normal[0] = Camera.Forward * TanX + Camera.Right;
+    Frustum.Normal[1] = Camera.Forward * TanX - Camera.Right;
+    Frustum.Normal[2] = Camera.Forward * TanY + Camera.Up;
+    Frustum.Normal[3] = Camera.Forward * TanY - Camera.Up;
+    Frustum.Normal[4] = Camera.Forward;
+    Frustum.Normal[5] = Camera.Forward * -1.f;
+    for(int p = 0; p < 4; ++p)
+        Frustum.Distance[p] = 0.f;
+    Frustum.Distance[4] = -Near;
+    Frustum.Distance[5] = Far;
+    return Frustum;
+}
+
+// NOTE - A box is outside when it is fully behind one plane, its corner furthest along the normal included :
+// Dot(Normal, Center) + Distance + Dot(|Normal|, HalfSize) < 0. The tile centers of a row only differ along x, so
+// everything but Normal.x * Center.x is a constant of the row, and 4 tiles of the row are tested at once.
+// The test is conservative, a box crossing two planes outside the frustum corner isn't culled.
+int CullTiles(tile_frustum const *Frustum, vec3f Eye, real32 Width, vec3f Extent, int Radius, int Capacity, vec2f *Offsets)
+{
+    int CenterX = (int)floorf(Eye.x / Width + 0.5f);
+    int CenterZ = (int)floorf(Eye.z / Width + 0.5f);
+    vec3f HalfSize(0.5f * Width + Extent.x, Extent.y, 0.5f * Width + Extent.z);
+
+    int Count = 0;
+    for(int j = -Radius; j <= Radius && Count < Capacity; ++j)
+    {
+        real32 OffsetZ = (real32)(CenterZ + j) * Width;
+        real32 Z = OffsetZ - Eye.z;
+        real32 RowTerm[TilePlaneCount];
+        for(int p = 0; p < TilePlaneCount; ++p)
+        {
+            vec3f const &N = Frustum->Normal[p];
+            RowTerm[p] = (N.y * -Eye.y + N.z * Z + Frustum->Distance[p]) +
+                         (fabsf(N.x) * HalfSize.x + fabsf(N.y) * HalfSize.y + fabsf(N.z) * HalfSize.z);
+        }
+
+        int i = -Radius;
+#if HAVE_SSE2
+        __m128 W = _mm_set1_ps(Width);
+        __m128 EyeX = _mm_set1_ps(Eye.x);
+        for(; i + 3 <= Radius && Count < Capacity; i += 4)
+        {
+            __m128i Column = _mm_add_epi32(_mm_set1_epi32(CenterX + i), _mm_setr_epi32(0, 1, 2, 3));
+            __m128 OffsetX = _mm_mul_ps(_mm_cvtepi32_ps(Column), W);
+            __m128 X = _mm_sub_ps(OffsetX, EyeX);
+            __m128 Outside = _mm_setzero_ps();
+            for(int p = 0; p < TilePlaneCount; ++p)
+            {
+                __m128 D = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(Frustum->Normal[p].x), X), _mm_set1_ps(RowTerm[p]));
+                Outside = _mm_or_ps(Outside, _mm_cmplt_ps(D, _mm_setzero_ps()));
+            }
+
+            int Visible = ~_mm_movemask_ps(Outside) & 0xF;
+            if(Visible)
+            {
+                real32 Lanes[4];
+                _mm_storeu_ps(Lanes, OffsetX);
+                for(int l = 0; l < 4 && Count < Capacity; ++l)
+                {
+                    if(Visible & (1 << l))
+                        Offsets[Count++] = vec2f(Lanes[l], OffsetZ);
+                }
+            }
+        }
+#endif
+        for(; i <= Radius && Count < Capacity; ++i)
+        {
+            real32 OffsetX = (real32)(CenterX + i) * Width;
+            real32 X = OffsetX - Eye.x;
+            bool Outside = false;
+            for(int p = 0; p < TilePlaneCount; ++p)
+            {
+                if(Frustum->Normal[p].x * X + RowTerm[p] < 0.f)
+                    Outside = true;
+            }
+            if(!Outside)
+                Offsets[Count++] = vec2f(OffsetX, OffsetZ);
+        }
+    }
+    return Count;
+}
+}
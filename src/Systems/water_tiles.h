@@ -0,0 +1,27 @@
+#ifndef WATER_TILES_H
+#define WATER_TILES_H
+
+#include "definitions.h"
+
+namespace water {
+    // NOTE - View frustum of the tile culling, relative to the eye. A point P is inside when
+    // Dot(Normal, P) + Distance >= 0 for every plane, the normals aren't normalized.
+    // Planes : left, right, bottom, top, near, far.
+    struct tile_frustum
+    {
+        vec3f Normal[6];
+        real32 Distance[6];
+    };
+
+    // TanY is tan(FOV / 2), Aspect width over height
+    tile_frustum MakeTileFrustum(camera const &Camera, real32 TanY, real32 Aspect, real32 Near, real32 Far);
+
+    // NOTE - The periodic ocean patch, Width wide, repeated on the (2 Radius + 1)^2 tiles of the grid centered on the
+    // tile under Eye, each tile being the patch moved by an integer multiple of Width along x and z. The waves move
+    // the surface up to Extent away from its tile, so tile boxes span [-Width/2 - Extent.x, Width/2 + Extent.x] around
+    // the offset along x, [-Extent.y, Extent.y] along y, and likewise along z.
+    // Writes the offsets (x, z) of the tiles whose box isn't fully outside Frustum, row by row, up to Capacity of them.
+    // Returns how many were written.
+    int CullTiles(tile_frustum const *Frustum, vec3f Eye, real32 Width, vec3f Extent, int Radius, int Capacity, vec2f *Offsets);
+}
+#endif
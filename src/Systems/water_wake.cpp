@@ -0,0 +1,486 @@
+#include "water_wake.h"
+#include "rf/utils.h"
+#include "jobs.h"
+
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#include <chrono>
+
+real32 static const WakeStepTime = 1.f / 60.f;
+real32 static const WakeWavelength = 8.f;   // Cells, the waves the layer propagates at the speed of
+real32 static const WakeDamping = 0.5f;     // 1/s
+real32 static const WakeGravity = 9.81f;
+int static const WakeSpongeWidth = 8;       // Cells
+int static const WakeMaxSteps = 8;          // Per advance, a stall doesn't replay all the missed time
+
+struct wake_pass
+{
+    water::wake *Wake;
+    real32 Damp;        // Velocity kept by a step
+    real32 K;           // Courant^2
+};
+
+// NOTE - The obstruction change since the last step is taken out of both the current and previous surfaces, moving
+// the water without giving it any velocity. Taken out of the next surface only, it would act as an impulse
+// and keep pushing until damped, displacing far more water than the obstacles.
+void WakeSourceRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    water::wake *Wake = (water::wake*)UserData;
+    int N = Wake->N;
+    int Stride = N + 2;
+
+    for(int j = Begin; j < End; ++j)
+    {
+        int Row = (j + 1) * Stride + 1;
+        real32 *H = Wake->Height + Row;
+        real32 *P = Wake->Previous + Row;
+        real32 const *O = Wake->Obstruction + Row;
+        real32 *OP = Wake->ObstructionPrev + Row;
+
+        int i = 0;
+#if HAVE_SSE2
+        for(; i < N; i += 4)
+        {
+            __m128 Obstruction = _mm_loadu_ps(O + i);
+            __m128 Delta = _mm_sub_ps(Obstruction, _mm_loadu_ps(OP + i));
+            _mm_storeu_ps(H + i, _mm_sub_ps(_mm_loadu_ps(H + i), Delta));
+            _mm_storeu_ps(P + i, _mm_sub_ps(_mm_loadu_ps(P + i), Delta));
+            _mm_storeu_ps(OP + i, Obstruction);
+        }
+#endif
+        for(; i < N; ++i)
+        {
+            real32 Delta = O[i] - OP[i];
+            H[i] -= Delta;
+            P[i] -= Delta;
+            OP[i] = O[i];
+        }
+    }
+}
+
+// NOTE - One step of rows [Begin, End), written over Previous. Each cell only reads Height around it and its own
+// Previous, so the rows need no synchronisation.
+void WakeStepRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    wake_pass *Pass = (wake_pass*)UserData;
+    water::wake *Wake = Pass->Wake;
+    int N = Wake->N;
+    int Stride = N + 2;
+
+    for(int j = Begin; j < End; ++j)
+    {
+        int Row = (j + 1) * Stride + 1;
+        real32 const *H = Wake->Height + Row;
+        real32 *P = Wake->Previous + Row;
+        real32 const *Sponge = Wake->Sponge;
+        real32 SpongeRow = Wake->Sponge[j];
+
+        int i = 0;
+#if HAVE_SSE2
+        __m128 Damp = _mm_set1_ps(Pass->Damp);
+        __m128 K = _mm_set1_ps(Pass->K);
+        __m128 Four = _mm_set1_ps(4.f);
+        __m128 SpongeRow4 = _mm_set1_ps(SpongeRow);
+        for(; i < N; i += 4)
+        {
+            __m128 C = _mm_loadu_ps(H + i);
+            __m128 Neighbours = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(H + i - 1), _mm_loadu_ps(H + i + 1)),
+                                           _mm_add_ps(_mm_loadu_ps(H + i - Stride), _mm_loadu_ps(H + i + Stride)));
+            __m128 Laplacian = _mm_sub_ps(Neighbours, _mm_mul_ps(Four, C));
+            __m128 New = _mm_add_ps(C, _mm_add_ps(_mm_mul_ps(_mm_sub_ps(C, _mm_loadu_ps(P + i)), Damp), _mm_mul_ps(K, Laplacian)));
+            _mm_storeu_ps(P + i, _mm_mul_ps(New, _mm_mul_ps(_mm_loadu_ps(Sponge + i), SpongeRow4)));
+        }
+#endif
+        for(; i < N; ++i)
+        {
+            real32 C = H[i];
+            real32 Laplacian = ((H[i - 1] + H[i + 1]) + (H[i - Stride] + H[i + Stride])) - 4.f * C;
+            real32 New = C + ((C - P[i]) * Pass->Damp + Pass->K * Laplacian);
+            P[i] = New * Sponge[i] * SpongeRow;
+        }
+    }
+}
+
+void WakeSlopeRows(void *UserData, int Begin, int End, int /*ThreadIdx*/)
+{
+    water::wake *Wake = (water::wake*)UserData;
+    int N = Wake->N;
+    int Stride = N + 2;
+    real32 InvTwoCells = 0.5f / Wake->CellSize;
+
+    for(int j = Begin; j < End; ++j)
+    {
+        int Row = (j + 1) * Stride + 1;
+        real32 const *H = Wake->Height + Row;
+        real32 *SX = Wake->SlopeX + Row;
+        real32 *SZ = Wake->SlopeZ + Row;
+        real32 RowMax = 0.f;
+
+        int i = 0;
+#if HAVE_SSE2
+        __m128 Scale = _mm_set1_ps(InvTwoCells);
+        __m128 AbsMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+        __m128 Max4 = _mm_setzero_ps();
+        for(; i < N; i += 4)
+        {
+            _mm_storeu_ps(SX + i, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(H + i + 1), _mm_loadu_ps(H + i - 1)), Scale));
+            _mm_storeu_ps(SZ + i, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(H + i + Stride), _mm_loadu_ps(H + i - Stride)), Scale));
+            Max4 = _mm_max_ps(Max4, _mm_and_ps(_mm_loadu_ps(H + i), AbsMask));
+        }
+        real32 Lanes[4];
+        _mm_storeu_ps(Lanes, Max4);
+        RowMax = Max(Max(Lanes[0], Lanes[1]), Max(Lanes[2], Lanes[3]));
+#endif
+        for(; i < N; ++i)
+        {
+            SX[i] = (H[i + 1] - H[i - 1]) * InvTwoCells;
+            SZ[i] = (H[i + Stride] - H[i - Stride]) * InvTwoCells;
+            RowMax = Max(RowMax, fabsf(H[i]));
+        }
+        Wake->RowMax[j] = RowMax;
+    }
+}
+
+// NOTE - New cell (i, j) takes old cell (i + dX, j + dZ), cells coming from outside are calm
+void WakeShift(water::wake *Wake, real32 **Field, int dX, int dZ)
+{
+    int N = Wake->N;
+    int Stride = N + 2;
+    memset(Wake->Scratch, 0, Stride * Stride * sizeof(real32));
+
+    int Begin = Max(0, -dX);
+    int End = Min(N, N - dX);
+    for(int j = 0; j < N && Begin < End; ++j)
+    {
+        int SrcJ = j + dZ;
+        if(SrcJ < 0 || SrcJ >= N)
+            continue;
+        memcpy(Wake->Scratch + (j + 1) * Stride + 1 + Begin, *Field + (SrcJ + 1) * Stride + 1 + Begin + dX,
+               (End - Begin) * sizeof(real32));
+    }
+
+    real32 *Tmp = *Field;
+    *Field = Wake->Scratch;
+    Wake->Scratch = Tmp;
+}
+
+// NOTE - Box filter of the cells, taken as constant over their square, from the prefix sums P of a line of Count
+// values : the integral up to U cells is P[i] + (U - i) * v[i]. Lattice point a covers [U0 + a.Step - Step/2,
+// U0 + a.Step + Step/2) in cells, past both ends of the line is calm water.
+void BoxFilterLine(real32 const *Line, int Count, int LineStride, real32 *Prefix, real32 U0, real32 Step, int OutCount,
+                   real32 *Out, int OutStride)
+{
+    Prefix[0] = 0.f;
+    for(int i = 0; i < Count; ++i)
+        Prefix[i + 1] = Prefix[i] + Line[i * LineStride];
+
+    real32 InvStep = 1.f / Step;
+    real32 Lo = U0 - 0.5f * Step;
+    real32 IntegralLo = 0.f;
+    for(int a = 0; a < OutCount; ++a)
+    {
+        real32 Hi = Lo + Step;
+        real32 IntegralHi;
+        if(Hi <= 0.f)
+            IntegralHi = 0.f;
+        else if(Hi >= (real32)Count)
+            IntegralHi = Prefix[Count];
+        else
+        {
+            int i = (int)Hi;
+            IntegralHi = Prefix[i] + (Hi - i) * Line[i * LineStride];
+        }
+        if(a == 0)
+        {
+            if(Lo <= 0.f)
+                IntegralLo = 0.f;
+            else if(Lo >= (real32)Count)
+                IntegralLo = Prefix[Count];
+            else
+            {
+                int i = (int)Lo;
+                IntegralLo = Prefix[i] + (Lo - i) * Line[i * LineStride];
+            }
+        }
+        Out[a * OutStride] = (IntegralHi - IntegralLo) * InvStep;
+        IntegralLo = IntegralHi;
+        Lo = Hi;
+    }
+}
+
+namespace water {
+void WakeInit(wake *Wake, rf::mem_pool *Pool, int N, real32 CellSize, real32 BudgetMs)
+{
+    memset(Wake, 0, sizeof(*Wake));
+    N &= ~3;
+    if(N < 4 * WakeSpongeWidth || CellSize <= 0.f)
+        return;
+
+    Wake->N = N;
+    Wake->CellSize = CellSize;
+    Wake->BudgetMs = BudgetMs;
+    Wake->Time = -1.f;
+
+    // NOTE - Explicit steps are stable for Courant numbers under 1/sqrt(2)
+    real32 Speed = sqrtf(WakeGravity * WakeWavelength * CellSize / (2.f * (real32)M_PI));
+    Wake->Courant = Min(Speed * WakeStepTime / CellSize, 0.5f);
+
+    size_t FieldSize = (size_t)(N + 2) * (N + 2);
+    Wake->Height = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->Previous = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->Obstruction = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->ObstructionPrev = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->SlopeX = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->SlopeZ = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->Scratch = rf::PoolAlloc<real32>(Pool, FieldSize);
+    Wake->Sponge = rf::PoolAlloc<real32>(Pool, N);
+    Wake->RowMax = rf::PoolAlloc<real32>(Pool, N);
+
+    // NOTE - Per step attenuation, down to 0.9 on the border cells
+    for(int i = 0; i < N; ++i)
+    {
+        real32 t = Min(1.f, Min(i, N - 1 - i) / (real32)WakeSpongeWidth);
+        Wake->Sponge[i] = 1.f - 0.1f * Square(1.f - t);
+    }
+}
+
+void WakeRecenter(wake *Wake, vec2f Center)
+{
+    int OriginX = (int)floorf(Center.x / Wake->CellSize) - Wake->N / 2;
+    int OriginZ = (int)floorf(Center.y / Wake->CellSize) - Wake->N / 2;
+    int dX = OriginX - Wake->OriginX;
+    int dZ = OriginZ - Wake->OriginZ;
+    if(dX == 0 && dZ == 0)
+        return;
+
+    Wake->OriginX = OriginX;
+    Wake->OriginZ = OriginZ;
+    WakeShift(Wake, &Wake->Height, dX, dZ);
+    WakeShift(Wake, &Wake->Previous, dX, dZ);
+    WakeShift(Wake, &Wake->Obstruction, dX, dZ);
+    WakeShift(Wake, &Wake->ObstructionPrev, dX, dZ);
+    WakeShift(Wake, &Wake->SlopeX, dX, dZ);
+    WakeShift(Wake, &Wake->SlopeZ, dX, dZ);
+}
+
+// NOTE - Each obstacle is splatted with the kernel (1 - d^2/R^2)^2, of integral pi.R^2/3, so the displaced height
+// sums to its volume. Radii under 1.5 cells would alias and are widened.
+void WakeSetObstacles(wake *Wake, int Count, wake_obstacle const *Obstacles)
+{
+    int N = Wake->N;
+    int Stride = N + 2;
+    real32 Cell = Wake->CellSize;
+    memset(Wake->Obstruction, 0, Stride * Stride * sizeof(real32));
+
+    for(int o = 0; o < Count; ++o)
+    {
+        wake_obstacle const &Obstacle = Obstacles[o];
+        real32 R = Max(Obstacle.Radius, 1.5f * Cell);
+        real32 Peak = Obstacle.Volume / ((real32)M_PI * Square(R) / 3.f);
+        real32 U = Obstacle.Position.x / Cell - Wake->OriginX - 0.5f;
+        real32 V = Obstacle.Position.y / Cell - Wake->OriginZ - 0.5f;
+        int i0 = Max(0, (int)floorf(U - R / Cell)), i1 = Min(N - 1, (int)ceilf(U + R / Cell));
+        int j0 = Max(0, (int)floorf(V - R / Cell)), j1 = Min(N - 1, (int)ceilf(V + R / Cell));
+        real32 InvR2 = Square(Cell / R);
+        for(int j = j0; j <= j1; ++j)
+        {
+            real32 *Row = Wake->Obstruction + (j + 1) * Stride + 1;
+            for(int i = i0; i <= i1; ++i)
+            {
+                real32 w = 1.f - (Square(i - U) + Square(j - V)) * InvR2;
+                if(w > 0.f)
+                    Row[i] += Peak * w * w;
+            }
+        }
+    }
+}
+
+void WakeAdvance(wake *Wake, real32 T)
+{
+    if(Wake->N == 0)
+        return;
+    if(Wake->Time < 0.f || T < Wake->Time)
+    {
+        Wake->Time = T;
+        return;
+    }
+
+    wake_pass Pass;
+    Pass.Wake = Wake;
+    Pass.Damp = 1.f - WakeDamping * WakeStepTime;
+    Pass.K = Square(Wake->Courant);
+
+    typedef std::chrono::steady_clock clock;
+    clock::time_point Start = clock::now();
+    int Grain = Max(1, Wake->N / (4 * jobs::ThreadCount()));
+    int Steps = 0;
+    while(Wake->Time + WakeStepTime <= T)
+    {
+        real32 ElapsedMs = (real32)std::chrono::duration<real64, std::milli>(clock::now() - Start).count();
+        if(Steps == WakeMaxSteps || (Steps > 0 && ElapsedMs > Wake->BudgetMs))
+        {
+            Wake->Time = T;
+            break;
+        }
+
+        if(Steps == 0)
+            jobs::ParallelFor(Wake->N, Grain, WakeSourceRows, Wake);
+        jobs::ParallelFor(Wake->N, Grain, WakeStepRows, &Pass);
+        real32 *Tmp = Wake->Height;
+        Wake->Height = Wake->Previous;
+        Wake->Previous = Tmp;
+        Wake->Time += WakeStepTime;
+        ++Steps;
+    }
+
+    if(Steps > 0)
+    {
+        jobs::ParallelFor(Wake->N, Grain, WakeSlopeRows, Wake);
+        Wake->MaxHeight = 0.f;
+        for(int j = 0; j < Wake->N; ++j)
+            Wake->MaxHeight = Max(Wake->MaxHeight, Wake->RowMax[j]);
+    }
+}
+
+vec2f WakeMin(wake const *Wake)
+{
+    return vec2f(Wake->OriginX * Wake->CellSize, Wake->OriginZ * Wake->CellSize);
+}
+
+real32 WakeSize(wake const *Wake)
+{
+    return Wake->N * Wake->CellSize;
+}
+
+void WakeSample(wake const *Wake, real32 X, real32 Z, real32 *Height, real32 *SlopeX, real32 *SlopeZ)
+{
+    *Height = *SlopeX = *SlopeZ = 0.f;
+
+    // NOTE - Lookups reach into the zero border, cell centers are at +0.5
+    real32 U = X / Wake->CellSize - Wake->OriginX - 0.5f;
+    real32 V = Z / Wake->CellSize - Wake->OriginZ - 0.5f;
+    if(!(U >= -1.f && U < (real32)Wake->N && V >= -1.f && V < (real32)Wake->N))
+        return;
+
+    int i = (int)floorf(U);
+    int j = (int)floorf(V);
+    real32 FU = U - i;
+    real32 FV = V - j;
+    int Stride = Wake->N + 2;
+    int Idx = (j + 1) * Stride + i + 1;
+
+    real32 const *Fields[3] = { Wake->Height, Wake->SlopeX, Wake->SlopeZ };
+    real32 *Out[3] = { Height, SlopeX, SlopeZ };
+    for(int f = 0; f < 3; ++f)
+    {
+        real32 const *F = Fields[f] + Idx;
+        *Out[f] = Mix(Mix(F[0], F[1], FU), Mix(F[Stride], F[Stride + 1], FU), FV);
+    }
+}
+
+void WakeGridInit(wake_grid *Grid, rf::mem_pool *Pool, wake const *Wake, real32 MinCellSize)
+{
+    *Grid = wake_grid();
+    if(Wake->N == 0 || MinCellSize <= 0.f)
+        return;
+
+    // NOTE - Lattice points whose square overlaps the layer, see WakeDownsample
+    int Capacity = (int)ceilf(WakeSize(Wake) / MinCellSize) + 3;
+    Grid->Capacity = Capacity;
+    Grid->CellSize = MinCellSize;
+    Grid->Height = rf::PoolAlloc<real32>(Pool, Square(Capacity));
+    Grid->SlopeX = rf::PoolAlloc<real32>(Pool, Square(Capacity));
+    Grid->SlopeZ = rf::PoolAlloc<real32>(Pool, Square(Capacity));
+    Grid->Scratch = rf::PoolAlloc<real32>(Pool, (size_t)Wake->N * Capacity + Max(Wake->N, Capacity) + 1);
+}
+
+// NOTE - Separable : each layer row is filtered along x to the lattice columns, then each lattice column along z.
+// A few hundred thousand operations for the default layer, on the calling thread.
+void WakeDownsample(wake const *Wake, real32 CellSize, wake_grid *Grid)
+{
+    Grid->Size = 0;
+    Grid->MaxHeight = 0.f;
+    if(Wake->N == 0 || Grid->Capacity == 0)
+        return;
+
+    int N = Wake->N;
+    int Stride = N + 2;
+    CellSize = Max(CellSize, Grid->CellSize);
+    vec2f Origin = WakeMin(Wake);
+    int Count = Min((int)ceilf(WakeSize(Wake) / CellSize) + 3, Grid->Capacity);
+    Grid->Min = vec2f(floorf(Origin.x / CellSize) * CellSize, floorf(Origin.y / CellSize) * CellSize);
+    Grid->CellSize = CellSize;
+    Grid->Size = Count;
+
+    // NOTE - Lattice point 0 in layer cells, cell i covering [i, i + 1)
+    real32 Step = CellSize / Wake->CellSize;
+    real32 U0 = Grid->Min.x / Wake->CellSize - Wake->OriginX;
+    real32 V0 = Grid->Min.y / Wake->CellSize - Wake->OriginZ;
+    real32 *Rows = Grid->Scratch;
+    real32 *Prefix = Grid->Scratch + (size_t)N * Grid->Capacity;
+
+    real32 const *Fields[3] = { Wake->Height, Wake->SlopeX, Wake->SlopeZ };
+    real32 *Out[3] = { Grid->Height, Grid->SlopeX, Grid->SlopeZ };
+    for(int f = 0; f < 3; ++f)
+    {
+        for(int j = 0; j < N; ++j)
+            BoxFilterLine(Fields[f] + (j + 1) * Stride + 1, N, 1, Prefix, U0, Step, Count, Rows + j * Count, 1);
+        for(int a = 0; a < Count; ++a)
+            BoxFilterLine(Rows + a, N, Count, Prefix, V0, Step, Count, Out[f] + a, Count);
+    }
+
+    for(int i = 0; i < Square(Count); ++i)
+        Grid->MaxHeight = Max(Grid->MaxHeight, fabsf(Grid->Height[i]));
+}
+
+void WakeGridBlend(wake_grid const *A, wake_grid const *B, real32 Alpha, wake_grid *Out)
+{
+    bool Same = A->Size == B->Size && A->CellSize == B->CellSize && A->Min.x == B->Min.x && A->Min.y == B->Min.y;
+    if(!Same)
+        A = B = Alpha < 0.5f ? A : B;
+
+    Out->Min = A->Min;
+    Out->CellSize = A->CellSize;
+    Out->Size = Min(A->Size, Out->Capacity);
+    Out->MaxHeight = 0.f;
+    real32 const *FieldsA[3] = { A->Height, A->SlopeX, A->SlopeZ };
+    real32 const *FieldsB[3] = { B->Height, B->SlopeX, B->SlopeZ };
+    real32 *Fields[3] = { Out->Height, Out->SlopeX, Out->SlopeZ };
+    for(int f = 0; f < 3; ++f)
+    {
+        for(int i = 0; i < Square(Out->Size); ++i)
+            Fields[f][i] = Mix(FieldsA[f][i], FieldsB[f][i], Alpha);
+    }
+    for(int i = 0; i < Square(Out->Size); ++i)
+        Out->MaxHeight = Max(Out->MaxHeight, fabsf(Out->Height[i]));
+}
+
+void WakeGridSample(wake_grid const *Grid, real32 X, real32 Z, real32 *Height, real32 *SlopeX, real32 *SlopeZ)
+{
+    *Height = *SlopeX = *SlopeZ = 0.f;
+    if(Grid->Size == 0)
+        return;
+
+    real32 U = (X - Grid->Min.x) / Grid->CellSize;
+    real32 V = (Z - Grid->Min.y) / Grid->CellSize;
+    int Last = Grid->Size - 1;
+    if(!(U >= 0.f && U < (real32)Last && V >= 0.f && V < (real32)Last))
+        return;
+
+    int i = (int)U;
+    int j = (int)V;
+    real32 FU = U - i;
+    real32 FV = V - j;
+    int Idx = j * Grid->Size + i;
+    int Stride = Grid->Size;
+
+    real32 const *Fields[3] = { Grid->Height, Grid->SlopeX, Grid->SlopeZ };
+    real32 *Out[3] = { Height, SlopeX, SlopeZ };
+    for(int f = 0; f < 3; ++f)
+    {
+        real32 const *F = Fields[f] + Idx;
+        *Out[f] = Mix(Mix(F[0], F[1], FU), Mix(F[Stride], F[Stride + 1], FU), FV);
+    }
+}
+}
@@ -0,0 +1,92 @@
+#ifndef WATER_WAKE_H
+#define WATER_WAKE_H
+
+#include "definitions.h"
+
+namespace water {
+    // NOTE - Something floating that pushes water aside, the wake source
+    struct wake_obstacle
+    {
+        vec2f Position;     // Water plane (x, z)
+        real32 Radius;      // Horizontal extent
+        real32 Volume;      // Submerged volume, m^3
+    };
+
+    // NOTE - Interactive wave layer on top of the FFT ocean, a square grid of N * N cells following a point of the
+    // water plane. It solves the damped 2D wave equation
+    //   d2h/dt2 = c^2 Laplacian(h) - Damping dh/dt
+    // with explicit fixed steps, the wave speed c being the deep water one for waves WakeWavelength cells long.
+    // Obstacles displace water : the change of their displaced volume on each cell is taken out of the surface there,
+    // so a body dropping in sends rings and a moving body leaves a wake. The borders are a sponge absorbing the waves.
+    // Fields have a one cell zero border, row stride N + 2.
+    struct wake
+    {
+        int N;                  // Cells per side, multiple of 4, 0 : disabled
+        real32 CellSize;
+        real32 Courant;         // c.dt / CellSize
+        real32 BudgetMs;        // Most time spent stepping per WakeAdvance
+        real32 Time;            // Simulated up to, < 0 before the first advance
+        int OriginX;            // World cell of cell (0, 0)
+        int OriginZ;
+
+        real32 *Height;         // Current surface
+        real32 *Previous;       // Surface of the previous step, overwritten by the next one
+        real32 *Obstruction;    // Displaced water height of the obstacles
+        real32 *ObstructionPrev;
+        real32 *SlopeX;         // Of Height, after the last step
+        real32 *SlopeZ;
+        real32 *Scratch;
+        real32 *Sponge;         // N, attenuation towards the borders
+        real32 *RowMax;         // N, max |Height| of each row after the last step
+        real32 MaxHeight;
+    };
+
+    void WakeInit(wake *Wake, rf::mem_pool *Pool, int N, real32 CellSize, real32 BudgetMs);
+
+    // Moves the grid so its center is around Center, the waves keep their world position
+    void WakeRecenter(wake *Wake, vec2f Center);
+
+    // Sets the obstacles of the coming steps, replacing the previous ones
+    void WakeSetObstacles(wake *Wake, int Count, wake_obstacle const *Obstacles);
+
+    // Fixed steps up to time T, stopping early once the budget is spent, the remaining time being dropped
+    void WakeAdvance(wake *Wake, real32 T);
+
+    // World extent of the grid, [Min, Min + Size) on both axes
+    vec2f WakeMin(wake const *Wake);
+    real32 WakeSize(wake const *Wake);
+
+    // Height and slopes at world (x, z), 0 outside the grid
+    void WakeSample(wake const *Wake, real32 X, real32 Z, real32 *Height, real32 *SlopeX, real32 *SlopeZ);
+
+    // NOTE - The layer box-filtered to a coarser lattice, to be read once per cell of that lattice without aliasing.
+    // Point (i, j) lies at Min + (i, j) * CellSize, Min being a multiple of CellSize so that the lattice lines up
+    // with the ocean grid, and holds the mean of the layer over the CellSize square centred on it. Fields are
+    // Size * Size, row-major, Size varying with CellSize up to Capacity.
+    struct wake_grid
+    {
+        vec2f Min;
+        real32 CellSize;
+        int Size;               // 0 : no layer
+        int Capacity;
+        real32 *Height;         // Capacity^2 each
+        real32 *SlopeX;
+        real32 *SlopeZ;
+        real32 *Scratch;        // Layer rows filtered along x, and the prefix sums
+        real32 MaxHeight;
+    };
+
+    // For lattices of cells at least MinCellSize wide
+    void WakeGridInit(wake_grid *Grid, rf::mem_pool *Pool, wake const *Wake, real32 MinCellSize);
+
+    // Filters the layer to the lattice of CellSize, at least the MinCellSize of the grid
+    void WakeDownsample(wake const *Wake, real32 CellSize, wake_grid *Grid);
+
+    // Out between A (Alpha 0) and B (Alpha 1). Lattices that moved or changed cell size between the two aren't mixed,
+    // the nearest one is taken as is.
+    void WakeGridBlend(wake_grid const *A, wake_grid const *B, real32 Alpha, wake_grid *Out);
+
+    // Bilinear height and slopes of the lattice at world (x, z), 0 outside it
+    void WakeGridSample(wake_grid const *Grid, real32 X, real32 Z, real32 *Height, real32 *SlopeX, real32 *SlopeZ);
+}
+#endif
@@ -36,6 +36,33 @@ struct config
 
 	real32  TimeScale; // Ratio for the length of a day. 1.0 is real time. 
 					   // 30.0 is 1 day = 48 minutes
+
+	int32   WorkerThreads; // Job system workers, besides the main thread. -1 : one per extra hardware thread
+
+	int32   WaterN;       // Ocean grid resolution : 64, 128, 256 or 512
+	int32   WaterFFTMode; // water::fft_mode, 0 : scalar, 1 : SIMD, 2 : SIMD + blocked 2D
+	bool    WaterFFTPacked; // Pack the real ocean fields two by two in complex FFTs
+	int32   WaterSeed;      // Seed of the ocean spectra, same seed gives the same ocean
+	real32  WaterBakeFPS;   // Bake one ocean period at this rate and play it back, 0 : live simulation
+	bool    WaterAsync;     // Run the ocean simulation on its own thread
+	real32  WaterSimHz;     // Ocean thread update rate, 0 : unthrottled
+	bool    WaterCompactVertices; // int16 displacements and octahedral int8 normals in the ocean vertex stream
+	int32   WaterCascades;  // Ocean spectrum bands, 1 to 4, each on a patch 4 times narrower than the previous one
+	int32   WaterWakeN;         // Interactive wave layer cells per side, 0 : disabled
+	real32  WaterWakeCellSize;  // Interactive wave layer cell size, m
+	real32  WaterWakeBudgetMs;  // Most time the wave layer steps take per ocean step, ms
+	bool    WaterThrottle;      // Lower the ocean update rate with the camera altitude and the water in view
+	bool    WaterTextures;      // Also output the ocean as displacement and slope textures with their mip chains
+	int32   WaterTileRadius;    // Draw the ocean patch on the (2R+1)^2 tiles around the camera, 0 : projected grid
+	real32  WaterSlabDistance;  // Projected grid : distance of the water drawn with the far shading, 0 : one screen quad
+
+	int32   BuoyancyMaxBodies;     // Floating bodies capacity
+	int32   BuoyancyMaxHullPoints; // Hull points capacity, over all the bodies
+	real32  BuoyancyHz;            // Fixed step rate of the floating bodies
+
+	int32   SprayMaxParticles;  // Spray and foam particles capacity
+	real32  SprayJacobian;      // Ocean displacement Jacobian under which the waves break and throw spray
+	real32  SprayRate;          // Spray particles per second and m^2 of breaking water
 };
 
 // NOTE - This memory is allocated at startup
@@ -0,0 +1,136 @@
+#include "jobs.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+namespace jobs {
+struct parallel_for
+{
+    range_func *Func;
+    void *UserData;
+    int Count;
+    int Grain;
+    int ChunkCount;
+    std::atomic<int> NextChunk;
+};
+
+static std::thread Workers[MaxThreadCount];
+static int WorkerCount = 0;
+
+static std::mutex DispatchMutex;        // Only one ParallelFor uses the workers at a time
+static std::mutex JobMutex;             // Guards everything below
+static std::condition_variable WakeCond;
+static std::condition_variable IdleCond;
+static parallel_for Job;
+static uint32 Generation = 0;           // Bumped for each new job, workers wait on it
+static int ActiveWorkers = 0;           // Workers currently inside a job
+static bool Running = false;
+
+static void RunChunks(parallel_for *PF, int ThreadIdx)
+{
+    for(;;)
+    {
+        int Chunk = PF->NextChunk.fetch_add(1);
+        if(Chunk >= PF->ChunkCount)
+            break;
+
+        int Begin = Chunk * PF->Grain;
+        int End = Min(Begin + PF->Grain, PF->Count);
+        PF->Func(PF->UserData, Begin, End, ThreadIdx);
+    }
+}
+
+static void WorkerMain(int ThreadIdx)
+{
+    uint32 SeenGeneration = 0;
+    for(;;)
+    {
+        {
+            std::unique_lock<std::mutex> Lock(JobMutex);
+            WakeCond.wait(Lock, [&]{ return !Running || Generation != SeenGeneration; });
+            if(!Running)
+                return;
+            SeenGeneration = Generation;
+            ++ActiveWorkers;
+        }
+
+        RunChunks(&Job, ThreadIdx);
+
+        {
+            std::lock_guard<std::mutex> Lock(JobMutex);
+            if(--ActiveWorkers == 0)
+                IdleCond.notify_all();
+        }
+    }
+}
+
+void Init(int Count)
+{
+    if(Count < 0)
+        Count = (int)std::thread::hardware_concurrency() - 1;
+    WorkerCount = Clamp(Count, 0, MaxThreadCount - 1);
+
+    Running = true;
+    for(int i = 0; i < WorkerCount; ++i)
+    {
+        Workers[i] = std::thread(WorkerMain, i + 1);
+    }
+    LogInfo("Job system : %d worker threads", WorkerCount);
+}
+
+void Destroy()
+{
+    {
+        std::lock_guard<std::mutex> Lock(JobMutex);
+        Running = false;
+    }
+    WakeCond.notify_all();
+    for(int i = 0; i < WorkerCount; ++i)
+    {
+        Workers[i].join();
+    }
+    WorkerCount = 0;
+}
+
+int ThreadCount()
+{
+    return WorkerCount + 1;
+}
+
+void ParallelFor(int Count, int Grain, range_func *Func, void *UserData)
+{
+    if(Count <= 0)
+        return;
+    Grain = Max(Grain, 1);
+
+    std::unique_lock<std::mutex> Dispatch(DispatchMutex, std::try_to_lock);
+    if(WorkerCount == 0 || Count <= Grain || !Dispatch.owns_lock())
+    {
+        Func(UserData, 0, Count, 0);
+        return;
+    }
+
+    {
+        // NOTE - Late workers from the previous job must be out of it before it is overwritten
+        std::unique_lock<std::mutex> Lock(JobMutex);
+        IdleCond.wait(Lock, []{ return ActiveWorkers == 0; });
+
+        Job.Func = Func;
+        Job.UserData = UserData;
+        Job.Count = Count;
+        Job.Grain = Grain;
+        Job.ChunkCount = (Count + Grain - 1) / Grain;
+        Job.NextChunk.store(0);
+        ++Generation;
+    }
+    WakeCond.notify_all();
+
+    RunChunks(&Job, 0);
+
+    // NOTE - Every chunk is claimed at this point, wait for the workers still running theirs
+    std::unique_lock<std::mutex> Lock(JobMutex);
+    IdleCond.wait(Lock, []{ return ActiveWorkers == 0; });
+}
+}
@@ -0,0 +1,27 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include "definitions.h"
+
+// NOTE - Worker thread pool running data-parallel loops.
+// The thread calling ParallelFor always takes part in the work as thread 0, workers are 1..ThreadCount-1,
+// so per-thread scratch memory can be indexed by ThreadIdx.
+namespace jobs {
+    // Called for the sub-range [Begin, End) of a ParallelFor, on thread ThreadIdx
+    typedef void range_func(void *UserData, int Begin, int End, int ThreadIdx);
+
+    int static const MaxThreadCount = 32;
+
+    // WorkerCount < 0 : one worker per hardware thread, minus the main thread
+    void Init(int WorkerCount);
+    void Destroy();
+
+    // Number of threads a ParallelFor can run on, including the calling thread
+    int ThreadCount();
+
+    // Runs Func over [0, Count) in chunks of Grain items, returns once every chunk is done.
+    // If the workers are already busy with another caller's loop, the whole range runs on the calling thread.
+    void ParallelFor(int Count, int Grain, range_func *Func, void *UserData);
+}
+
+#endif
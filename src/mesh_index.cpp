@@ -0,0 +1,315 @@
+#include "mesh_index.h"
+#include "rf/context.h"
+
+// NOTE - Scoring of OptimizeTriangleOrder, the values of Forsyth's article. The cache modelled by the scores is
+// larger than the ones the order is measured on, which only makes the vertices of the last triangles stay hot.
+int static const ScoreCacheSize = 32;
+real32 static const CacheDecayPower = 1.5f;
+real32 static const LastTriangleScore = 0.75f;
+real32 static const ValenceBoostScale = 2.f;
+real32 static const ValenceBoostPower = 0.5f;
+
+inline void SetIndex(mesh::indices *Out, uint32 Idx, uint32 Value)
+{
+    if(Out->Type == GL_UNSIGNED_SHORT)
+        ((uint16*)Out->Data)[Idx] = (uint16)Value;
+    else
+        ((uint32*)Out->Data)[Idx] = Value;
+}
+
+// NOTE - Type and restart value for indices up to VertexCount - 1, keeping the restart value out of them
+void ChooseIndexType(mesh::indices *Out, uint32 VertexCount)
+{
+    bool Narrow = Out->Mode == GL_TRIANGLE_STRIP ? VertexCount < 0xFFFF : VertexCount <= 0x10000;
+    Out->Type = Narrow ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    Out->Restart = Narrow ? 0xFFFF : 0xFFFFFFFF;
+}
+
+// NOTE - Score of a vertex at CachePosition (-1 : not in the cache) with Remaining triangles left to emit
+real32 VertexScore(int CachePosition, uint32 Remaining)
+{
+    if(Remaining == 0)
+        return -1.f;
+
+    real32 Score = 0.f;
+    if(CachePosition >= 0)
+    {
+        // NOTE - The vertices of the last triangle get a fixed score, so that the next one doesn't just reuse
+        // its edge and strip along
+        if(CachePosition < 3)
+            Score = LastTriangleScore;
+        else
+            Score = powf(1.f - (CachePosition - 3) / (real32)(ScoreCacheSize - 3), CacheDecayPower);
+    }
+    return Score + ValenceBoostScale * powf((real32)Remaining, -ValenceBoostPower);
+}
+
+namespace mesh {
+size_t IndexSize(uint32 Type)
+{
+    return Type == GL_UNSIGNED_SHORT ? sizeof(uint16) : sizeof(uint32);
+}
+
+uint32 GetIndex(indices const *In, uint32 Idx)
+{
+    if(In->Type == GL_UNSIGNED_SHORT)
+        return ((uint16 const*)In->Data)[Idx];
+    return ((uint32 const*)In->Data)[Idx];
+}
+
+void BuildGridIndices(indices *Out, rf::mem_pool *Pool, int Columns, int Rows, int CacheSize, bool Strips)
+{
+    int BlockWidth = Max(1, Min(CacheSize, MaxCacheSize) - 2);
+    int BlockCount = (Columns + BlockWidth - 1) / BlockWidth;
+    uint32 Stride = Columns + 1;
+
+    Out->Mode = Strips ? GL_TRIANGLE_STRIP : GL_TRIANGLES;
+    ChooseIndexType(Out, Stride * (Rows + 1));
+
+    // NOTE - Strips : 2 indices per vertex column of each block row and of the priming, and the restarts between
+    // them. Lists : 6 per quad, and 3 per 2 vertices of the priming.
+    size_t Capacity = Strips ? (size_t)(Rows + 1) * (2 * (Columns + BlockCount) + BlockCount)
+                             : (size_t)6 * Columns * Rows + 3 * (Columns + 2 * BlockCount);
+    Out->Data = rf::PoolAlloc<uint8>(Pool, Capacity * IndexSize(Out->Type));
+
+    uint32 Count = 0;
+    for(int Block = 0; Block < Columns; Block += BlockWidth)
+    {
+        int BlockEnd = Min(Block + BlockWidth, Columns);
+
+        // NOTE - The first row of a block is loaded alone first, with degenerate triangles. Loaded along with the
+        // second one, both would have twice the vertices of a row in the cache, evicting each other from then on.
+        if(Strips)
+        {
+            if(Count > 0)
+                SetIndex(Out, Count++, Out->Restart);
+            for(int x = Block; x <= BlockEnd; ++x)
+            {
+                SetIndex(Out, Count++, x);
+                SetIndex(Out, Count++, x);
+            }
+        }
+        else
+        {
+            for(int x = Block; x <= BlockEnd; x += 2)
+            {
+                SetIndex(Out, Count++, x);
+                SetIndex(Out, Count++, x);
+                SetIndex(Out, Count++, Min(x + 1, BlockEnd));
+            }
+        }
+
+        for(int y = 0; y < Rows; ++y)
+        {
+            uint32 Top = y * Stride;
+            uint32 Bottom = Top + Stride;
+            if(Strips)
+            {
+                if(Count > 0)
+                    SetIndex(Out, Count++, Out->Restart);
+                for(int x = Block; x <= BlockEnd; ++x)
+                {
+                    SetIndex(Out, Count++, Top + x);
+                    SetIndex(Out, Count++, Bottom + x);
+                }
+            }
+            else
+            {
+                for(int x = Block; x < BlockEnd; ++x)
+                {
+                    SetIndex(Out, Count++, Top + x);
+                    SetIndex(Out, Count++, Bottom + x);
+                    SetIndex(Out, Count++, Top + x + 1);
+                    SetIndex(Out, Count++, Top + x + 1);
+                    SetIndex(Out, Count++, Bottom + x);
+                    SetIndex(Out, Count++, Bottom + x + 1);
+                }
+            }
+        }
+    }
+    Out->Count = Count;
+}
+
+void OptimizeTriangleOrder(uint32 *Indices, uint32 IndexCount, uint32 VertexCount, rf::mem_pool *Scratch)
+{
+    uint32 TriangleCount = IndexCount / 3;
+    if(TriangleCount == 0)
+        return;
+
+    // NOTE - Triangles left to emit of each vertex v, Adjacency[First[v], First[v] + Remaining[v])
+    uint32 *Remaining = rf::PoolAlloc<uint32>(Scratch, VertexCount);
+    uint32 *First = rf::PoolAlloc<uint32>(Scratch, VertexCount + 1);
+    uint32 *Adjacency = rf::PoolAlloc<uint32>(Scratch, 3 * TriangleCount);
+    int32 *CachePosition = rf::PoolAlloc<int32>(Scratch, VertexCount);
+    real32 *Score = rf::PoolAlloc<real32>(Scratch, VertexCount);
+    real32 *TriangleScore = rf::PoolAlloc<real32>(Scratch, TriangleCount);
+    uint8 *Emitted = rf::PoolAlloc<uint8>(Scratch, TriangleCount);
+    uint32 *Output = rf::PoolAlloc<uint32>(Scratch, 3 * TriangleCount);
+
+    memset(Remaining, 0, VertexCount * sizeof(uint32));
+    for(uint32 i = 0; i < 3 * TriangleCount; ++i)
+        ++Remaining[Indices[i]];
+    First[0] = 0;
+    for(uint32 v = 0; v < VertexCount; ++v)
+    {
+        First[v + 1] = First[v] + Remaining[v];
+        Remaining[v] = 0;
+    }
+    for(uint32 t = 0; t < TriangleCount; ++t)
+    {
+        for(int k = 0; k < 3; ++k)
+        {
+            uint32 v = Indices[3 * t + k];
+            Adjacency[First[v] + Remaining[v]++] = t;
+        }
+    }
+
+    for(uint32 v = 0; v < VertexCount; ++v)
+    {
+        CachePosition[v] = -1;
+        Score[v] = VertexScore(-1, Remaining[v]);
+    }
+    int32 Best = 0;
+    for(uint32 t = 0; t < TriangleCount; ++t)
+    {
+        Emitted[t] = 0;
+        TriangleScore[t] = Score[Indices[3 * t]] + Score[Indices[3 * t + 1]] + Score[Indices[3 * t + 2]];
+        if(TriangleScore[t] > TriangleScore[Best])
+            Best = t;
+    }
+
+    uint32 Cache[ScoreCacheSize + 3];
+    int CacheCount = 0;
+    uint32 Cursor = 0; // Every triangle before it is emitted
+    for(uint32 Written = 0; Written < TriangleCount; ++Written)
+    {
+        uint32 const *Triangle = Indices + 3 * Best;
+        Emitted[Best] = 1;
+        memcpy(Output + 3 * Written, Triangle, 3 * sizeof(uint32));
+
+        for(int k = 0; k < 3; ++k)
+        {
+            uint32 v = Triangle[k];
+            uint32 *List = Adjacency + First[v];
+            for(uint32 i = 0; i < Remaining[v]; ++i)
+            {
+                if(List[i] == (uint32)Best)
+                {
+                    List[i] = List[--Remaining[v]];
+                    break;
+                }
+            }
+        }
+
+        // NOTE - LRU : the triangle in front, then the previous entries, the last ones falling out of the cache
+        uint32 NewCache[ScoreCacheSize + 3];
+        int NewCount = 0;
+        for(int k = 0; k < 3; ++k)
+            NewCache[NewCount++] = Triangle[k];
+        for(int i = 0; i < CacheCount; ++i)
+        {
+            uint32 v = Cache[i];
+            if(v != Triangle[0] && v != Triangle[1] && v != Triangle[2])
+                NewCache[NewCount++] = v;
+        }
+
+        for(int i = 0; i < NewCount; ++i)
+        {
+            uint32 v = NewCache[i];
+            CachePosition[v] = i < ScoreCacheSize ? i : -1;
+            real32 NewScore = VertexScore(CachePosition[v], Remaining[v]);
+            real32 Delta = NewScore - Score[v];
+            Score[v] = NewScore;
+            for(uint32 j = 0; j < Remaining[v]; ++j)
+                TriangleScore[Adjacency[First[v] + j]] += Delta;
+        }
+        CacheCount = Min(NewCount, ScoreCacheSize);
+        memcpy(Cache, NewCache, CacheCount * sizeof(uint32));
+
+        // NOTE - Next triangle among the ones of the cached vertices, else the first one left
+        Best = -1;
+        real32 BestScore = -1.f;
+        for(int i = 0; i < CacheCount; ++i)
+        {
+            uint32 v = Cache[i];
+            for(uint32 j = 0; j < Remaining[v]; ++j)
+            {
+                uint32 t = Adjacency[First[v] + j];
+                if(TriangleScore[t] > BestScore)
+                {
+                    BestScore = TriangleScore[t];
+                    Best = t;
+                }
+            }
+        }
+        if(Best < 0)
+        {
+            while(Cursor < TriangleCount && Emitted[Cursor])
+                ++Cursor;
+            Best = Cursor;
+        }
+    }
+
+    memcpy(Indices, Output, 3 * TriangleCount * sizeof(uint32));
+}
+
+void PackTriangleList(indices *Out, rf::mem_pool *Pool, uint32 const *Indices, uint32 IndexCount, uint32 VertexCount)
+{
+    Out->Mode = GL_TRIANGLES;
+    ChooseIndexType(Out, VertexCount);
+    Out->Count = IndexCount;
+    Out->Data = rf::PoolAlloc<uint8>(Pool, IndexCount * IndexSize(Out->Type));
+    for(uint32 i = 0; i < IndexCount; ++i)
+        SetIndex(Out, i, Indices[i]);
+}
+
+real32 ComputeACMR(indices const *In, int CacheSize)
+{
+    CacheSize = Clamp(CacheSize, 1, MaxCacheSize);
+    uint32 Cache[MaxCacheSize];
+    int Filled = 0;
+    int Next = 0;
+
+    bool Strips = In->Mode == GL_TRIANGLE_STRIP;
+    uint32 Misses = 0;
+    uint32 Triangles = 0;
+    uint32 Previous[2] = {};
+    uint32 StripLength = 0;
+    for(uint32 i = 0; i < In->Count; ++i)
+    {
+        uint32 Idx = GetIndex(In, i);
+        if(Strips && Idx == In->Restart)
+        {
+            StripLength = 0;
+            continue;
+        }
+
+        bool Hit = false;
+        for(int c = 0; c < Filled && !Hit; ++c)
+            Hit = Cache[c] == Idx;
+        if(!Hit)
+        {
+            Cache[Next] = Idx;
+            Next = (Next + 1) % CacheSize;
+            Filled = Min(Filled + 1, CacheSize);
+            ++Misses;
+        }
+
+        if(Strips)
+        {
+            if(++StripLength >= 3 && Idx != Previous[0] && Idx != Previous[1] && Previous[0] != Previous[1])
+                ++Triangles;
+            Previous[1] = Previous[0];
+            Previous[0] = Idx;
+        }
+        else if(i % 3 == 2)
+        {
+            uint32 A = GetIndex(In, i - 2);
+            uint32 B = GetIndex(In, i - 1);
+            if(A != B && B != Idx && A != Idx)
+                ++Triangles;
+        }
+    }
+    return Triangles > 0 ? Misses / (real32)Triangles : 0.f;
+}
+}
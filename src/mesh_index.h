@@ -0,0 +1,56 @@
+#ifndef MESH_INDEX_H
+#define MESH_INDEX_H
+
+#include "definitions.h"
+
+// NOTE - Index buffers ordered for the post-transform vertex cache. The GPU keeps the last few transformed vertices
+// and only runs the vertex shader again for the indices that missed them, so the same triangles cost from 0.5
+// vertex each (every vertex of a grid transformed once) to 3 depending on their order alone.
+// Indices are 16-bit whenever the mesh has few enough vertices, and strips restart on the largest index value
+// (glPrimitiveRestartIndex).
+//
+// The cache is measured as ACMR, average cache miss ratio : vertices transformed per triangle with a FIFO cache of
+// CacheSize entries, see ComputeACMR.
+namespace mesh {
+    int static const DefaultCacheSize = 24;   // Entries, a conservative FIFO model of the current GPUs
+    int static const MaxCacheSize = 64;
+
+    struct indices
+    {
+        uint32 Mode;        // GL_TRIANGLES, or GL_TRIANGLE_STRIP with primitive restart
+        uint32 Type;        // GL_UNSIGNED_SHORT when every vertex fits, else GL_UNSIGNED_INT
+        uint32 Restart;     // Strips only, the largest index of Type
+        uint32 Count;
+        void *Data;         // uint16 or uint32
+    };
+
+    // Bytes of an index of Type
+    size_t IndexSize(uint32 Type);
+
+    // Index Idx of In, as uint32 whatever its type
+    uint32 GetIndex(indices const *In, uint32 Idx);
+
+    // NOTE - Grid of (Columns + 1) * (Rows + 1) vertices, vertex (x, y) being y * (Columns + 1) + x. The columns are
+    // cut in blocks of CacheSize - 2 quads, each walked row by row : the row of vertices a quad row shares with the
+    // next one is still in the cache when the next one needs it, and each vertex is transformed about once.
+    // Strips are one per quad row of a block, (x, y) (x, y+1) (x+1, y) (x+1, y+1)... Lists have the same triangles,
+    // the quad (x, y) being (x, y) (x, y+1) (x+1, y) and (x+1, y) (x, y+1) (x+1, y+1) : both vertices of the top row
+    // are used before the new one of the bottom row is loaded.
+    // Each block starts with degenerate triangles over its first row, which only load it into the cache.
+    // Allocated from Pool.
+    void BuildGridIndices(indices *Out, rf::mem_pool *Pool, int Columns, int Rows, int CacheSize, bool Strips);
+
+    // NOTE - Reorders the triangles of any indexed list in place for the cache, Tom Forsyth's linear-speed
+    // optimisation : triangles are emitted greedily, scored by how recently their vertices were used and how few
+    // triangles those still have left, so no vertex lingers until it was evicted. Scratch is only used for the call.
+    void OptimizeTriangleOrder(uint32 *Indices, uint32 IndexCount, uint32 VertexCount, rf::mem_pool *Scratch);
+
+    // NOTE - A triangle list as indices, 16-bit if VertexCount allows, allocated from Pool
+    void PackTriangleList(indices *Out, rf::mem_pool *Pool, uint32 const *Indices, uint32 IndexCount, uint32 VertexCount);
+
+    // NOTE - Vertices a FIFO cache of CacheSize entries transforms per triangle drawn, degenerate triangles not
+    // counted as drawn
+    real32 ComputeACMR(indices const *In, int CacheSize);
+}
+
+#endif
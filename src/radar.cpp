@@ -7,8 +7,11 @@
 #include "rf/ui.h"
 
 #include "definitions.h"
+#include "jobs.h"
 
 #include "Systems/water.h"
+#include "Systems/buoyancy.h"
+#include "Systems/spray.h"
 #include "Systems/atmosphere.h"
 #include "Systems/planet.h"
 #include "Game/sun.h"
@@ -90,6 +93,33 @@ bool ParseConfig(config *ConfigOut, char const *Filename)
 
 	ConfigOut->TimeScale = (real32)rf::JSON_Get(root, "fTimescale", 30.0);
 
+	ConfigOut->WorkerThreads = rf::JSON_Get(root, "iWorkerThreads", -1);
+
+	ConfigOut->WaterN = rf::JSON_Get(root, "iWaterN", 64);
+	ConfigOut->WaterFFTMode = rf::JSON_Get(root, "iWaterFFTMode", 2);
+	ConfigOut->WaterFFTPacked = rf::JSON_Get(root, "bWaterFFTPacked", 1) != 0;
+	ConfigOut->WaterSeed = rf::JSON_Get(root, "iWaterSeed", 1234);
+	ConfigOut->WaterBakeFPS = (real32)rf::JSON_Get(root, "fWaterBakeFPS", 0.0);
+	ConfigOut->WaterAsync = rf::JSON_Get(root, "bWaterAsync", 0) != 0;
+	ConfigOut->WaterSimHz = (real32)rf::JSON_Get(root, "fWaterSimHz", 60.0);
+	ConfigOut->WaterCompactVertices = rf::JSON_Get(root, "bWaterCompactVertices", 0) != 0;
+	ConfigOut->WaterCascades = rf::JSON_Get(root, "iWaterCascades", 1);
+	ConfigOut->WaterWakeN = rf::JSON_Get(root, "iWaterWakeN", 128);
+	ConfigOut->WaterWakeCellSize = (real32)rf::JSON_Get(root, "fWaterWakeCellSize", 0.5);
+	ConfigOut->WaterWakeBudgetMs = (real32)rf::JSON_Get(root, "fWaterWakeBudgetMs", 1.0);
+	ConfigOut->WaterThrottle = rf::JSON_Get(root, "bWaterThrottle", 1) != 0;
+	ConfigOut->WaterTextures = rf::JSON_Get(root, "bWaterTextures", 1) != 0;
+	ConfigOut->WaterTileRadius = rf::JSON_Get(root, "iWaterTileRadius", 0);
+	ConfigOut->WaterSlabDistance = (real32)rf::JSON_Get(root, "fWaterSlabDistance", 0.0);
+
+	ConfigOut->BuoyancyMaxBodies = rf::JSON_Get(root, "iBuoyancyMaxBodies", 1024);
+	ConfigOut->BuoyancyMaxHullPoints = rf::JSON_Get(root, "iBuoyancyMaxHullPoints", 16384);
+	ConfigOut->BuoyancyHz = (real32)rf::JSON_Get(root, "fBuoyancyHz", 60.0);
+
+	ConfigOut->SprayMaxParticles = rf::JSON_Get(root, "iSprayMaxParticles", 65536);
+	ConfigOut->SprayJacobian = (real32)rf::JSON_Get(root, "fSprayJacobian", 0.5);
+	ConfigOut->SprayRate = (real32)rf::JSON_Get(root, "fSprayRate", 8.0);
+
 	if (Content) free(Content);
 
 	return true;
@@ -115,6 +145,7 @@ void ReloadShaders(rf::context *Context)
 
 #if DO_WATER
     water::ReloadShaders(Context);
+    spray::ReloadShaders(Context);
 #endif
 #if DO_ATMOSPHERE
     atmosphere::ReloadShaders(Context);
@@ -319,12 +350,16 @@ int RadarMain(int /*argc*/, char ** /*argv*/)
         return 1;
     }
 
+    jobs::Init(Config.WorkerThreads);
+
     // Subsystems initialization
 #if DO_ATMOSPHERE
     atmosphere::Init(State, Context);
 #endif
 #if DO_WATER
-    water::Init(State, Context, State->WaterState);
+    water::Init(State, Context, &Config, State->WaterState);
+    buoyancy::Init(Context, &Config);
+    spray::Init(Context, &Config);
 #endif
 #if DO_PLANET
 	planet::Init(State, Context);
@@ -407,7 +442,10 @@ int RadarMain(int /*argc*/, char ** /*argv*/)
 #endif
 #if DO_WATER
         water::Update(State, &Input);
+        buoyancy::Update(State, &Input);
+        spray::Update(State, &Input);
         water::Render(State, 0, 0);
+        spray::Render(State);
 #endif
 #if DO_PLANET
 		planet::Render(State, Context);
@@ -450,7 +488,13 @@ int RadarMain(int /*argc*/, char ** /*argv*/)
     rf::DestroyFramebuffer(&FPBackbuffer);
     Tests::Destroy();
 
+#if DO_WATER
+    spray::Destroy();
+    buoyancy::Destroy();
+    water::Destroy();
+#endif
     game::Destroy(State);
+    jobs::Destroy();
     rf::ctx::Destroy(Context);
     DestroyMemory(Memory);
     return 0;
@@ -0,0 +1,331 @@
+#include "sfmt.h"
+
+#include <cstring>
+#if HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+// NOTE - Bit-exact variates need every float multiply and add to be rounded on its own, never fused
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+namespace sfmt {
+// NOTE - SFMT19937 parameters, from the reference implementation
+int static const POS1 = 122;
+int static const SL1 = 18;
+int static const SL2 = 1;
+int static const SR1 = 11;
+int static const SR2 = 1;
+static uint32 const Mask[4] = { 0xdfffffefU, 0xddfecb7fU, 0xbffaffffU, 0xbffffff6U };
+static uint32 const Parity[4] = { 0x00000001U, 0x00000000U, 0x00000000U, 0x13c9e684U };
+
+#if HAVE_SSE2
+static inline __m128i DoRecursion(__m128i A, __m128i B, __m128i C, __m128i D, __m128i M)
+{
+    __m128i X = _mm_slli_si128(A, SL2);
+    __m128i Y = _mm_srli_si128(C, SR2);
+    __m128i Z = _mm_and_si128(_mm_srli_epi32(B, SR1), M);
+    __m128i V = _mm_slli_epi32(D, SL1);
+    Z = _mm_xor_si128(Z, A);
+    Z = _mm_xor_si128(Z, X);
+    Z = _mm_xor_si128(Z, Y);
+    return _mm_xor_si128(Z, V);
+}
+
+static void GenerateAll(state *S)
+{
+    __m128i *W = (__m128i*)S->W;
+    __m128i M = _mm_set_epi32((int)Mask[3], (int)Mask[2], (int)Mask[1], (int)Mask[0]);
+    __m128i R1 = _mm_loadu_si128(W + StateSize - 2);
+    __m128i R2 = _mm_loadu_si128(W + StateSize - 1);
+
+    int i = 0;
+    for(; i < StateSize - POS1; ++i)
+    {
+        __m128i R = DoRecursion(_mm_loadu_si128(W + i), _mm_loadu_si128(W + i + POS1), R1, R2, M);
+        _mm_storeu_si128(W + i, R);
+        R1 = R2;
+        R2 = R;
+    }
+    for(; i < StateSize; ++i)
+    {
+        __m128i R = DoRecursion(_mm_loadu_si128(W + i), _mm_loadu_si128(W + i + POS1 - StateSize), R1, R2, M);
+        _mm_storeu_si128(W + i, R);
+        R1 = R2;
+        R2 = R;
+    }
+}
+#else
+// NOTE - 128-bit shifts by whole bytes, on little-endian uint32[4]
+static void LShift128(uint32 *Out, uint32 const *In, int Shift)
+{
+    uint64 TH = ((uint64)In[3] << 32) | In[2];
+    uint64 TL = ((uint64)In[1] << 32) | In[0];
+    uint64 OH = (TH << (Shift * 8)) | (TL >> (64 - Shift * 8));
+    uint64 OL = TL << (Shift * 8);
+    Out[0] = (uint32)OL;
+    Out[1] = (uint32)(OL >> 32);
+    Out[2] = (uint32)OH;
+    Out[3] = (uint32)(OH >> 32);
+}
+
+static void RShift128(uint32 *Out, uint32 const *In, int Shift)
+{
+    uint64 TH = ((uint64)In[3] << 32) | In[2];
+    uint64 TL = ((uint64)In[1] << 32) | In[0];
+    uint64 OH = TH >> (Shift * 8);
+    uint64 OL = (TL >> (Shift * 8)) | (TH << (64 - Shift * 8));
+    Out[0] = (uint32)OL;
+    Out[1] = (uint32)(OL >> 32);
+    Out[2] = (uint32)OH;
+    Out[3] = (uint32)(OH >> 32);
+}
+
+static void DoRecursion(uint32 *R, uint32 const *A, uint32 const *B, uint32 const *C, uint32 const *D)
+{
+    uint32 X[4], Y[4];
+    LShift128(X, A, SL2);
+    RShift128(Y, C, SR2);
+    for(int j = 0; j < 4; ++j)
+    {
+        R[j] = A[j] ^ X[j] ^ ((B[j] >> SR1) & Mask[j]) ^ Y[j] ^ (D[j] << SL1);
+    }
+}
+
+static void GenerateAll(state *S)
+{
+    uint32 *W = S->W;
+    uint32 *R1 = W + 4 * (StateSize - 2);
+    uint32 *R2 = W + 4 * (StateSize - 1);
+
+    int i = 0;
+    for(; i < StateSize - POS1; ++i)
+    {
+        DoRecursion(W + 4 * i, W + 4 * i, W + 4 * (i + POS1), R1, R2);
+        R1 = R2;
+        R2 = W + 4 * i;
+    }
+    for(; i < StateSize; ++i)
+    {
+        DoRecursion(W + 4 * i, W + 4 * i, W + 4 * (i + POS1 - StateSize), R1, R2);
+        R1 = R2;
+        R2 = W + 4 * i;
+    }
+}
+#endif
+
+static void CertifyPeriod(state *S)
+{
+    uint32 Inner = 0;
+    for(int i = 0; i < 4; ++i)
+        Inner ^= S->W[i] & Parity[i];
+    for(int i = 16; i > 0; i >>= 1)
+        Inner ^= Inner >> i;
+    if(Inner & 1)
+        return;
+
+    // NOTE - Not a full period state, flip one parity bit to fix it
+    for(int i = 0; i < 4; ++i)
+    {
+        uint32 Work = 1;
+        for(int j = 0; j < 32; ++j)
+        {
+            if(Work & Parity[i])
+            {
+                S->W[i] ^= Work;
+                return;
+            }
+            Work <<= 1;
+        }
+    }
+}
+
+void Init(state *S, uint32 Seed)
+{
+    S->W[0] = Seed;
+    for(int i = 1; i < StateSize32; ++i)
+    {
+        S->W[i] = 1812433253U * (S->W[i-1] ^ (S->W[i-1] >> 30)) + i;
+    }
+    S->Idx = StateSize32;
+    CertifyPeriod(S);
+}
+
+uint32 Next32(state *S)
+{
+    if(S->Idx >= StateSize32)
+    {
+        GenerateAll(S);
+        S->Idx = 0;
+    }
+    return S->W[S->Idx++];
+}
+
+// NOTE - Box-Muller on 4 pairs of uniforms, from the 8 uint32 of Words : 4 for the radii, 4 for the angles.
+// Out receives the 4 cosine variates then the 4 sine variates.
+// The log and sincos are polynomial (Cephes) so that the result doesn't depend on the platform's libm, and
+// the scalar version performs exactly the same float operations as the SSE2 one.
+static real32 const InvTwo24 = 1.f / 16777216.f;
+static real32 const SqrtHalf = 0.707106781186547524f;
+static real32 const LogP[9] = { 7.0376836292E-2f, -1.1514610310E-1f, 1.1676998740E-1f, -1.2420140846E-1f, 1.4249322787E-1f,
+                                -1.6668057665E-1f, 2.0000714765E-1f, -2.4999993993E-1f, 3.3333331174E-1f };
+static real32 const LogQ1 = -2.12194440e-4f;
+static real32 const LogQ2 = 0.693359375f;
+static real32 const PiOver2 = 1.57079632679489661923f;
+static real32 const SinP[3] = { -1.9515295891E-4f, 8.3321608736E-3f, -1.6666654611E-1f };
+static real32 const CosP[3] = { 2.443315711809948E-005f, -1.388731625493765E-003f, 4.166664568298827E-002f };
+
+#if HAVE_SSE2
+static void BoxMuller4(uint32 const *Words, real32 *Out)
+{
+    __m128 One = _mm_set1_ps(1.f);
+    __m128i WR = _mm_loadu_si128((__m128i const*)Words);
+    __m128i WA = _mm_loadu_si128((__m128i const*)(Words + 4));
+
+    // Radius uniform in (0, 1], angle uniform in [0, 1)
+    __m128 U1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(_mm_srli_epi32(WR, 8), _mm_set1_epi32(1))), _mm_set1_ps(InvTwo24));
+    __m128 U2 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(WA, 8)), _mm_set1_ps(InvTwo24));
+
+    // log(U1)
+    __m128 X = U1;
+    __m128i Exp = _mm_sub_epi32(_mm_srli_epi32(_mm_castps_si128(X), 23), _mm_set1_epi32(0x7f));
+    X = _mm_and_ps(X, _mm_castsi128_ps(_mm_set1_epi32(~0x7f800000)));
+    X = _mm_or_ps(X, _mm_set1_ps(0.5f));
+    __m128 E = _mm_add_ps(_mm_cvtepi32_ps(Exp), One);
+    __m128 LtMask = _mm_cmplt_ps(X, _mm_set1_ps(SqrtHalf));
+    __m128 Tmp = _mm_and_ps(X, LtMask);
+    X = _mm_sub_ps(X, One);
+    E = _mm_sub_ps(E, _mm_and_ps(One, LtMask));
+    X = _mm_add_ps(X, Tmp);
+    __m128 Z = _mm_mul_ps(X, X);
+    __m128 Y = _mm_set1_ps(LogP[0]);
+    for(int i = 1; i < 9; ++i)
+        Y = _mm_add_ps(_mm_mul_ps(Y, X), _mm_set1_ps(LogP[i]));
+    Y = _mm_mul_ps(Y, X);
+    Y = _mm_mul_ps(Y, Z);
+    Y = _mm_add_ps(Y, _mm_mul_ps(E, _mm_set1_ps(LogQ1)));
+    Y = _mm_sub_ps(Y, _mm_mul_ps(Z, _mm_set1_ps(0.5f)));
+    X = _mm_add_ps(X, Y);
+    X = _mm_add_ps(X, _mm_mul_ps(E, _mm_set1_ps(LogQ2)));
+    __m128 R = _mm_sqrt_ps(_mm_mul_ps(X, _mm_set1_ps(-2.f)));
+
+    // sincos(2.pi.U2), reduced to [-pi/4, pi/4) around the closest quadrant
+    __m128 Q4 = _mm_mul_ps(U2, _mm_set1_ps(4.f));
+    __m128i Quadrant = _mm_cvttps_epi32(_mm_add_ps(Q4, _mm_set1_ps(0.5f)));
+    __m128 Theta = _mm_mul_ps(_mm_sub_ps(Q4, _mm_cvtepi32_ps(Quadrant)), _mm_set1_ps(PiOver2));
+    Z = _mm_mul_ps(Theta, Theta);
+    __m128 S = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(SinP[0]), Z), _mm_set1_ps(SinP[1])), Z), _mm_set1_ps(SinP[2]));
+    S = _mm_mul_ps(S, Z);
+    S = _mm_mul_ps(S, Theta);
+    S = _mm_add_ps(S, Theta);
+    __m128 C = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(CosP[0]), Z), _mm_set1_ps(CosP[1])), Z), _mm_set1_ps(CosP[2]));
+    C = _mm_mul_ps(C, Z);
+    C = _mm_mul_ps(C, Z);
+    C = _mm_sub_ps(C, _mm_mul_ps(Z, _mm_set1_ps(0.5f)));
+    C = _mm_add_ps(C, One);
+
+    __m128i Bit0 = _mm_and_si128(Quadrant, _mm_set1_epi32(1));
+    __m128i Bit1 = _mm_srli_epi32(_mm_and_si128(Quadrant, _mm_set1_epi32(2)), 1);
+    __m128 Swap = _mm_castsi128_ps(_mm_cmpeq_epi32(Bit0, _mm_set1_epi32(1)));
+    __m128 SinSign = _mm_castsi128_ps(_mm_slli_epi32(Bit1, 31));
+    __m128 CosSign = _mm_castsi128_ps(_mm_slli_epi32(_mm_xor_si128(Bit0, Bit1), 31));
+    __m128 Sin = _mm_or_ps(_mm_and_ps(Swap, C), _mm_andnot_ps(Swap, S));
+    __m128 Cos = _mm_or_ps(_mm_and_ps(Swap, S), _mm_andnot_ps(Swap, C));
+    Sin = _mm_xor_ps(Sin, SinSign);
+    Cos = _mm_xor_ps(Cos, CosSign);
+
+    _mm_storeu_ps(Out, _mm_mul_ps(R, Cos));
+    _mm_storeu_ps(Out + 4, _mm_mul_ps(R, Sin));
+}
+#else
+static void BoxMuller4(uint32 const *Words, real32 *Out)
+{
+    for(int l = 0; l < 4; ++l)
+    {
+        real32 U1 = (real32)(int32)((Words[l] >> 8) + 1) * InvTwo24;
+        real32 U2 = (real32)(int32)(Words[4 + l] >> 8) * InvTwo24;
+
+        // log(U1)
+        real32 X = U1;
+        uint32 Bits;
+        memcpy(&Bits, &X, sizeof(Bits));
+        real32 E = (real32)((int32)(Bits >> 23) - 0x7f) + 1.f;
+        Bits = (Bits & ~0x7f800000U) | 0x3f000000U;
+        memcpy(&X, &Bits, sizeof(Bits));
+        bool Lt = X < SqrtHalf;
+        real32 Tmp = Lt ? X : 0.f;
+        X = X - 1.f;
+        E = E - (Lt ? 1.f : 0.f);
+        X = X + Tmp;
+        real32 Z = X * X;
+        real32 Y = LogP[0];
+        for(int i = 1; i < 9; ++i)
+            Y = Y * X + LogP[i];
+        Y = Y * X;
+        Y = Y * Z;
+        Y = Y + E * LogQ1;
+        Y = Y - Z * 0.5f;
+        X = X + Y;
+        X = X + E * LogQ2;
+        real32 R = sqrtf(X * -2.f);
+
+        // sincos(2.pi.U2)
+        real32 Q4 = U2 * 4.f;
+        int32 Quadrant = (int32)(Q4 + 0.5f);
+        real32 Theta = (Q4 - (real32)Quadrant) * PiOver2;
+        Z = Theta * Theta;
+        real32 S = (SinP[0] * Z + SinP[1]) * Z + SinP[2];
+        S = S * Z;
+        S = S * Theta;
+        S = S + Theta;
+        real32 C = (CosP[0] * Z + CosP[1]) * Z + CosP[2];
+        C = C * Z;
+        C = C * Z;
+        C = C - Z * 0.5f;
+        C = C + 1.f;
+
+        bool Bit0 = (Quadrant & 1) != 0;
+        bool Bit1 = (Quadrant & 2) != 0;
+        real32 Sin = Bit0 ? C : S;
+        real32 Cos = Bit0 ? S : C;
+        if(Bit1) Sin = -Sin;
+        if(Bit0 != Bit1) Cos = -Cos;
+
+        Out[l] = R * Cos;
+        Out[4 + l] = R * Sin;
+    }
+}
+#endif
+
+void FillNormal(state *S, real32 *Out, int Count)
+{
+    // NOTE - Batches take 8 aligned words, StateSize32 being a multiple of 8 they never straddle a generation
+    S->Idx = (S->Idx + 7) & ~7;
+
+    for(int i = 0; i < Count; i += 8)
+    {
+        if(S->Idx >= StateSize32)
+        {
+            GenerateAll(S);
+            S->Idx = 0;
+        }
+
+        if(Count - i >= 8)
+        {
+            BoxMuller4(S->W + S->Idx, Out + i);
+        }
+        else
+        {
+            real32 Tail[8];
+            BoxMuller4(S->W + S->Idx, Tail);
+            memcpy(Out + i, Tail, (Count - i) * sizeof(real32));
+        }
+        S->Idx += 8;
+    }
+}
+}
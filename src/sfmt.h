@@ -0,0 +1,27 @@
+#ifndef SFMT_H
+#define SFMT_H
+
+#include "definitions.h"
+
+// NOTE - SFMT19937, SIMD-oriented Fast Mersenne Twister (Saito & Matsumoto).
+// Every generator is fully determined by its seed : the same seed gives the same uint32 stream and the
+// same normal variates, bit for bit, with or without SSE2.
+namespace sfmt {
+    int static const StateSize = 156;       // In 128-bit words
+    int static const StateSize32 = 4 * StateSize;
+
+    struct state
+    {
+        uint32 W[StateSize32];
+        int Idx;            // Next unused uint32 of W
+    };
+
+    void Init(state *S, uint32 Seed);
+
+    uint32 Next32(state *S);
+
+    // Standard normal variates, Box-Muller on batches of 4 pairs
+    void FillNormal(state *S, real32 *Out, int Count);
+}
+
+#endif
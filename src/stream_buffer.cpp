@@ -0,0 +1,169 @@
+#include "stream_buffer.h"
+#include "rf/context.h"
+
+namespace stream {
+static bool HasBufferStorage()
+{
+    int32 Major = 0, Minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &Major);
+    glGetIntegerv(GL_MINOR_VERSION, &Minor);
+    if(Major > 4 || (Major == 4 && Minor >= 4))
+        return true;
+
+    int32 ExtensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &ExtensionCount);
+    for(int i = 0; i < ExtensionCount; ++i)
+    {
+        char const *Extension = (char const*)glGetStringi(GL_EXTENSIONS, i);
+        if(Extension && strcmp(Extension, "GL_ARB_buffer_storage") == 0)
+            return true;
+    }
+    return false;
+}
+
+// NOTE - Blocks until the GPU is done with the draws fenced on Slot
+static void WaitSlot(buffer *Buffer, int Slot)
+{
+    GLsync Sync = (GLsync)Buffer->Fences[Slot];
+    if(!Sync)
+        return;
+
+    GLbitfield Flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+    for(;;)
+    {
+        GLenum Status = glClientWaitSync(Sync, Flags, 1000000); // 1ms
+        if(Status == GL_ALREADY_SIGNALED || Status == GL_CONDITION_SATISFIED || Status == GL_WAIT_FAILED)
+        {
+            if(Status == GL_WAIT_FAILED)
+                LogError("Stream buffer fence wait failed.");
+            break;
+        }
+        Flags = 0; // Flushed once is enough
+    }
+    glDeleteSync(Sync);
+    Buffer->Fences[Slot] = NULL;
+}
+
+void Init(buffer *Buffer, size_t SlotSize)
+{
+    memset(Buffer, 0, sizeof(*Buffer));
+    Buffer->SlotSize = (SlotSize + SlotAlignment - 1) & ~(SlotAlignment - 1);
+    Buffer->Slot = SlotCount - 1; // The first Map goes to slot 0
+    size_t Size = SlotCount * Buffer->SlotSize;
+
+    glGenBuffers(1, &Buffer->VBO);
+    glBindBuffer(GL_ARRAY_BUFFER, Buffer->VBO);
+    if(HasBufferStorage())
+    {
+        GLbitfield Flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glBufferStorage(GL_ARRAY_BUFFER, Size, NULL, Flags);
+        Buffer->Mapped = (uint8*)glMapBufferRange(GL_ARRAY_BUFFER, 0, Size, Flags);
+        Buffer->Persistent = Buffer->Mapped != NULL;
+        if(!Buffer->Persistent)
+        {
+            // NOTE - Immutable storage can't be respecified, start over with a mutable buffer
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glDeleteBuffers(1, &Buffer->VBO);
+            glGenBuffers(1, &Buffer->VBO);
+            glBindBuffer(GL_ARRAY_BUFFER, Buffer->VBO);
+        }
+    }
+    if(!Buffer->Persistent)
+    {
+        glBufferData(GL_ARRAY_BUFFER, Size, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    LogInfo("Stream buffer : %d x %.1f kB, %s", SlotCount, Buffer->SlotSize / 1024.f,
+            Buffer->Persistent ? "persistent mapping" : "unsynchronized mapping");
+}
+
+void Destroy(buffer *Buffer)
+{
+    for(int i = 0; i < SlotCount; ++i)
+    {
+        if(Buffer->Fences[i])
+            glDeleteSync((GLsync)Buffer->Fences[i]);
+        Buffer->Fences[i] = NULL;
+    }
+
+    if(Buffer->Persistent)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, Buffer->VBO);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    glDeleteBuffers(1, &Buffer->VBO);
+    Buffer->VBO = 0;
+    Buffer->Mapped = NULL;
+}
+
+void *Map(buffer *Buffer)
+{
+    Buffer->Slot = (Buffer->Slot + 1) % SlotCount;
+    WaitSlot(Buffer, Buffer->Slot);
+
+    if(Buffer->Persistent)
+        return Buffer->Mapped + Offset(Buffer);
+
+    glBindBuffer(GL_ARRAY_BUFFER, Buffer->VBO);
+    GLbitfield Flags = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT;
+    Buffer->Mapped = (uint8*)glMapBufferRange(GL_ARRAY_BUFFER, Offset(Buffer), Buffer->SlotSize, Flags);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    return Buffer->Mapped;
+}
+
+void Unmap(buffer *Buffer)
+{
+    // NOTE - Coherent persistent writes are visible to the GPU for any command issued after them
+    if(Buffer->Persistent || !Buffer->Mapped)
+        return;
+
+    glBindBuffer(GL_ARRAY_BUFFER, Buffer->VBO);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    Buffer->Mapped = NULL;
+}
+
+void Write(buffer *Buffer, void const *Data, size_t Size)
+{
+    Assert(Size <= Buffer->SlotSize);
+    if(Buffer->Persistent)
+    {
+        memcpy(Buffer->Mapped + Offset(Buffer), Data, Size);
+        return;
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, Buffer->VBO);
+    glBufferSubData(GL_ARRAY_BUFFER, Offset(Buffer), Size, Data);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void Upload(buffer *Buffer, void const *Data, size_t Size)
+{
+    Assert(Size <= Buffer->SlotSize);
+    void *Dst = Map(Buffer);
+    if(Dst)
+    {
+        memcpy(Dst, Data, Size);
+        Unmap(Buffer);
+    }
+    else
+    {
+        Write(Buffer, Data, Size);
+    }
+}
+
+size_t Offset(buffer const *Buffer)
+{
+    return Buffer->Slot * Buffer->SlotSize;
+}
+
+void Fence(buffer *Buffer)
+{
+    // NOTE - Several fences on the same slot in a frame, only the last one matters
+    if(Buffer->Fences[Buffer->Slot])
+        glDeleteSync((GLsync)Buffer->Fences[Buffer->Slot]);
+    Buffer->Fences[Buffer->Slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+}
@@ -0,0 +1,51 @@
+#ifndef STREAM_BUFFER_H
+#define STREAM_BUFFER_H
+
+#include "definitions.h"
+
+// NOTE - Ring buffer for geometry rewritten every frame. The buffer holds SlotCount slots, each frame writes
+// the next one while the GPU may still read the previous ones, and a fence put after the last draw reading a
+// slot guards it until the ring comes back to it. With GL_ARB_buffer_storage (or GL 4.4) the whole buffer is
+// mapped once, persistent and coherent, and Map is pointer arithmetic. Otherwise each slot is mapped
+// unsynchronized, the fences doing the synchronisation the driver is told to skip.
+//
+// Per frame :
+//   void *Dst = stream::Map(&Buffer);      // Next slot, waits if the GPU still reads it
+//   if(Dst) { write SlotSize bytes at most; stream::Unmap(&Buffer); }
+//   else    { stream::Write(&Buffer, Data, Size); }
+//   point the vertex attributes at stream::Offset(&Buffer), draw
+//   stream::Fence(&Buffer);                // After the last draw reading the slot
+namespace stream {
+    int static const SlotCount = 3;
+    size_t static const SlotAlignment = 256; // Enough for attribute and uniform buffer offsets
+
+    struct buffer
+    {
+        uint32 VBO;
+        size_t SlotSize;
+        int Slot;               // Slot of the current frame
+        bool Persistent;
+        uint8 *Mapped;          // Persistent : the whole buffer. Else : current slot between Map and Unmap.
+        void *Fences[SlotCount]; // GLsync, NULL when the slot has no pending reads
+    };
+
+    void Init(buffer *Buffer, size_t SlotSize);
+    void Destroy(buffer *Buffer);
+
+    // Moves to the next slot and returns where to write it, NULL if the driver failed to map it.
+    void *Map(buffer *Buffer);
+    void Unmap(buffer *Buffer);
+
+    // Copy into the current slot, for when Map failed
+    void Write(buffer *Buffer, void const *Data, size_t Size);
+
+    // Map, copy and Unmap
+    void Upload(buffer *Buffer, void const *Data, size_t Size);
+
+    // Byte offset of the current slot in VBO
+    size_t Offset(buffer const *Buffer);
+
+    void Fence(buffer *Buffer);
+}
+
+#endif
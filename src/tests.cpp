@@ -2,6 +2,7 @@
 
 #include "rf/utils.h"
 #include "rf/context.h"
+#include "mesh_index.h"
 
 namespace Tests
 {
@@ -85,6 +86,38 @@ void ReloadShaders(rf::context *Context)
     rf::ctx::RegisterShader3D(Context, ProgramSkybox);
 }
 
+// NOTE - The indices of a generated triangle mesh, read back from its IBO and uploaded again ordered for the
+// vertex cache, 16-bit when its vertices allow
+void OptimizeMeshIndices(rf::context *Context, rf::mesh *Mesh, char const *Name)
+{
+    mesh::indices Before = {};
+    Before.Mode = GL_TRIANGLES;
+    Before.Type = Mesh->IndexType;
+    Before.Count = Mesh->IndexCount;
+    Before.Data = rf::PoolAlloc<uint8>(Context->ScratchPool, Before.Count * mesh::IndexSize(Before.Type));
+    glBindVertexArray(Mesh->VAO);
+    glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0, Before.Count * mesh::IndexSize(Before.Type), Before.Data);
+
+    uint32 *Indices = rf::PoolAlloc<uint32>(Context->ScratchPool, Before.Count);
+    uint32 VertexCount = 0;
+    for(uint32 i = 0; i < Before.Count; ++i)
+    {
+        Indices[i] = mesh::GetIndex(&Before, i);
+        VertexCount = Max(VertexCount, Indices[i] + 1);
+    }
+    mesh::OptimizeTriangleOrder(Indices, Before.Count, VertexCount, Context->ScratchPool);
+
+    mesh::indices After;
+    mesh::PackTriangleList(&After, Context->ScratchPool, Indices, Before.Count, VertexCount);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, After.Count * mesh::IndexSize(After.Type), After.Data, GL_STATIC_DRAW);
+    glBindVertexArray(0);
+    Mesh->IndexType = After.Type;
+
+    LogInfo("%s : %u indices, ACMR %.2f -> %.2f, %d-bit", Name, After.Count,
+            mesh::ComputeACMR(&Before, mesh::DefaultCacheSize), mesh::ComputeACMR(&After, mesh::DefaultCacheSize),
+            (int)(8 * mesh::IndexSize(After.Type)));
+}
+
 bool Init(rf::context *Context, config const * Config)
 {
     GGXLUT = rf::PrecomputeGGXLUT(Context, 512);
@@ -92,6 +125,7 @@ bool Init(rf::context *Context, config const * Config)
                                 &HDRCubemapEnvmap, &HDRGlossyEnvmap, &HDRIrradianceEnvmap);
 
     Sphere = rf::MakeUnitSphere(true, 3);
+    OptimizeMeshIndices(Context, &Sphere, "Unit sphere");
     Cube = rf::MakeUnitCube();
     SkyboxCube = rf::MakeUnitCube(false);
 
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs the stream ring buffer test headless under Mesa's llvmpipe, through both mapping paths.
+# Build it first : premake5 gmake && make -C <build dir> stream_buffer_test
+# Usage : tests/run_stream_buffer_test.sh [path/to/stream_buffer_test]
+
+TEST=${1:-"$(dirname "$0")/../bin/stream_buffer_test"}
+if [ ! -x "$TEST" ]; then
+    echo "$TEST not found, build the stream_buffer_test project first."
+    exit 1
+fi
+
+export LIBGL_ALWAYS_SOFTWARE=1
+export GALLIUM_DRIVER=llvmpipe
+export EGL_PLATFORM=surfaceless
+
+STATUS=0
+
+# Mesa has GL 4.5 and GL_ARB_buffer_storage : one persistent coherent mapping
+"$TEST" persistent || STATUS=1
+
+# GL 4.3 without GL_ARB_buffer_storage : each slot mapped unsynchronized
+MESA_GL_VERSION_OVERRIDE=4.3 MESA_EXTENSION_OVERRIDE=-GL_ARB_buffer_storage "$TEST" unsynchronized || STATUS=1
+
+exit $STATUS
@@ -0,0 +1,238 @@
+#include "definitions.h"
+#include "stream_buffer.h"
+#include "rf/context.h"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// NOTE - Headless check of the stream ring buffer, run under Mesa's software rasteriser by
+// run_stream_buffer_test.sh : once as the driver comes (persistent mapping) and once with GL_ARB_buffer_storage
+// hidden (unsynchronized mapping). Each frame fills the next slot with a pattern unique to the frame, through
+// Map, Upload or Write in turn, and has the GPU copy the slot away before fencing it, the way a draw would read it.
+// When the ring comes back to a slot, the copy made from it SlotCount frames ago is read back and checked : a
+// write that didn't wait for the fence would show up as the newer frame's pattern.
+//
+// Usage : stream_buffer_test persistent|unsynchronized
+
+static int const FrameCount = 8 * stream::SlotCount + 1;   // Several fence wrap-arounds, ending mid-ring
+static size_t const RequestedSlotSize = 1000;                // Rounded up to SlotAlignment by Init
+
+static int ErrorCount = 0;
+
+#define Check(Cond, ...) do { if(!(Cond)) { LogError(__VA_ARGS__); ++ErrorCount; } } while(0)
+
+static uint32 PatternWord(int Frame, size_t Word)
+{
+    return ((uint32)(Frame + 1) << 20) | (uint32)Word;
+}
+
+static void FillPattern(uint32 *Dst, size_t WordCount, int Frame)
+{
+    for(size_t i = 0; i < WordCount; ++i)
+        Dst[i] = PatternWord(Frame, i);
+}
+
+static void CheckGL(char const *Where, int Frame)
+{
+    GLenum Error = glGetError();
+    Check(Error == GL_NO_ERROR, "Frame %d, %s : GL error 0x%x", Frame, Where, Error);
+}
+
+// NOTE - Reads back what the GPU copied out of slot Slot when Frame wrote it
+static void CheckReadback(uint32 Readback, uint32 *Words, size_t WordCount, int Slot, int Frame)
+{
+    size_t SlotBytes = WordCount * sizeof(uint32);
+    glBindBuffer(GL_COPY_READ_BUFFER, Readback);
+    glGetBufferSubData(GL_COPY_READ_BUFFER, Slot * SlotBytes, SlotBytes, Words);
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    CheckGL("readback", Frame);
+
+    int Mismatches = 0;
+    for(size_t i = 0; i < WordCount; ++i)
+    {
+        if(Words[i] != PatternWord(Frame, i))
+        {
+            if(Mismatches == 0)
+                LogError("Frame %d, slot %d : word %u is 0x%08x, expected 0x%08x", Frame, Slot, (uint32)i, Words[i],
+                         PatternWord(Frame, i));
+            ++Mismatches;
+        }
+    }
+    Check(Mismatches == 0, "Frame %d, slot %d : %d/%u words differ", Frame, Slot, Mismatches, (uint32)WordCount);
+}
+
+static EGLContext CreateHeadlessContext(EGLDisplay *Display)
+{
+    PFNEGLGETPLATFORMDISPLAYEXTPROC GetPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(!GetPlatformDisplay)
+    {
+        LogError("EGL_EXT_platform_base not supported.");
+        return EGL_NO_CONTEXT;
+    }
+
+    *Display = GetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    EGLint Major, Minor;
+    if(*Display == EGL_NO_DISPLAY || !eglInitialize(*Display, &Major, &Minor))
+    {
+        LogError("Can't initialize a surfaceless EGL display (EGL_MESA_platform_surfaceless).");
+        return EGL_NO_CONTEXT;
+    }
+    LogInfo("EGL %d.%d, %s", Major, Minor, eglQueryString(*Display, EGL_VENDOR));
+
+    if(!eglBindAPI(EGL_OPENGL_API))
+    {
+        LogError("Can't bind the desktop OpenGL API.");
+        return EGL_NO_CONTEXT;
+    }
+
+    // NOTE - Like the window context : core profile. Mesa gives the highest version it has, capped by
+    // MESA_GL_VERSION_OVERRIDE.
+    EGLint const Attribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext Context = eglCreateContext(*Display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, Attribs);
+    if(Context == EGL_NO_CONTEXT || !eglMakeCurrent(*Display, EGL_NO_SURFACE, EGL_NO_SURFACE, Context))
+    {
+        LogError("Can't make a surfaceless GL context current (0x%x).", eglGetError());
+        return EGL_NO_CONTEXT;
+    }
+    return Context;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 2 || (strcmp(argv[1], "persistent") != 0 && strcmp(argv[1], "unsynchronized") != 0))
+    {
+        LogError("Usage : %s persistent|unsynchronized", argv[0]);
+        return 2;
+    }
+    bool ExpectPersistent = strcmp(argv[1], "persistent") == 0;
+
+    EGLDisplay Display = EGL_NO_DISPLAY;
+    EGLContext Context = CreateHeadlessContext(&Display);
+    if(Context == EGL_NO_CONTEXT)
+        return 1;
+
+    // NOTE - GLEW loads through GLX, whose entry points reach the current EGL context too with libglvnd. Only
+    // the GLX extensions fail to load, there is no X display.
+    glewExperimental = GL_TRUE;
+    GLenum GlewError = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if(GlewError == GLEW_ERROR_NO_GLX_DISPLAY)
+        GlewError = GLEW_OK;
+#endif
+    if(GlewError != GLEW_OK)
+    {
+        LogError("Can't initialize GLEW : %s", (char const*)glewGetErrorString(GlewError));
+        return 1;
+    }
+    glGetError(); // GLEW's extension probing on a core context
+
+    LogInfo("%s, %s", (char const*)glGetString(GL_RENDERER), (char const*)glGetString(GL_VERSION));
+
+    stream::buffer Buffer;
+    stream::Init(&Buffer, RequestedSlotSize);
+    CheckGL("Init", -1);
+    Check(Buffer.Persistent == ExpectPersistent, "Expected %s mapping, got %s", argv[1],
+          Buffer.Persistent ? "persistent" : "unsynchronized");
+    Check(Buffer.SlotSize % stream::SlotAlignment == 0 && Buffer.SlotSize >= RequestedSlotSize,
+          "Slot size %u for %u requested", (uint32)Buffer.SlotSize, (uint32)RequestedSlotSize);
+
+    size_t SlotSize = Buffer.SlotSize;
+    size_t WordCount = SlotSize / sizeof(uint32);
+    uint32 *Pattern = (uint32*)malloc(SlotSize);
+    uint32 *Words = (uint32*)malloc(SlotSize);
+
+    // NOTE - One region per slot, stands for the draws reading the slot
+    uint32 Readback;
+    glGenBuffers(1, &Readback);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, Readback);
+    glBufferData(GL_COPY_WRITE_BUFFER, stream::SlotCount * SlotSize, NULL, GL_STREAM_READ);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    int SlotFrame[stream::SlotCount];   // Frame whose copy of the slot is pending in Readback, -1 for none
+    for(int i = 0; i < stream::SlotCount; ++i)
+        SlotFrame[i] = -1;
+
+    for(int Frame = 0; Frame < FrameCount; ++Frame)
+    {
+        int Slot = Frame % stream::SlotCount;
+        FillPattern(Pattern, WordCount, Frame);
+
+        // NOTE - The three ways of filling a slot, in turn so that each one meets every slot
+        int Method = (Frame / stream::SlotCount) % 3;
+        if(Method == 0)
+        {
+            void *Dst = stream::Map(&Buffer);
+            Check(Dst != NULL, "Frame %d : Map failed", Frame);
+            if(Dst)
+            {
+                memcpy(Dst, Pattern, SlotSize);
+                stream::Unmap(&Buffer);
+            }
+        }
+        else if(Method == 1)
+        {
+            stream::Upload(&Buffer, Pattern, SlotSize);
+        }
+        else
+        {
+            // Map failure path : move to the next slot, then copy without a mapping
+            if(stream::Map(&Buffer))
+                stream::Unmap(&Buffer);
+            stream::Write(&Buffer, Pattern, SlotSize);
+        }
+        CheckGL("fill", Frame);
+
+        Check(Buffer.Slot == Slot, "Frame %d : slot %d, expected %d", Frame, Buffer.Slot, Slot);
+        Check(stream::Offset(&Buffer) == Slot * SlotSize, "Frame %d : offset %u, expected %u", Frame,
+              (uint32)stream::Offset(&Buffer), (uint32)(Slot * SlotSize));
+        Check(Buffer.Fences[Slot] == NULL, "Frame %d : slot %d fence still pending after Map", Frame, Slot);
+
+        // NOTE - The previous use of the slot was waited on by Map, its copy must hold that frame's pattern and
+        // not the one just written
+        if(SlotFrame[Slot] >= 0)
+            CheckReadback(Readback, Words, WordCount, Slot, SlotFrame[Slot]);
+
+        glBindBuffer(GL_COPY_READ_BUFFER, Buffer.VBO);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, Readback);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, stream::Offset(&Buffer), Slot * SlotSize,
+                            SlotSize);
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        stream::Fence(&Buffer);
+        CheckGL("copy", Frame);
+        Check(Buffer.Fences[Slot] != NULL, "Frame %d : no fence on slot %d", Frame, Slot);
+
+        SlotFrame[Slot] = Frame;
+    }
+
+    // NOTE - The last frames of the ring never came around again
+    for(int Slot = 0; Slot < stream::SlotCount; ++Slot)
+    {
+        if(SlotFrame[Slot] >= 0)
+            CheckReadback(Readback, Words, WordCount, Slot, SlotFrame[Slot]);
+    }
+
+    stream::Destroy(&Buffer);
+    glDeleteBuffers(1, &Readback);
+    CheckGL("Destroy", FrameCount);
+
+    free(Pattern);
+    free(Words);
+    eglMakeCurrent(Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(Display, Context);
+    eglTerminate(Display);
+
+    if(ErrorCount > 0)
+    {
+        LogError("stream_buffer_test %s : FAILED, %d errors", argv[1], ErrorCount);
+        return 1;
+    }
+    LogInfo("stream_buffer_test %s : %d frames over %d slots OK", argv[1], FrameCount, stream::SlotCount);
+    return 0;
+}